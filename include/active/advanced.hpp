@@ -135,13 +135,18 @@ namespace active
 					}
 				}
 
-				typename allocator_type::template rebind<fn_impl<Fn> >::other realloc(m_allocator);
+				typedef typename allocator_type::template rebind<fn_impl<Fn> >::other realloc_type;
+				realloc_type realloc(m_allocator);
 
 				fn_impl<Fn> * impl = realloc.allocate(1);
 
 				try
 				{
-					realloc.construct(impl, fn_impl<Fn>(platform::forward<RVALUE_REF(Fn)>(fn), priority, m_sequence++)  );
+#ifdef ACTIVE_USE_CXX11
+					std::allocator_traits<realloc_type>::construct(realloc, impl, platform::forward<RVALUE_REF(Fn)>(fn), priority, m_sequence++);
+#else
+					realloc.construct(impl, fn_impl<Fn>(fn, priority, m_sequence++)  );
+#endif
 				}
 				catch(...)
 				{
@@ -284,6 +289,9 @@ namespace active
 		protected:
 			mutable platform::mutex m_mutex;
 		};
+
+		template<typename Allocator>
+		int head_priority(const advanced<Allocator> & queue) { return queue.get_priority(); }
 	}
 
 	typedef object_impl<schedule::thread_pool, queueing::advanced<>, sharing::disabled> advanced;
@@ -12,6 +12,7 @@ namespace active
 		atomic_fifo();
 		void push(atomic_node*n);
 		atomic_node * pop();
+		bool empty() const;
 	private:
 		std::atomic<atomic_node*> input_queue, output_queue;
 	};	
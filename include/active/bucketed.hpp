@@ -0,0 +1,310 @@
+#ifndef ACTIVE_BUCKETED_INCLUDED
+#define ACTIVE_BUCKETED_INCLUDED
+
+#include "advanced.hpp"
+
+namespace active
+{
+	namespace queueing
+	{
+		/*	Prioritized message queue for a small fixed range of priorities, 0 to Levels-1.
+			Priorities outside this range are clamped.
+			Each priority has its own intrusive FIFO, and a bitmap records which
+			are non-empty, so enqueue and dequeue are O(1).
+			When full, policy::discard evicts the oldest message of the lowest priority,
+			unless the new message has a lower priority still.
+		 */
+		template<typename Allocator=std::allocator<void>, int Levels=32>
+		class bucketed
+		{
+		public:
+			typedef Allocator allocator_type;
+
+		private:
+			typedef char check_levels[Levels>0 && Levels<=32 ? 1 : -1];
+
+			struct message
+			{
+				message() : m_next(0) { }
+				virtual void run()=0;
+				virtual void destroy(allocator_type&)=0;
+				message * m_next;
+			};
+
+			struct level
+			{
+				message * m_front, * m_back;
+			};
+
+		public:
+			bucketed(const allocator_type & alloc = allocator_type(),
+					 std::size_t capacity=1000, policy::queue_full mp=policy::ignore) :
+				m_allocator(alloc), m_bits(0), m_size(0),
+				m_capacity(capacity), m_queue_full_policy(mp), m_activated(false)
+			{
+				init_levels();
+			}
+
+			bucketed(const bucketed&o) :
+				m_allocator(o.m_allocator), m_bits(0), m_size(0),
+				m_capacity(o.m_capacity), m_queue_full_policy(o.m_queue_full_policy), m_activated(false)
+			{
+				init_levels();
+			}
+
+			~bucketed()
+			{
+				while( m_bits )
+					pop(highest(m_bits))->destroy(m_allocator);
+			}
+
+			allocator_type get_allocator() const { return m_allocator; }
+
+			void set_policy( policy::queue_full p )
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				m_queue_full_policy = p;
+			}
+
+			template<typename Fn>
+			bool enqueue_fn(any_object *o, RVALUE_REF(Fn)fn, int priority)
+			{
+				const int l = priority<0 ? 0 : priority>=Levels ? Levels-1 : priority;
+
+				typedef typename allocator_type::template rebind<fn_impl<Fn> >::other realloc_type;
+				realloc_type realloc(m_allocator);
+				fn_impl<Fn> * impl = realloc.allocate(1);
+
+				try
+				{
+#ifdef ACTIVE_USE_CXX11
+					std::allocator_traits<realloc_type>::construct(realloc, impl, platform::forward<RVALUE_REF(Fn)>(fn));
+#else
+					realloc.construct(impl, fn_impl<Fn>(fn));
+#endif
+				}
+				catch(...)
+				{
+					realloc.deallocate(impl,1);
+					throw;
+				}
+
+				platform::unique_lock<platform::mutex> lock(m_mutex);
+				if( m_size >= m_capacity && m_bits )
+				{
+					switch( m_queue_full_policy )
+					{
+					case policy::ignore:
+						break;
+					case policy::discard:
+						if( l >= lowest(m_bits) )
+						{
+							pop(lowest(m_bits))->destroy(m_allocator);
+						}
+						else
+						{
+							impl->destroy(m_allocator);
+							return false;	// Discard message
+						}
+						break;
+					case policy::block:
+						// Note: higher priority messages get delivered anyway.
+						while( full_for(l) )
+						{
+							bool idle_success;
+							do
+							{
+								lock.unlock();
+								idle_success = o->idle();
+								lock.lock();
+							}
+							while( full_for(l) && idle_success );
+
+							if( !idle_success && full_for(l) )
+#ifdef ACTIVE_USE_BOOST
+								m_queue_available.timed_wait(lock, boost::posix_time::milliseconds(50));
+#else
+								m_queue_available.wait_for(lock, std::chrono::milliseconds(50) );
+#endif
+						}
+						break;
+					case policy::fail:
+						impl->destroy(m_allocator);
+						throw std::bad_alloc();
+					}
+				}
+
+				push(l, impl);
+				if( !m_activated )
+				{
+					m_activated = true;
+					return true;
+				}
+				return false;
+			}
+
+			bool empty() const
+			{
+				return !m_bits && !m_activated;
+			}
+
+			bool mutexed_empty() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return !m_bits; // Note: different from empty();
+			}
+
+			void set_capacity(std::size_t new_capacity)
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				m_capacity = new_capacity;
+			}
+
+			std::size_t get_capacity() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return m_capacity;
+			}
+
+			int get_priority() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return m_bits ? highest(m_bits) : 0;
+			}
+
+			bool run_some(any_object * o, int n=100) throw()
+			{
+				platform::unique_lock<platform::mutex> lock(m_mutex);
+				while( m_bits && n-->0)
+				{
+					message * m = pop(highest(m_bits));
+					if( m_size+1 == m_capacity || !m_bits ) m_queue_available.notify_all();
+					lock.unlock();
+					try
+					{
+						m->run();
+					}
+					catch (...)
+					{
+						o->exception_handler();
+					}
+					lock.lock();
+					m->destroy(m_allocator);
+				}
+				m_activated = m_bits!=0;
+				return m_activated;
+			}
+
+			void clear()
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				while( m_bits )
+					pop(highest(m_bits))->destroy(m_allocator);
+				m_queue_available.notify_all();
+			}
+
+			std::size_t size() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return m_size;
+			}
+
+		private:
+			bucketed & operator=(const bucketed&);
+
+			void init_levels()
+			{
+				for(int l=0; l<Levels; ++l)
+					m_levels[l].m_front = m_levels[l].m_back = 0;
+			}
+
+			void push(int l, message * m)
+			{
+				level & q = m_levels[l];
+				m->m_next = 0;
+				if( q.m_back ) q.m_back->m_next = m;
+				else q.m_front = m;
+				q.m_back = m;
+				m_bits |= 1u<<l;
+				++m_size;
+			}
+
+			message * pop(int l)
+			{
+				level & q = m_levels[l];
+				message * m = q.m_front;
+				q.m_front = m->m_next;
+				if( !q.m_front )
+				{
+					q.m_back = 0;
+					m_bits &= ~(1u<<l);
+				}
+				--m_size;
+				return m;
+			}
+
+			// Whether a message of level l must wait for space.
+			bool full_for(int l) const
+			{
+				return m_size >= m_capacity && m_bits && l <= highest(m_bits);
+			}
+
+			static int highest(unsigned bits)
+			{
+#ifdef __GNUC__
+				return 31-__builtin_clz(bits);
+#else
+				int i=0;
+				while( bits>>=1 ) ++i;
+				return i;
+#endif
+			}
+
+			static int lowest(unsigned bits)
+			{
+#ifdef __GNUC__
+				return __builtin_ctz(bits);
+#else
+				int i=0;
+				for( ; !(bits&1); bits>>=1) ++i;
+				return i;
+#endif
+			}
+
+			template<typename Fn>
+			struct fn_impl : public message
+			{
+				fn_impl(RVALUE_REF(Fn)fn) : m_fn(platform::forward<RVALUE_REF(Fn)>(fn)) { }
+				Fn m_fn;
+				void run()
+				{
+					m_fn();
+				}
+				void destroy(allocator_type&a)
+				{
+					typename allocator_type::template rebind<fn_impl<Fn> >::other realloc(a);
+					realloc.destroy(this);
+					realloc.deallocate(this,1);
+				}
+			};
+
+			allocator_type m_allocator;
+			level m_levels[Levels];
+			unsigned m_bits;	// Bit l is set if level l is non-empty
+			std::size_t m_size, m_capacity;
+			policy::queue_full m_queue_full_policy;
+			platform::condition_variable m_queue_available;
+			bool m_activated;
+
+		protected:
+			mutable platform::mutex m_mutex;
+		};
+
+		template<typename Allocator, int Levels>
+		int head_priority(const bucketed<Allocator, Levels> & queue) { return queue.get_priority(); }
+	}
+
+	typedef object_impl<schedule::thread_pool, queueing::bucketed<>, sharing::disabled> bucketed;
+}
+
+#endif
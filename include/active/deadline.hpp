@@ -0,0 +1,239 @@
+#ifndef ACTIVE_DEADLINE_INCLUDED
+#define ACTIVE_DEADLINE_INCLUDED
+
+#include "object.hpp"
+#include <queue>
+#include <vector>
+
+// Deadline-ordered mailbox. Requires ACTIVE_USE_CXX11.
+
+namespace active
+{
+	namespace queueing
+	{
+		/*	Message queue which runs messages in order of their deadline(), earliest first.
+			A message whose deadline has passed by the time it would run is discarded,
+			unless set_discard_expired(false) is called, in which case it runs anyway.
+			Messages without a deadline run after those with one, in the order sent.
+			Deadlines come from the first argument of an active method call, so messages
+			only have one with ACTIVE_USE_VARIADIC_TEMPLATES.
+		 */
+		template<typename Allocator=std::allocator<void> >
+		class deadline_ordered
+		{
+		public:
+			typedef Allocator allocator_type;
+
+		private:
+			struct message
+			{
+				message(deadline_type d, std::size_t s) : m_deadline(d), m_sequence(s) { }
+				virtual void run()=0;
+				virtual void destroy(allocator_type&)=0;
+				const deadline_type m_deadline;
+				const std::size_t m_sequence;
+			};
+
+			struct msg_cmp;
+			typedef std::vector<message*, typename allocator_type::template rebind<message*>::other> vector_type;
+			typedef std::priority_queue<message*, vector_type, msg_cmp> queue_type;
+
+		public:
+
+			deadline_ordered(const allocator_type & alloc = allocator_type()) :
+				m_allocator(alloc), m_messages(msg_cmp(), vector_type(alloc)),
+				m_sequence(0), m_activated(false), m_discard_expired(true),
+				m_on_time(0), m_late(0), m_expired(0)
+			{
+			}
+
+			deadline_ordered(const deadline_ordered&o) :
+				m_allocator(o.m_allocator), m_messages(msg_cmp(), vector_type(o.m_allocator)),
+				m_sequence(0), m_activated(false), m_discard_expired(o.m_discard_expired),
+				m_on_time(0), m_late(0), m_expired(0)
+			{
+			}
+
+			~deadline_ordered()
+			{
+				clear();
+			}
+
+			allocator_type get_allocator() const { return m_allocator; }
+
+			template<typename Fn>
+			bool enqueue_fn(any_object *, RVALUE_REF(Fn)fn, int)
+			{
+				const deadline_type d = message_deadline(fn, 0);
+
+				typedef typename allocator_type::template rebind<fn_impl<Fn> >::other realloc_type;
+				realloc_type realloc(m_allocator);
+				fn_impl<Fn> * impl = realloc.allocate(1);
+
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				try
+				{
+					std::allocator_traits<realloc_type>::construct(realloc, impl, platform::forward<RVALUE_REF(Fn)>(fn), d, m_sequence++);
+				}
+				catch(...)
+				{
+					realloc.deallocate(impl,1);
+					throw;
+				}
+
+				try
+				{
+					m_messages.push(impl);
+				}
+				catch(...)
+				{
+					impl->destroy(m_allocator);
+					throw;
+				}
+
+				if( m_activated ) return false;
+				m_activated = true;
+				return true;
+			}
+
+			bool empty() const
+			{
+				return m_messages.empty() && !m_activated;
+			}
+
+			bool mutexed_empty() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return m_messages.empty(); // Note: different from empty();
+			}
+
+			std::size_t size() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return m_messages.size();
+			}
+
+			// The deadline of the next message, or deadline_type::max() if none.
+			deadline_type get_deadline() const
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				return m_messages.empty() ? deadline_type::max() : m_messages.top()->m_deadline;
+			}
+
+			void set_discard_expired(bool discard)
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				m_discard_expired = discard;
+			}
+
+			deadline_counts get_counts() const
+			{
+				deadline_counts counts = { m_on_time.load(), m_late.load(), m_expired.load() };
+				return counts;
+			}
+
+			// Expired messages are not counted towards n, so that a stale backlog is dropped promptly.
+			bool run_some(any_object * o, int n=100) throw()
+			{
+				platform::unique_lock<platform::mutex> lock(m_mutex);
+				while( !m_messages.empty() && n>0 )
+				{
+					message * m = m_messages.top();
+					m_messages.pop();
+					const bool discard = m_discard_expired;
+					lock.unlock();
+
+					const bool has_deadline = m->m_deadline != deadline_type::max();
+					if( has_deadline && deadline_type::clock::now() > m->m_deadline )
+					{
+						++m_expired;
+						if( !discard ) run(o, m);
+					}
+					else
+					{
+						--n;
+						run(o, m);
+						if( has_deadline )
+							++(deadline_type::clock::now() > m->m_deadline ? m_late : m_on_time);
+					}
+
+					lock.lock();
+					m->destroy(m_allocator);
+				}
+				m_activated = !m_messages.empty();
+				return m_activated;
+			}
+
+			void clear()
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				while( !m_messages.empty() )
+				{
+					message * m = m_messages.top();
+					m_messages.pop();
+					m->destroy(m_allocator);
+				}
+			}
+
+		private:
+			deadline_ordered & operator=(const deadline_ordered&);
+
+			static void run(any_object * o, message * m) throw()
+			{
+				try
+				{
+					m->run();
+				}
+				catch (...)
+				{
+					o->exception_handler();
+				}
+			}
+
+			struct msg_cmp
+			{
+				bool operator()(message *m1, message *m2) const
+				{
+					return m1->m_deadline > m2->m_deadline || (m1->m_deadline == m2->m_deadline && m1->m_sequence > m2->m_sequence);
+				}
+			};
+
+			template<typename Fn>
+			struct fn_impl : public message
+			{
+				fn_impl(RVALUE_REF(Fn)fn, deadline_type d, std::size_t seq) :
+					message(d, seq),
+					m_fn(platform::forward<RVALUE_REF(Fn)>(fn))
+				{
+				}
+				Fn m_fn;
+				void run()
+				{
+					m_fn();
+				}
+				void destroy(allocator_type&a)
+				{
+					typename allocator_type::template rebind<fn_impl<Fn> >::other realloc(a);
+					realloc.destroy(this);
+					realloc.deallocate(this,1);
+				}
+			};
+
+			allocator_type m_allocator;
+			queue_type m_messages;
+			std::size_t m_sequence;
+			bool m_activated, m_discard_expired;
+			std::atomic<std::size_t> m_on_time, m_late, m_expired;
+
+		protected:
+			mutable platform::mutex m_mutex;
+		};
+
+		template<typename Allocator>
+		deadline_type head_deadline(const deadline_ordered<Allocator> & queue) { return queue.get_deadline(); }
+	}
+
+	typedef object_impl<schedule::thread_pool, queueing::deadline_ordered<>, sharing::disabled> deadline_ordered;
+}
+
+#endif
@@ -1,5 +1,9 @@
+#include <active/config.hpp>
 #include <memory>
 #include <algorithm>
+#ifdef ACTIVE_USE_CXX11
+#include <type_traits>
+#endif
 
 namespace active
 {
@@ -7,7 +11,10 @@ namespace active
 		A stable polymorphic deque.
 		This could probably be expanded into a proper container, but for now
 		the bare minimum is implemented to support cppao.
-		This does not implement alignment 100% portably. */
+		This does not implement alignment 100% portably.
+		Messages are stored in chunks of at least chunk_size bytes.
+		Drained chunks are kept on a short spare list and reused,
+		so steady traffic does not allocate. */
 
 	template<typename T, typename Alloc=std::allocator<T> >
 	class fifo
@@ -17,13 +24,17 @@ namespace active
 		typedef typename allocator_type::size_type size_type;
 		typedef T value_type;
 
-		fifo(const allocator_type & a = allocator_type()) :
-			m_head(0), m_tail(0), m_size(0), m_allocator(a) { }
+		static const size_type default_chunk_size=1024;
+		static const size_type max_spare_chunks=2;
+
+		fifo(const allocator_type & a = allocator_type(), size_type chunk_size=default_chunk_size) :
+			m_head(0), m_tail(0), m_size(0), m_allocator(a),
+			m_chunk_size(chunk_size), m_spare(0), m_spare_count(0) { }
 
 		~fifo()
 		{
 			clear();
-			if(m_head) erase(m_head);
+			shrink_to_fit();
 		}
 
 		void reserve(size_type c)
@@ -32,11 +43,33 @@ namespace active
 			{
 				if( m_head && m_head->empty () )
 				{
-					erase(m_head);
+					recycle(m_head);
 					m_head = m_tail = 0;
 				}
 
-				add_chain(std::max(c+aligned_size<entry>::value,size_type(200UL)));	// !! Where to get this value from ?
+				add_chain(std::max(aligned_size<chain>::value+aligned_size<entry>::value+c, m_chunk_size));
+			}
+		}
+
+		// The size of chunks allocated from now on.
+		void set_chunk_size(size_type bytes) { m_chunk_size = bytes; }
+		size_type get_chunk_size() const { return m_chunk_size; }
+
+		// Frees the spare chunks, and the last chunk if the fifo is empty.
+		void shrink_to_fit()
+		{
+			while( m_spare )
+			{
+				chain * c = m_spare;
+				m_spare = c->m_next;
+				erase(c);
+			}
+			m_spare_count = 0;
+
+			if( m_head && m_head->empty() && !m_head->m_next )
+			{
+				erase(m_head);
+				m_head = m_tail = 0;
 			}
 		}
 
@@ -51,11 +84,28 @@ namespace active
 #ifdef ACTIVE_USE_CXX11
 		template<typename U>
 		void push(U&&u)
+		{
+			emplace<typename std::decay<U>::type>(std::forward<U>(u));
+		}
+
+		// Constructs a U in place at the back of the queue.
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+		template<typename U, typename... Args>
+		void emplace(Args&&... args)
 		{
 			reserve(aligned_size<U>::value);
-			m_tail->push(std::forward<U&&>(u), m_allocator);
+			m_tail->template emplace<U>(m_allocator, std::forward<Args>(args)...);
 			++m_size;
 		}
+#else
+		template<typename U, typename Arg>
+		void emplace(Arg&&arg)
+		{
+			reserve(aligned_size<U>::value);
+			m_tail->template emplace<U>(m_allocator, std::forward<Arg>(arg));
+			++m_size;
+		}
+#endif
 #endif
 
 		value_type & front()
@@ -78,7 +128,7 @@ namespace active
 				if( m_head->m_next )
 				{
 					chain * new_head = m_head->m_next;
-					erase(m_head);
+					recycle(m_head);
 					m_head = new_head;
 					if( !m_head ) m_tail=0;
 				}
@@ -121,7 +171,7 @@ namespace active
 				}
 				chain * old_head = m_head;
 				m_head=m_head->m_next;
-				erase(old_head);
+				recycle(old_head);
 			}
 
 			front_chain->m_next=0;
@@ -141,6 +191,9 @@ namespace active
 			std::swap( m_tail, other.m_tail );
 			std::swap( m_size, other.m_size );
 			std::swap( m_allocator, other.m_allocator );
+			std::swap( m_chunk_size, other.m_chunk_size );
+			std::swap( m_spare, other.m_spare );
+			std::swap( m_spare_count, other.m_spare_count );
 		}
 
 	private:
@@ -177,14 +230,34 @@ namespace active
 			}
 
 #ifdef ACTIVE_USE_CXX11
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+			template<typename U, typename... Args>
+			void emplace(allocator_type & allocator, Args&&... args)
+			{
+				typedef typename allocator_type::template rebind<U>::other realloc_type;
+				realloc_type alloc(allocator);
+				U * data = reinterpret_cast<U*>(m_back+aligned_size<entry>::value);
+				std::allocator_traits<realloc_type>::construct(alloc, data, std::forward<Args>(args)...);
+				commit<U>();
+			}
+#else
+			template<typename U, typename Arg>
+			void emplace(allocator_type & allocator, Arg&& arg)
+			{
+				typedef typename allocator_type::template rebind<U>::other realloc_type;
+				realloc_type alloc(allocator);
+				U * data = reinterpret_cast<U*>(m_back+aligned_size<entry>::value);
+				std::allocator_traits<realloc_type>::construct(alloc, data, std::forward<Arg>(arg));
+				commit<U>();
+			}
+#endif
+
+			// Appends the U which has been constructed after m_back.
 			template<typename U>
-			void push(U && u, allocator_type & allocator)
+			void commit()
 			{
 				entry * e = reinterpret_cast<entry*>(m_back);
-				U * data = reinterpret_cast<U*>(m_back+aligned_size<entry>::value);
-				typename allocator_type::template rebind<U>::other alloc(allocator);
-				alloc.construct(data, u);
-				m_back = (char*)data+aligned_size<U>::value;
+				m_back += aligned_size<entry>::value + aligned_size<U>::value;
 				e->m_next = m_back;
 			}
 #endif
@@ -216,16 +289,44 @@ namespace active
 
 		void add_chain(size_type bytes)
 		{
-			typename allocator_type::template rebind<char>::other alloc(m_allocator);
-			char *buffer = alloc.allocate(bytes);
-			chain *c = reinterpret_cast<chain*>(buffer);
+			chain *c = m_spare;
+			if( c )
+			{
+				m_spare = c->m_next;
+				--m_spare_count;
+				if( size_type(c->m_end-reinterpret_cast<char*>(c)) < bytes )
+				{
+					erase(c);
+					c = 0;
+				}
+			}
+
+			if( !c )
+			{
+				typename allocator_type::template rebind<char>::other alloc(m_allocator);
+				char *buffer = alloc.allocate(bytes);
+				c = reinterpret_cast<chain*>(buffer);
+				c->m_end = buffer+bytes;
+			}
 			c->m_next = 0;
 			c->reset();
-			c->m_end = buffer+bytes;
 			if(m_tail) m_tail->m_next = c, m_tail = c;
 			else m_head = m_tail = c;
 		}
 
+		// Keeps a drained chunk for reuse, up to max_spare_chunks.
+		void recycle(chain * c)
+		{
+			if( m_spare_count < max_spare_chunks )
+			{
+				c->m_next = m_spare;
+				m_spare = c;
+				++m_spare_count;
+			}
+			else
+				erase(c);
+		}
+
 		void erase(chain * c)
 		{
 			typename allocator_type::template rebind<char>::other alloc(m_allocator);
@@ -235,6 +336,9 @@ namespace active
 		chain *m_head, *m_tail;
 		size_type m_size;
 		allocator_type m_allocator;
+		size_type m_chunk_size;
+		chain * m_spare;	// Drained chunks, linked by m_next
+		size_type m_spare_count;
 
 		fifo(const fifo&);
 		fifo & operator=(const fifo&);
@@ -0,0 +1,201 @@
+#ifndef ACTIVE_LOCK_FREE_INCLUDED
+#define ACTIVE_LOCK_FREE_INCLUDED
+
+#include "object.hpp"
+#include <atomic>
+#include <new>
+
+namespace active
+{
+	namespace queueing
+	{
+		/*	Message queue which does not use a mutex. Requires ACTIVE_USE_CXX11.
+			Messages are pushed onto an intrusive multi-producer/single-consumer
+			list (Dmitry Vyukov's algorithm) and popped by the thread running the object.
+			m_count is the number of messages which have been pushed but not run,
+			so exactly one producer sees it go from 0 and activates the object.
+			It can briefly go negative when the consumer runs a message before
+			its producer has counted it.
+		 */
+		template<typename Allocator=std::allocator<void> >
+		class lock_free
+		{
+		public:
+			typedef Allocator allocator_type;
+
+		private:
+			struct message
+			{
+				message() : m_next(nullptr) { }
+				virtual void run()=0;
+				virtual void destroy(allocator_type&)=0;
+				std::atomic<message*> m_next;
+			};
+
+			struct stub : public message
+			{
+				void run() { }
+				void destroy(allocator_type&) { }
+			};
+
+		public:
+			lock_free(const allocator_type & alloc = allocator_type()) :
+				m_allocator(alloc), m_back(&m_stub), m_front(&m_stub), m_count(0), m_run_count(0)
+			{
+			}
+
+			lock_free(const lock_free & o) :
+				m_allocator(o.m_allocator), m_back(&m_stub), m_front(&m_stub), m_count(0), m_run_count(0)
+			{
+			}
+
+			~lock_free()
+			{
+				while( message * m = pop() )
+					m->destroy(m_allocator);
+			}
+
+			allocator_type get_allocator() const { return m_allocator; }
+
+			template<typename Fn>
+			bool enqueue_fn( any_object *, RVALUE_REF(Fn) fn, int )
+			{
+				typename allocator_type::template rebind<fn_impl<Fn> >::other realloc(m_allocator);
+				fn_impl<Fn> * impl = realloc.allocate(1);
+				try
+				{
+					::new(static_cast<void*>(impl)) fn_impl<Fn>(platform::forward<RVALUE_REF(Fn)>(fn));
+				}
+				catch(...)
+				{
+					realloc.deallocate(impl,1);
+					throw;
+				}
+				push(impl);
+				return m_count.fetch_add(1, std::memory_order_acq_rel)==0;
+			}
+
+			bool empty() const
+			{
+				return m_count.load(std::memory_order_acquire)==0;
+			}
+
+			// Excludes messages which have been run or cleared by the current active method.
+			bool mutexed_empty() const
+			{
+				return size()==0;
+			}
+
+			std::size_t size() const
+			{
+				int pending = m_count.load(std::memory_order_acquire) - m_run_count.load(std::memory_order_relaxed);
+				return pending>0 ? pending : 0;
+			}
+
+			bool run_some(any_object * o, int n=100) throw()
+			{
+				m_run_count.store(0, std::memory_order_relaxed);
+				message * m = nullptr;
+				while( n-->0 && (m=pop()) )
+				{
+					m_run_count.fetch_add(1, std::memory_order_relaxed);
+					try
+					{
+						m->run();
+					}
+					catch (...)
+					{
+						o->exception_handler();
+					}
+					m->destroy(m_allocator);
+				}
+
+				int run_count = m_run_count.load(std::memory_order_relaxed);
+				int remaining = m_count.fetch_sub(run_count, std::memory_order_acq_rel) - run_count;
+				if( remaining>0 && !m )
+				{
+					// A producer has been interrupted part way through push().
+					platform::this_thread::yield();
+				}
+				return remaining>0;
+			}
+
+			// Destroy all messages except current. Only callable from active methods.
+			void clear()
+			{
+				while( message * m = pop() )
+				{
+					m_run_count.fetch_add(1, std::memory_order_relaxed);
+					m->destroy(m_allocator);
+				}
+			}
+
+		private:
+			lock_free & operator=(const lock_free&);
+
+			void push(message * m)
+			{
+				m->m_next.store(nullptr, std::memory_order_relaxed);
+				message * prev = m_back.exchange(m, std::memory_order_acq_rel);
+				prev->m_next.store(m, std::memory_order_release);
+			}
+
+			// Only called by the consumer.
+			// Returns null if empty, or if a producer has not finished push().
+			message * pop()
+			{
+				message * front = m_front;
+				message * next = front->m_next.load(std::memory_order_acquire);
+				if( front == &m_stub )
+				{
+					if( !next ) return nullptr;
+					m_front = front = next;
+					next = next->m_next.load(std::memory_order_acquire);
+				}
+				if( next )
+				{
+					m_front = next;
+					return front;
+				}
+				if( front != m_back.load(std::memory_order_acquire) )
+					return nullptr;
+				push(&m_stub);
+				next = front->m_next.load(std::memory_order_acquire);
+				if( next )
+				{
+					m_front = next;
+					return front;
+				}
+				return nullptr;
+			}
+
+			template<typename Fn>
+			struct fn_impl : public message
+			{
+				fn_impl(RVALUE_REF(Fn)fn) : m_fn(platform::forward<RVALUE_REF(Fn)>(fn)) { }
+				Fn m_fn;
+				void run()
+				{
+					m_fn();
+				}
+				void destroy(allocator_type&a)
+				{
+					typename allocator_type::template rebind<fn_impl<Fn> >::other realloc(a);
+					realloc.destroy(this);
+					realloc.deallocate(this,1);
+				}
+			};
+
+			allocator_type m_allocator;
+			stub m_stub;
+			std::atomic<message*> m_back;	// Producers push here
+			message * m_front;	// Consumer pops here
+			std::atomic<int> m_count;
+			std::atomic<int> m_run_count;	// Run or cleared in current run_some()
+		};
+	}
+
+	typedef object_impl<schedule::thread_pool, queueing::lock_free<>, sharing::disabled> lock_free;
+}
+
+#endif
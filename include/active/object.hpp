@@ -10,6 +10,10 @@
 #include "atomic_node.hpp"
 
 #ifdef ACTIVE_USE_CXX11
+	#include <atomic>
+	#include <chrono>
+	#include <tuple>
+	#include <type_traits>
 	#define RVALUE_REF(T) T&&
 	namespace active
 	{
@@ -66,24 +70,89 @@ namespace active
 {
 	template<typename T> int priority(const T&) { return 0; }
 
+#ifdef ACTIVE_USE_CXX11
+	// When a message should have run by, for queueing::deadline_ordered and the
+	// scheduler's earliest_deadline mode. Specialize like priority().
+	// The default is no deadline.
+	typedef std::chrono::steady_clock::time_point deadline_type;
+	template<typename T> deadline_type deadline(const T&) { return deadline_type::max(); }
+
+	// Messages with a deadline counted by queueing::deadline_ordered.
+	struct deadline_counts
+	{
+		std::size_t on_time;	// Finished by their deadline
+		std::size_t late;	// Started by their deadline, but finished after it
+		std::size_t expired;	// Discarded without running, or started after their deadline
+	};
+#endif
+
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+	// The sequence 0..N-1, used to unpack stored arguments.
+	template<std::size_t... I> struct indexes { };
+	template<std::size_t N, std::size_t... I> struct make_indexes : make_indexes<N-1, N-1, I...> { };
+	template<std::size_t... I> struct make_indexes<0, I...> { typedef indexes<I...> type; };
+#endif
+
 	namespace policy
 	{
 		enum queue_full { ignore, block, discard, fail };
 	}
 
+	// Number of priority lanes in a scheduler. See object_impl::set_lane().
+	const int scheduler_lanes = 4;
+
 	// Interface of all active objects.
 	struct any_object : public atomic_node
 	{
+		any_object() : m_quantum(0), m_lane(0)
+		{
+#ifdef ACTIVE_USE_CXX11
+			m_deadline = deadline_type::max();
+			m_heap_child = m_heap_next = m_heap_prev = 0;
+			m_heap_sequence = 0;
+#endif
+		}
 		virtual ~any_object();
 		virtual void run() throw()=0;
 		virtual bool run_some(int n=100) throw()=0;
 		virtual void exception_handler() throw();
 		virtual bool idle() throw()=0;
+
+		// How many messages fit in the scheduler's time budget, or 0 if not measured yet.
+		// See scheduler::set_quantum().
+		int m_quantum;
+
+		// The scheduler lane that the object is activated in, set before each activation.
+		int m_lane;
+
+#ifdef ACTIVE_USE_CXX11
+		// The deadline of the message which the object runs next, if known, set before each activation.
+		deadline_type m_deadline;
+
+		// Links in the scheduler's deadline heap, where m_heap_prev is the parent of
+		// a first child, and the order activated, which breaks ties between deadlines.
+		any_object * m_heap_child, * m_heap_next, * m_heap_prev;
+		unsigned long long m_heap_sequence;
+#endif
 	};
 
 	class scheduler;
 	bool idle(scheduler & sched) throw();
 
+#ifdef ACTIVE_USE_CXX11
+	// Called when an already activated object is sent a message which may run before
+	// the one it was activated for, with the deadline of its next message.
+	void raise_deadline(scheduler & sched, any_object * obj, deadline_type d) throw();
+#endif
+
+	/*	An object runs a slice of at most n messages in chunks. begin_slice()
+		returns the size of the first chunk, and continue_slice() the size of
+		the next, after a chunk which left messages in the queue, or 0 to end
+		the slice. Without a time budget, the first chunk is the whole slice.
+	 */
+	int begin_slice(any_object * obj, int n) throw();
+	int continue_slice(any_object * obj, int ran) throw();
+
 	// As a convenience, provide a global variable to run all active objects.
 	extern scheduler default_scheduler;
 
@@ -130,6 +199,24 @@ namespace active
 
 	namespace queueing	// The queuing policy classes
 	{
+		// The priority of the next message, for queues which order messages by priority.
+		template<typename Queue>
+		int head_priority(const Queue &) { return 0; }
+
+#ifdef ACTIVE_USE_CXX11
+		// The deadline of the next message, for queues which order messages by deadline.
+		template<typename Queue>
+		deadline_type head_deadline(const Queue &) { return deadline_type::max(); }
+
+		// The deadline of a message about to be queued, if it is an active method call.
+		// Call with a second argument of 0.
+		template<typename Fn>
+		auto message_deadline(const Fn & fn, int) -> decltype(fn.get_deadline()) { return fn.get_deadline(); }
+
+		template<typename Fn>
+		deadline_type message_deadline(const Fn &, long) { return deadline_type::max(); }
+#endif
+
 		// Default message queue shared between all message types.
 		template< typename Allocator=std::allocator<void> >
 		class shared
@@ -150,7 +237,7 @@ namespace active
 			{
 			}
 
-			shared(const shared&o) : m_queue(o.m_queue.get_allocator())
+			shared(const shared&o) : m_queue(o.m_queue.get_allocator(), o.m_queue.get_chunk_size())
 			{
 			}
 
@@ -160,7 +247,11 @@ namespace active
 			bool enqueue_fn( any_object * obj, RVALUE_REF(Fn) fn, int )
 			{
 				platform::lock_guard<platform::mutex> lock(m_mutex);
-				m_queue.push( run_impl<Fn>(platform::forward<RVALUE_REF(Fn)>(fn)) );
+#ifdef ACTIVE_USE_CXX11
+				m_queue.template emplace<run_impl<Fn> >( platform::forward<RVALUE_REF(Fn)>(fn) );
+#else
+				m_queue.push( run_impl<Fn>(fn) );
+#endif
 				return m_queue.size()==1;
 			}
 
@@ -204,6 +295,18 @@ namespace active
 				m_queue.truncate();
 			}
 
+			void set_chunk_size(std::size_t bytes)
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				m_queue.set_chunk_size(bytes);
+			}
+
+			void shrink_to_fit()
+			{
+				platform::lock_guard<platform::mutex> lock(m_mutex);
+				m_queue.shrink_to_fit();
+			}
+
 		private:
 
 			template<typename Fn>
@@ -239,7 +342,7 @@ namespace active
 
 		object_impl(scheduler_type & tp = default_scheduler,
 					const allocator_type & alloc = allocator_type())
-					: m_schedule(tp), m_queue(alloc)
+					: m_schedule(tp), m_queue(alloc), m_base_lane(0), m_lane_from_priority(false)
 		{
 		}
 
@@ -278,6 +381,37 @@ namespace active
 			return m_queue.get_capacity();
 		}
 
+#ifdef ACTIVE_USE_CXX11
+		// Gets the deadline of the next waiting message, for queueing::deadline_ordered.
+		deadline_type get_deadline() const
+		{
+			return m_queue.get_deadline();
+		}
+
+		// Whether messages are discarded once their deadline has passed (the default), or run anyway.
+		void set_discard_expired(bool discard)
+		{
+			m_queue.set_discard_expired(discard);
+		}
+
+		deadline_counts get_deadline_counts() const
+		{
+			return m_queue.get_counts();
+		}
+#endif
+
+		// Sets the size of the blocks used to store queued messages.
+		void set_chunk_size(size_type bytes)
+		{
+			m_queue.set_chunk_size(bytes);
+		}
+
+		// Frees memory held by the message queue, for example once the object is idle.
+		void shrink_to_fit()
+		{
+			m_queue.shrink_to_fit();
+		}
+
 		size_type size() const
 		{
 			return m_queue.size();
@@ -294,6 +428,22 @@ namespace active
 			return m_queue.get_priority();
 		}
 
+		/*	Puts the object in a priority lane of its scheduler, from 0 (the default)
+			to scheduler_lanes-1. Threads run objects in higher lanes first, so a
+			latency-critical object does not wait behind bulk work in lane 0.
+			Requires ACTIVE_USE_CXX11; otherwise all objects share one queue.
+		 */
+		void set_lane(int lane)
+		{
+			m_base_lane = lane<0 ? 0 : lane<scheduler_lanes ? lane : scheduler_lanes-1;
+		}
+
+		int get_lane() const { return m_base_lane; }
+
+		// Whether the priority() of the next message raises the object's lane.
+		// For FIFO queues this is the message which activates the object.
+		void set_lane_from_priority(bool enabled) { m_lane_from_priority = enabled; }
+
 		bool idle() throw()
 		{
 			return active::idle(get_scheduler());
@@ -316,8 +466,18 @@ namespace active
 
 			// Run a few messages from the queue
 			// if we still have messages, then reactivate this object.
-			if( m_queue.run_some(this, n) )
+			int chunk = begin_slice(this, n);
+			bool more = m_queue.run_some(this, chunk);
+			while( more && (chunk = continue_slice(this, chunk)) )
+				more = m_queue.run_some(this, chunk);
+			if( more )
 			{
+				using queueing::head_priority;	// Finds overloads for other queues by ADL
+				m_lane = lane_for(m_lane_from_priority ? head_priority(m_queue) : 0);
+#ifdef ACTIVE_USE_CXX11
+				using queueing::head_deadline;
+				m_deadline = head_deadline(m_queue);
+#endif
 				m_share.activate(this);
 				m_schedule.activate(m_share.pointer(this));
 				return true;
@@ -331,11 +491,28 @@ namespace active
 		template<typename T>
 		void enqueue_fn2(RVALUE_REF(T) fn, int priority=0)
 		{
+#ifdef ACTIVE_USE_CXX11
+			const deadline_type d = queueing::message_deadline(fn, 0);
+#endif
 			if( m_queue.enqueue_fn(this, platform::forward<RVALUE_REF(T)>(fn), priority))
 			{
+				m_lane = lane_for(priority);
+#ifdef ACTIVE_USE_CXX11
+				m_deadline = d;
+#endif
 				m_share.activate(this);
 				m_schedule.activate(m_share.pointer(this));
 			}
+#ifdef ACTIVE_USE_CXX11
+			else if( d != deadline_type::max() )
+			{
+				// Queues ordered by deadline may now have an earlier message to run.
+				using queueing::head_deadline;
+				const deadline_type head = head_deadline(m_queue);
+				if( head != deadline_type::max() )
+					raise_deadline(get_scheduler(), this, head);
+			}
+#endif
 		}
 
 	protected:
@@ -359,9 +536,17 @@ namespace active
 		}
 
 	private:
+		int lane_for(int priority) const
+		{
+			if( !m_lane_from_priority || priority<=m_base_lane ) return m_base_lane;
+			return priority<scheduler_lanes ? priority : scheduler_lanes-1;
+		}
+
 		schedule_type m_schedule;
 		queue_type m_queue;
 		share_type m_share;
+		int m_base_lane;
+		bool m_lane_from_priority;
 	};
 
 	// The default object type.
@@ -398,17 +583,44 @@ namespace active
 		}
 
 #ifdef ACTIVE_USE_VARIADIC_TEMPLATES
-		template<typename... Args>
-		void run_active_method(Args ...args)
+		/*	The message stored in the queue for a call to active_method().
+			The arguments are moved in and out, so move-only types can be sent
+			and large values are never copied. Obj is object or const object.
+		 */
+		template<typename Obj, typename... Args>
+		class method_call
 		{
-			get_derived().active_method(args...);
-		}
+		public:
+			template<typename... As>
+			method_call(Obj * obj, As && ...args) :
+				m_object(obj), m_args(platform::forward<As>(args)...)
+			{
+			}
 
-		template<typename... Args>
-		void const_run_active_method(Args ...args) const
-		{
-			get_derived().active_method(args...);
-		}
+			void operator()()
+			{
+				call(typename make_indexes<sizeof...(Args)>::type());
+			}
+
+			int get_priority() const
+			{
+				return priority(std::get<0>(m_args));
+			}
+
+			deadline_type get_deadline() const
+			{
+				return deadline(std::get<0>(m_args));
+			}
+		private:
+			template<std::size_t... I>
+			void call(indexes<I...>)
+			{
+				m_object->get_derived().active_method(platform::move(std::get<I>(m_args))...);
+			}
+
+			Obj * m_object;
+			std::tuple<Args...> m_args;
+		};
 #endif
 
 		template<typename Arg1>
@@ -496,18 +708,22 @@ namespace active
 
 #ifdef ACTIVE_USE_VARIADIC_TEMPLATES
 		template<typename Arg1, typename... Args>
-		derived_type & operator()(Arg1 arg1, Args ...args)
+		derived_type & operator()(Arg1 && arg1, Args && ...args)
 		{
-			this->active_fn( platform::bind(&object::run_active_method<Arg1,Args...>,
-											this,arg1,args...),priority(arg1));
+			method_call<object, typename std::decay<Arg1>::type, typename std::decay<Args>::type...>
+				call(this, platform::forward<Arg1>(arg1), platform::forward<Args>(args)...);
+			int p = call.get_priority();
+			this->active_fn( platform::move(call), p);
 			return get_derived();
 		}
 
 		template<typename Arg1, typename... Args>
-		const derived_type & operator()(Arg1 arg1, Args ...args) const
+		const derived_type & operator()(Arg1 && arg1, Args && ...args) const
 		{
-			this->active_fn( platform::bind(&object::const_run_active_method<Arg1,Args...>,
-											this,arg1,args...),priority(arg1));
+			method_call<const object, typename std::decay<Arg1>::type, typename std::decay<Args>::type...>
+				call(this, platform::forward<Arg1>(arg1), platform::forward<Args>(args)...);
+			int p = call.get_priority();
+			this->active_fn( platform::move(call), p);
 			return get_derived();
 		}
 #else
@@ -600,10 +816,11 @@ namespace active
 	};
 
 	// Runs the scheduler for a given duration.
+	// With 0 threads, uses topology::system().concurrency(), which respects the cgroup's CPUs and quota.
 	class run
 	{
 	public:
-		explicit run(int threads=platform::thread::hardware_concurrency(), scheduler & sched = default_scheduler);
+		explicit run(int threads=0, scheduler & sched = default_scheduler);
 		~run();
 	private:
 		run(const run&);
@@ -616,6 +833,33 @@ namespace active
 #endif
 		threads m_threads;
 	};	
+
+#ifdef ACTIVE_USE_CXX11
+	// A thread pool which is kept alive between bursts of work.
+	// Threads park when there is nothing to do.
+	// The destructor waits for the scheduler to become idle.
+	// With 0 threads, sized like run.
+	class pool
+	{
+	public:
+		explicit pool(int threads=0, scheduler & sched = default_scheduler);
+		~pool();
+
+		// Blocks until all messages in the scheduler have been processed.
+		void wait_idle();
+	private:
+		pool(const pool&);
+		pool & operator=(const pool&);
+		scheduler & m_scheduler;
+		std::atomic<bool> m_stop;
+#ifdef ACTIVE_USE_BOOST
+		typedef boost::thread_group threads;
+#else
+		typedef std::vector<platform::thread> threads;
+#endif
+		threads m_threads;
+	};
+#endif
 } // namespace active
 
 
@@ -0,0 +1,30 @@
+#ifndef ACTIVE_RUN_QUEUE_INCLUDED
+#define ACTIVE_RUN_QUEUE_INCLUDED
+
+#include <atomic>
+#include "atomic_node.hpp"
+
+namespace active
+{
+	/*	Bounded queue of activated objects owned by one worker thread.
+		Only the owner may push(), but any thread may pop(), which is
+		how idle workers steal work from busy ones.
+	 */
+	class run_queue
+	{
+	public:
+		run_queue();
+
+		// Returns false if the queue is full.
+		bool push(atomic_node * n);
+		atomic_node * pop();
+		bool empty() const;
+
+		static const unsigned capacity=256;
+	private:
+		std::atomic<unsigned> m_head, m_tail;
+		std::atomic<atomic_node*> m_items[capacity];
+	};
+}
+
+#endif
@@ -25,17 +25,37 @@
 
 #ifdef ACTIVE_USE_CXX11
 	#include "atomic_fifo.hpp"
+	#include "run_queue.hpp"
+	#include "timer_wheel.hpp"
+	#include <vector>
 #endif
 
 namespace active
 {
+	namespace policy
+	{
+		// How a scheduler distributes activated objects between its threads.
+		// work_stealing gives each thread in run() its own run queue.
+		// earliest_deadline runs the object whose next message has the earliest
+		// deadline() first; see queueing::deadline_ordered. Objects without a
+		// deadline run after those with one, in the order activated.
+		// Both require ACTIVE_USE_CXX11 and otherwise behave as shared_queue.
+		enum scheduling { shared_queue, work_stealing, earliest_deadline };
+	}
+
 	// Represents a pool of active objects which can be executed in a thread pool.
 	class scheduler
 	{
 	public:
 		typedef any_object * ObjectPtr;
 
-		scheduler();
+		explicit scheduler(policy::scheduling mode = policy::shared_queue);
+		~scheduler();
+
+		policy::scheduling get_scheduling() const { return m_mode; }
+
+		// State of a thread inside run().
+		struct worker;
 
 		// Used by an active object to signal that there are messages to process.
 		void activate(ObjectPtr) throw();
@@ -56,12 +76,145 @@ namespace active
 		// Can be run concurrently.
 		bool run_one();
 
+#ifdef ACTIVE_USE_CXX11
+		// Runs in current thread until stop is set, parking when there is no work.
+		// Can be run concurrently.
+		void run_until(const std::atomic<bool> & stop);
+
+		// Blocks until no thread is running an object and no objects are activated,
+		// which means that every mailbox has been drained.
+		void wait_idle();
+
+		// Wakes all parked threads, for example so that they see their stop flag.
+		void wake_all() throw();
+
+		// Whether an object activated by a thread in run() is run next by that same
+		// thread, ahead of the queue, while its caches are warm. Enabled by default.
+		void set_run_next(bool enabled) { m_run_next = enabled; }
+		bool get_run_next() const { return m_run_next; }
+
+		/*	Limits how long a thread runs one object before moving on, so that objects
+			with expensive messages do not hold up the rest, and objects with cheap ones
+			are not requeued too often. Each slice runs at most messages messages, or any
+			number if 0. With a time budget, a slice also ends once it has taken that many
+			microseconds, measured with the CPU's cycle counter. The clock is read between
+			chunks of messages, sized from the cost of each object's messages so far.
+			Defaults to 100 messages and no time budget. Set before threads call run().
+		 */
+		void set_quantum(int messages, int microseconds=0);
+		int get_quantum_messages() const { return m_quantum_messages; }
+		int get_quantum_microseconds() const { return m_quantum_microseconds; }
+
+		/*	Waits for external events such as I/O readiness.
+			When a thread in run() runs out of work, it calls poll() instead of parking,
+			so events are handled on the same threads as messages, without a thread
+			dedicated to waiting. Only one thread polls at a time.
+			A poller should call start_work() while it has events to wait for,
+			and stop_work() when it has none, so that run() does not return early.
+		 */
+		struct poller
+		{
+			virtual ~poller() { }
+
+			// Waits up to timeout_ms for events, and handles them, usually by sending messages.
+			virtual void poll(int timeout_ms)=0;
+
+			// Makes poll() return promptly. Called from any thread.
+			virtual void interrupt() throw()=0;
+
+			// Called by a worker after each slice of messages, so that requests queued
+			// by those messages can be submitted together. Should be cheap when there
+			// is nothing to do.
+			virtual void flush() { }
+		};
+
+		/*	Sets the poller, or 0 for none. Set before threads call run().
+			Waits until no other thread is using the previous poller, interrupting
+			it if a thread is waiting in it, so that it can then be destroyed,
+			even while threads are still in run().
+		 */
+		void set_poller(poller * p);
+		poller * get_poller() const { return m_poller.load(); }
+
+		/*	Runs cb->fire() on a thread in run() once delay has passed, and then every
+			period if period is non-zero. See active/timer.hpp for sending messages.
+			Expired timers are handled by idle threads, or every few slices by busy ones,
+			and a parked thread sleeps until the next one is due.
+			A pending timer counts as work, so run() does not return until every
+			one-shot timer has fired, and every periodic timer has been cancelled.
+		 */
+		timer_id add_timer(timer_wheel::clock::duration delay, timer_wheel::clock::duration period,
+			const timer_wheel::callback_ptr & cb);
+
+		// Returns false if the timer has already fired, or was cancelled.
+		bool cancel_timer(timer_id id);
+
+		/*	Pins each thread which calls run() or run_until() to a CPU, in the order
+			given by topology::system().placement(), one CPU per worker, wrapping around
+			if there are more workers than CPUs. Idle threads then steal from workers on
+			an SMT sibling first, then the same last-level cache, then further away.
+			Disabled by default. Set before threads call run().
+		 */
+		void set_pinning(bool enabled);
+		bool get_pinning() const { return !m_placement.empty(); }
+#endif
+
 	private:
+		scheduler(const scheduler&);
+		scheduler & operator=(const scheduler&);
+
+		const policy::scheduling m_mode;
 		platform::mutex m_mutex;
 		platform::condition_variable m_ready;
 #ifdef ACTIVE_USE_CXX11
 		atomic_fifo m_activated_objects;
+		atomic_fifo m_lanes[scheduler_lanes-1];	// Activated objects in lanes 1 and above
+		std::atomic<int> m_lane_count;	// Objects in m_lanes
+
+		any_object * m_deadlines;	// Root of the heap of activated objects in earliest_deadline mode
+		platform::mutex m_deadline_mutex;
+		unsigned long long m_deadline_sequence;	// Protected by m_deadline_mutex
+		std::atomic<int> m_deadline_count;	// Objects in m_deadlines
 		std::atomic<int> m_busy_count;
+		std::atomic<worker*> m_workers;	// Never shrinks; workers are recycled.
+		std::atomic<int> m_worker_count;
+		std::vector<int> m_placement;	// CPUs to pin workers to, or empty
+		worker * m_idle;	// Parked workers, protected by m_mutex.
+		std::atomic<int> m_parked, m_spinning;
+		std::atomic<int> m_idle_waiters;	// Threads in wait_idle()
+		bool m_run_next;
+		std::atomic<poller*> m_poller;
+		std::atomic<int> m_poller_users;	// Threads calling m_poller, see poller_use
+		std::atomic<bool> m_polling;	// A thread is inside poll()
+		int m_quantum_messages, m_quantum_microseconds;
+		unsigned long long m_quantum_cycles;	// Time budget, or 0 for none
+		timer_wheel m_timers;
+		platform::mutex m_timer_mutex;
+		std::atomic<timer_wheel::clock::rep> m_next_timer;	// Since the clock's epoch
+		worker * m_timer_waiter;	// The parked worker which wakes for the next timer, protected by m_mutex.
+
+		worker * current_worker() const throw();
+		worker * attach_worker();
+		atomic_node * steal(worker * thief) throw();
+		void find_victims(worker * thief);
+		atomic_node * take_run_next(worker * w) throw();
+		atomic_node * pop_lane(worker * w, bool rotate) throw();
+		void push_deadline(any_object * p) throw();
+		atomic_node * pop_deadline() throw();
+		bool has_work() const throw();
+		void park(worker * w, const std::atomic<bool> * stop);
+		bool poll(worker * w, const std::atomic<bool> * stop);
+		struct poller_use;
+		void interrupt_poller() throw();
+		void flush_poller();
+		void wake_one() throw();
+		void notify_idle() throw();
+		timer_wheel::clock::time_point next_timer() const throw();
+		void set_next_timer(timer_wheel::clock::time_point t) throw();
+		bool expire_timers();
+		friend int active::begin_slice(any_object*, int) throw();
+		friend int active::continue_slice(any_object*, int) throw();
+		friend void active::raise_deadline(scheduler&, any_object*, deadline_type) throw();
 #else
 		any_object * m_head;
 		int m_busy_count;	// Used to work out when we have actually finished.
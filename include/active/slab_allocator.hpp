@@ -0,0 +1,102 @@
+#ifndef ACTIVE_SLAB_ALLOCATOR_INCLUDED
+#define ACTIVE_SLAB_ALLOCATOR_INCLUDED
+
+#include <active/config.hpp>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace active
+{
+	/*	Memory for small objects such as queued messages. Requires ACTIVE_USE_CXX11.
+		Blocks are grouped into size classes. Each thread caches free blocks of each class,
+		and exchanges batches of them with a short spin-locked depot, so memory freed on
+		one thread can be reused on another without taking a mutex.
+		Memory is never returned to the system.
+	 */
+	namespace slab
+	{
+		// Larger blocks are allocated with operator new.
+		const std::size_t max_size = 512;
+
+		void * allocate(std::size_t bytes);
+		void deallocate(void * p, std::size_t bytes) throw();
+	}
+
+	// Standard allocator using active::slab.
+	template<typename T>
+	class slab_allocator
+	{
+	public:
+		typedef T value_type;
+		typedef T * pointer;
+		typedef const T * const_pointer;
+		typedef T & reference;
+		typedef const T & const_reference;
+		typedef std::size_t size_type;
+		typedef std::ptrdiff_t difference_type;
+
+		template<typename U> struct rebind { typedef slab_allocator<U> other; };
+
+		slab_allocator() throw() { }
+		template<typename U> slab_allocator(const slab_allocator<U>&) throw() { }
+
+		pointer address(reference x) const { return &x; }
+		const_pointer address(const_reference x) const { return &x; }
+
+		pointer allocate(size_type n, const void * =0)
+		{
+			return static_cast<pointer>(slab::allocate(n*sizeof(T)));
+		}
+
+		void deallocate(pointer p, size_type n)
+		{
+			slab::deallocate(p, n*sizeof(T));
+		}
+
+		size_type max_size() const throw() { return size_type(-1)/sizeof(T); }
+
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+		template<typename U, typename... Args>
+		void construct(U * p, Args&&... args)
+		{
+			::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+		}
+#else
+		void construct(pointer p, const T & v)
+		{
+			::new(static_cast<void*>(p)) T(v);
+		}
+#endif
+
+		template<typename U>
+		void destroy(U * p)
+		{
+			p->~U();
+		}
+	};
+
+	template<>
+	class slab_allocator<void>
+	{
+	public:
+		typedef void value_type;
+		typedef void * pointer;
+		typedef const void * const_pointer;
+		typedef std::size_t size_type;
+		typedef std::ptrdiff_t difference_type;
+
+		template<typename U> struct rebind { typedef slab_allocator<U> other; };
+
+		slab_allocator() throw() { }
+		template<typename U> slab_allocator(const slab_allocator<U>&) throw() { }
+	};
+
+	template<typename T, typename U>
+	bool operator==(const slab_allocator<T>&, const slab_allocator<U>&) { return true; }
+
+	template<typename T, typename U>
+	bool operator!=(const slab_allocator<T>&, const slab_allocator<U>&) { return false; }
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef ACTIVE_TIMER_INCLUDED
+#define ACTIVE_TIMER_INCLUDED
+
+#include "scheduler.hpp"
+
+// Delayed and periodic messages. Requires ACTIVE_USE_CXX11.
+
+namespace active
+{
+	namespace timer
+	{
+		template<typename Obj, typename Msg>
+		struct send_to : public timer_wheel::callback
+		{
+			send_to(Obj & obj, const Msg & msg) : m_obj(obj), m_msg(msg) { }
+			void fire() { m_obj(m_msg); }
+			Obj & m_obj;
+			const Msg m_msg;
+		};
+
+		// Does nothing once the object has been destroyed.
+		template<typename Obj, typename Msg>
+		struct send_to_weak : public timer_wheel::callback
+		{
+			send_to_weak(const platform::shared_ptr<Obj> & obj, const Msg & msg) : m_obj(obj), m_msg(msg) { }
+			void fire()
+			{
+				if( platform::shared_ptr<Obj> obj = m_obj.lock() ) (*obj)(m_msg);
+			}
+			platform::weak_ptr<Obj> m_obj;
+			const Msg m_msg;
+		};
+	}
+
+	// Sends msg to obj once delay has passed. The object must outlive the timer.
+	template<typename Obj, typename Msg>
+	timer_id send_after(Obj & obj, std::chrono::nanoseconds delay, const Msg & msg)
+	{
+		return obj.get_scheduler().add_timer(delay, std::chrono::nanoseconds::zero(),
+			std::make_shared< timer::send_to<Obj,Msg> >(obj, msg));
+	}
+
+	// Sends msg to a shared object once delay has passed, unless the object has been destroyed.
+	template<typename Obj, typename Msg>
+	timer_id send_after(platform::shared_ptr<Obj> obj, std::chrono::nanoseconds delay, const Msg & msg)
+	{
+		return obj->get_scheduler().add_timer(delay, std::chrono::nanoseconds::zero(),
+			std::make_shared< timer::send_to_weak<Obj,Msg> >(obj, msg));
+	}
+
+	// Sends msg to obj every period, starting one period from now, until the timer is cancelled.
+	template<typename Obj, typename Msg>
+	timer_id send_every(Obj & obj, std::chrono::nanoseconds period, const Msg & msg)
+	{
+		return obj.get_scheduler().add_timer(period, period,
+			std::make_shared< timer::send_to<Obj,Msg> >(obj, msg));
+	}
+
+	template<typename Obj, typename Msg>
+	timer_id send_every(platform::shared_ptr<Obj> obj, std::chrono::nanoseconds period, const Msg & msg)
+	{
+		return obj->get_scheduler().add_timer(period, period,
+			std::make_shared< timer::send_to_weak<Obj,Msg> >(obj, msg));
+	}
+
+	// Cancels a timer for obj. Returns false if it has already fired or been cancelled.
+	template<typename Obj>
+	bool cancel_timer(Obj & obj, timer_id id)
+	{
+		return obj.get_scheduler().cancel_timer(id);
+	}
+
+	template<typename Obj>
+	bool cancel_timer(platform::shared_ptr<Obj> obj, timer_id id)
+	{
+		return obj->get_scheduler().cancel_timer(id);
+	}
+}
+
+#endif
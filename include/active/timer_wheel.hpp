@@ -0,0 +1,89 @@
+#ifndef ACTIVE_TIMER_WHEEL_INCLUDED
+#define ACTIVE_TIMER_WHEEL_INCLUDED
+
+#include <active/config.hpp>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+namespace active
+{
+	// Identifies a timer, so that it can be cancelled.
+	struct timer_id
+	{
+		unsigned index, generation;
+	};
+
+	/*	Hierarchical timing wheel. Requires ACTIVE_USE_CXX11.
+		Timers are kept in 4 levels of 256 slots, with a resolution of 1ms at the
+		lowest level and 256 times coarser at each level above, which covers
+		about 49 days. Later timers are held in the top level until they come
+		into range. Adding and cancelling are O(1), and expiring is O(1) per
+		timer, plus moving each timer down at most once per level.
+		Timers never expire early, and expire up to 1ms late.
+		Not thread-safe; scheduler protects its wheel with a mutex.
+	 */
+	class timer_wheel
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+		typedef std::chrono::milliseconds tick;
+
+		struct callback
+		{
+			virtual ~callback() { }
+			virtual void fire()=0;
+		};
+
+		typedef std::shared_ptr<callback> callback_ptr;
+
+		timer_wheel();
+
+		// A period of zero means the timer expires only once.
+		timer_id add(clock::time_point deadline, clock::duration period, const callback_ptr & cb);
+
+		// Returns false if the timer has already expired or been cancelled.
+		bool cancel(timer_id id);
+
+		// Moves the wheel forward to now, and appends the callbacks of expired timers to due.
+		// Periodic timers are rescheduled, skipping any periods which have been missed.
+		// Returns the number of timers removed.
+		std::size_t expire(clock::time_point now, std::vector<callback_ptr> & due);
+
+		// No timer expires before this, or time_point::max() if there are none.
+		clock::time_point next_expiry() const;
+
+		std::size_t size() const { return m_size; }
+
+	private:
+		enum { levels=4, slot_bits=8, slots=1<<slot_bits, mask=slots-1 };
+		typedef unsigned long long ticks;
+
+		struct node
+		{
+			ticks deadline, period;
+			callback_ptr cb;
+			unsigned generation;
+			int slot;	// level*slots + index, or -1 if free
+			int prev, next;	// In the slot, or the free list
+		};
+
+		ticks to_ticks(clock::time_point t, bool round_up) const;
+		void insert(int n);
+		void unlink(int n);
+		void release(int n);
+		void cascade(int level);
+		int distance(int level, int from) const;
+
+		clock::time_point m_origin;
+		ticks m_now;
+		std::vector<node> m_nodes;
+		int m_free;
+		std::size_t m_size;
+		int m_heads[levels*slots];
+		unsigned long long m_bits[levels][slots/64];	// Non-empty slots
+	};
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef ACTIVE_TOPOLOGY_INCLUDED
+#define ACTIVE_TOPOLOGY_INCLUDED
+
+#include <active/config.hpp>
+#include <string>
+#include <vector>
+
+namespace active
+{
+	/*	The CPUs which the process may run on, and how they share cores, caches,
+		packages and NUMA nodes. On Linux this is read from /sys/devices/system/cpu,
+		restricted to the process's affinity mask, which includes its cgroup cpuset.
+		The cgroup CPU quota limits concurrency(), which sizes a default run or pool.
+		Elsewhere each of hardware_concurrency() CPUs is treated as a separate core.
+	 */
+	class topology
+	{
+	public:
+		struct cpu
+		{
+			int id;	// Logical CPU number
+			int core, package, node;
+			int cache;	// The lowest id of the CPUs sharing its last-level cache
+		};
+
+		// The topology of this machine, read once.
+		static const topology & system();
+
+		// Reads a sysfs cpu directory, and optionally a cgroup directory.
+		// Used for testing; does not apply the affinity mask.
+		explicit topology(const std::string & cpu_dir, const std::string & cgroup_dir = std::string());
+
+		const std::vector<cpu> & cpus() const { return m_cpus; }
+
+		// The CPUs allowed by the cgroup quota, or 0 if unlimited.
+		double get_quota() const { return m_quota; }
+
+		// How many threads can usefully run at once: the number of CPUs,
+		// limited by the quota, and at least 1.
+		int concurrency() const;
+
+		/*	How far apart two logical CPUs are: 0 for the same CPU, 1 for SMT
+			siblings, 2 for a shared last-level cache, 3 for the same package or
+			NUMA node, and 4 otherwise, or if either CPU is not known.
+		 */
+		int distance(int cpu1, int cpu2) const;
+
+		// The CPUs to place successive workers on. Fills the physical cores of
+		// one package before the next, then their SMT siblings.
+		std::vector<int> placement() const;
+
+		// Pins the calling thread to a logical CPU. Returns false if not supported.
+		static bool pin(int cpu);
+
+	private:
+		static topology read_system();
+		void read_cgroup(const std::string & dir);
+		void restrict(const std::vector<int> & allowed);
+		const cpu * find(int id) const;
+
+		std::vector<cpu> m_cpus;	// In order of id
+		double m_quota;
+	};
+}
+
+#endif
@@ -3,27 +3,698 @@
 #include <active/thread.hpp>
 #include <active/direct.hpp>
 #include <active/synchronous.hpp>
+#include <active/topology.hpp>
 #include <cstdio>
+#include <algorithm>
 
 // Various tweaks which can affect performance:
 
-// Whether to use a condition variable to signal to waiting worker threads.
-// Set to 0 because this gives a performance penalty.
+// Without C++11 atomics, whether to use a condition variable to signal to
+// waiting worker threads. Set to 0 because this gives a performance penalty.
+// C++11 builds park idle workers instead, see scheduler::park().
 #define ACTIVE_OBJECT_CONDITION 0
 
+// How many times an idle worker checks for work before parking.
+#define ACTIVE_OBJECT_SPIN_COUNT 100
+
+// In work_stealing mode, how often a worker looks at the shared queue before
+// its own run queue, so that objects activated from outside are not starved.
+#define ACTIVE_OBJECT_SHARED_QUEUE_INTERVAL 61
+
+// How many objects in a row a worker may take from its run-next slot before
+// it looks at the queues, so that a pair of objects cannot starve the rest.
+#define ACTIVE_OBJECT_RUN_NEXT_LIMIT 16
+
+// How long an idle worker waits in scheduler::poller::poll() before checking
+// for work again, in milliseconds.
+#define ACTIVE_OBJECT_POLL_TIMEOUT 50
+
+// How many objects a busy worker runs between checks for expired timers.
+#define ACTIVE_OBJECT_TIMER_INTERVAL 64
+
+// With a time budget, the most messages that an object runs between
+// readings of the clock.
+#define ACTIVE_OBJECT_MAX_QUANTUM 65536
+
+// How often a worker takes an object from a lower priority lane first,
+// so that lower lanes are not starved.
+#define ACTIVE_OBJECT_LANE_INTERVAL 8
+
+#ifdef ACTIVE_USE_CXX11
+	#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		#include <intrin.h>
+		#define ACTIVE_HAS_TSC 1
+	#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		#include <x86intrin.h>
+		#define ACTIVE_HAS_TSC 1
+	#endif
+	#include <climits>
+
+struct active::scheduler::worker
+{
+	worker(scheduler & s) : m_scheduler(s), m_next(nullptr), m_in_use(true), m_tick(0), m_lane_tick(0),
+		m_cpu(-1), m_victims_for(0), m_run_next(nullptr), m_running(nullptr), m_run_next_count(0),
+		m_polling(false), m_next_idle(nullptr), m_wakeup(false)
+	{
+		m_slice.start = 0;
+	}
+	scheduler & m_scheduler;
+	worker * m_next;
+	std::atomic<bool> m_in_use;
+	unsigned m_tick, m_lane_tick;
+	run_queue m_queue;
+
+	// With pinning, the CPU that threads using this worker are pinned to,
+	// and the other workers in the order to steal from, nearest first.
+	int m_cpu;
+	std::vector<worker*> m_victims;
+	int m_victims_for;	// The number of workers when m_victims was found
+
+	// The object this thread activated most recently, which it runs next.
+	// Only the owner puts objects here, but idle workers may take them.
+	std::atomic<atomic_node*> m_run_next;
+	any_object * m_running;	// Not put in m_run_next when it reactivates itself
+	unsigned m_run_next_count;
+
+	// The slice of m_running, if there is a time budget. See begin_slice().
+	struct slice
+	{
+		unsigned long long start, chunk_start;	// Cycles; start is 0 without a time budget
+		int left;	// Messages
+	} m_slice;
+	bool m_polling;	// Inside scheduler::poller::poll()
+
+	// Parking, protected by scheduler::m_mutex.
+	worker * m_next_idle;
+	bool m_wakeup;
+	platform::condition_variable m_wake;
+};
+
+namespace
+{
+	// The worker of the current thread, or null if not inside scheduler::run().
+	ACTIVE_THREAD_LOCAL active::scheduler::worker * this_worker = nullptr;
+
+	// How many scheduler::poller_use are alive in the current thread.
+	ACTIVE_THREAD_LOCAL int this_poller_uses = 0;
+
+	// A cheap clock for timing slices. The time-stamp counter runs at a
+	// constant rate on current x86 processors.
+	inline unsigned long long cycles() throw()
+	{
+#ifdef ACTIVE_HAS_TSC
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	double measure_cycles_per_microsecond()
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const unsigned long long start_cycles = cycles();
+		std::chrono::steady_clock::duration elapsed;
+		do
+			elapsed = std::chrono::steady_clock::now() - start;
+		while( elapsed < std::chrono::milliseconds(2) );
+		return (cycles() - start_cycles) / std::chrono::duration<double, std::micro>(elapsed).count();
+	}
+
+	double cycles_per_microsecond()
+	{
+		static const double rate = measure_cycles_per_microsecond();
+		return rate;
+	}
+}
+#endif
+
 // Our global variable, the scheduler.
 // I generally hate global variables, but actually this one makes sense since
 // it appears to offer some background facility such as a memory allocator
 // or a thread. Use of this is optional.
 active::scheduler active::default_scheduler;
 
-active::scheduler::scheduler() : m_busy_count(0)
+active::scheduler::scheduler(policy::scheduling mode) : m_mode(mode), m_busy_count(0)
 {
-#ifndef ACTIVE_USE_CXX11
+#ifdef ACTIVE_USE_CXX11
+	m_workers = nullptr;
+	m_worker_count = 0;
+	m_lane_count = 0;
+	m_deadlines = nullptr;
+	m_deadline_sequence = 0;
+	m_deadline_count = 0;
+	m_idle = nullptr;
+	m_parked = 0;
+	m_spinning = 0;
+	m_idle_waiters = 0;
+	m_run_next = true;
+	m_poller = nullptr;
+	m_poller_users = 0;
+	m_polling = false;
+	m_next_timer = timer_wheel::clock::time_point::max().time_since_epoch().count();
+	m_timer_waiter = nullptr;
+	m_quantum_messages = 100;
+	m_quantum_microseconds = 0;
+	m_quantum_cycles = 0;
+#else
 	m_head = nullptr;
 #endif
 }
 
+active::scheduler::~scheduler()
+{
+#ifdef ACTIVE_USE_CXX11
+	for(worker * w=m_workers; w; )
+	{
+		worker * next = w->m_next;
+		delete w;
+		w = next;
+	}
+#endif
+}
+
+#ifdef ACTIVE_USE_CXX11
+active::scheduler::worker * active::scheduler::current_worker() const throw()
+{
+	worker * w = this_worker;
+	return w && &w->m_scheduler==this ? w : nullptr;
+}
+
+// Finds a worker which is not in use, or creates a new one.
+// Workers are never removed from the list, so other threads can safely
+// traverse it to steal work.
+active::scheduler::worker * active::scheduler::attach_worker()
+{
+	for(worker * w=m_workers.load(std::memory_order_acquire); w; w=w->m_next)
+	{
+		bool in_use=false;
+		if( w->m_in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire) )
+			return w;
+	}
+
+	worker * w = new worker(*this);
+	const int index = m_worker_count.fetch_add(1);
+	if( !m_placement.empty() )
+		w->m_cpu = m_placement[index % m_placement.size()];
+	w->m_next = m_workers.load(std::memory_order_relaxed);
+	while( !m_workers.compare_exchange_weak(w->m_next, w, std::memory_order_release, std::memory_order_relaxed) )
+		;
+	return w;
+}
+
+active::atomic_node * active::scheduler::take_run_next(worker * w) throw()
+{
+	return w->m_run_next.load(std::memory_order_relaxed) ?
+		w->m_run_next.exchange(nullptr, std::memory_order_acquire) : nullptr;
+}
+
+void active::scheduler::set_pinning(bool enabled)
+{
+	m_placement = enabled ? topology::system().placement() : std::vector<int>();
+}
+
+// Orders the other workers by their distance from the thief, and then
+// round-robin starting after the thief. Found again when workers are added.
+void active::scheduler::find_victims(worker * thief)
+{
+	const int count = m_worker_count.load(std::memory_order_acquire);
+	std::vector<worker*> victims;
+	worker * first = thief->m_next ? thief->m_next : m_workers.load(std::memory_order_acquire);
+	for(worker * w=first; w; )
+	{
+		if( w!=thief ) victims.push_back(w);
+		w = w->m_next ? w->m_next : m_workers.load(std::memory_order_acquire);
+		if( w==first ) break;
+	}
+
+	const topology & t = topology::system();
+	const int cpu = thief->m_cpu;
+	std::stable_sort(victims.begin(), victims.end(),
+		[&](worker * a, worker * b) { return t.distance(cpu, a->m_cpu) < t.distance(cpu, b->m_cpu); });
+	thief->m_victims.swap(victims);
+	thief->m_victims_for = count;
+}
+
+// Takes an object from another worker's run queue or run-next slot.
+// Victims are visited round-robin starting after the thief, or nearest
+// first with pinning.
+active::atomic_node * active::scheduler::steal(worker * thief) throw()
+{
+	if( thief && thief->m_cpu!=-1 )
+	{
+		try
+		{
+			if( thief->m_victims_for != m_worker_count.load(std::memory_order_relaxed) )
+				find_victims(thief);
+			for(std::size_t i=0; i<thief->m_victims.size(); ++i)
+			{
+				worker * w = thief->m_victims[i];
+				atomic_node * n = w->m_queue.pop();
+				if( !n ) n = take_run_next(w);
+				if( n ) return n;
+			}
+			return nullptr;
+		}
+		catch(...)
+		{
+			// Out of memory; visit workers in list order instead.
+		}
+	}
+
+	worker * first = thief && thief->m_next ? thief->m_next : m_workers.load(std::memory_order_acquire);
+	for(worker * w=first; w; )
+	{
+		if( w!=thief )
+		{
+			atomic_node * n = w->m_queue.pop();
+			if( !n ) n = take_run_next(w);
+			if( n ) return n;
+		}
+		w = w->m_next ? w->m_next : m_workers.load(std::memory_order_acquire);
+		if( w==first ) break;
+	}
+	return nullptr;
+}
+
+/*	Takes an object from the highest non-empty lane above 0.
+	Every ACTIVE_OBJECT_LANE_INTERVAL calls, a worker starts from a lower lane
+	instead, taking each lane in turn, and returns null on lane 0's turn so that
+	the caller looks at lane 0 first.
+ */
+active::atomic_node * active::scheduler::pop_lane(worker * w, bool rotate) throw()
+{
+	int first = scheduler_lanes-1;
+	if( rotate && w && ++w->m_lane_tick % ACTIVE_OBJECT_LANE_INTERVAL == 0 )
+	{
+		first = int(w->m_lane_tick / ACTIVE_OBJECT_LANE_INTERVAL % scheduler_lanes);
+		if( first==0 ) return nullptr;
+	}
+
+	for( int i=0; i<scheduler_lanes-1; ++i )
+	{
+		// first, first-1, ..., 1, then the lanes above first
+		const int lane = i<first ? first-i : scheduler_lanes-1-(i-first);
+		if( atomic_node * n = m_lanes[lane-1].pop() )
+		{
+			m_lane_count.fetch_sub(1, std::memory_order_relaxed);
+			return n;
+		}
+	}
+	return nullptr;
+}
+
+namespace
+{
+	bool earlier(const active::any_object * a, const active::any_object * b)
+	{
+		return a->m_deadline < b->m_deadline ||
+			(a->m_deadline == b->m_deadline && a->m_heap_sequence < b->m_heap_sequence);
+	}
+
+	// Makes the later root the first child of the earlier one.
+	active::any_object * meld(active::any_object * a, active::any_object * b)
+	{
+		if( earlier(b, a) ) std::swap(a, b);
+		b->m_heap_prev = a;
+		b->m_heap_next = a->m_heap_child;
+		if( a->m_heap_child ) a->m_heap_child->m_heap_prev = b;
+		a->m_heap_child = b;
+		return a;
+	}
+
+	// Melds a list of siblings into one heap, by pairs from the left, then from the right.
+	active::any_object * meld_siblings(active::any_object * first)
+	{
+		active::any_object * pairs = 0;	// Linked in reverse
+		while( first )
+		{
+			active::any_object * a = first, * b = a->m_heap_next;
+			first = b ? b->m_heap_next : 0;
+			a->m_heap_next = 0;
+			if( b )
+			{
+				b->m_heap_next = 0;
+				a = meld(a, b);
+			}
+			a->m_heap_next = pairs;
+			pairs = a;
+		}
+
+		active::any_object * root = 0;
+		while( active::any_object * a = pairs )
+		{
+			pairs = a->m_heap_next;
+			a->m_heap_next = 0;
+			root = root ? meld(root, a) : a;
+		}
+		if( root ) root->m_heap_prev = 0;
+		return root;
+	}
+}
+
+/*	In earliest_deadline mode, objects in lane 0 are kept in a heap ordered by
+	the deadline of their next message, and then by the order activated.
+	It is a pairing heap linked through the objects themselves, so activate()
+	does not allocate, and an object can move up when it is sent an earlier message.
+ */
+void active::scheduler::push_deadline(any_object * p) throw()
+{
+	platform::lock_guard<platform::mutex> lock(m_deadline_mutex);
+	p->m_heap_child = p->m_heap_next = p->m_heap_prev = nullptr;
+	p->m_heap_sequence = m_deadline_sequence++;
+	m_deadlines = m_deadlines ? meld(m_deadlines, p) : p;
+	m_deadline_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+active::atomic_node * active::scheduler::pop_deadline() throw()
+{
+	if( !m_deadline_count.load(std::memory_order_relaxed) ) return nullptr;
+	platform::lock_guard<platform::mutex> lock(m_deadline_mutex);
+	any_object * p = m_deadlines;
+	if( !p ) return nullptr;
+	m_deadlines = meld_siblings(p->m_heap_child);
+	p->m_heap_child = nullptr;
+	m_deadline_count.fetch_sub(1, std::memory_order_relaxed);
+	return p;
+}
+
+// Only objects still waiting in the heap move; those already running
+// pick up the message themselves.
+void active::raise_deadline(scheduler & sched, any_object * obj, deadline_type d) throw()
+{
+	if( sched.m_mode!=policy::earliest_deadline || !sched.m_deadline_count.load(std::memory_order_relaxed) )
+		return;
+
+	platform::lock_guard<platform::mutex> lock(sched.m_deadline_mutex);
+	if( (!obj->m_heap_prev && obj!=sched.m_deadlines) || !(d < obj->m_deadline) )
+		return;
+
+	obj->m_deadline = d;
+	if( obj==sched.m_deadlines ) return;
+
+	// Cut the object and its children from the heap, and meld them back in.
+	any_object * prev = obj->m_heap_prev;
+	if( prev->m_heap_child==obj ) prev->m_heap_child = obj->m_heap_next;
+	else prev->m_heap_next = obj->m_heap_next;
+	if( obj->m_heap_next ) obj->m_heap_next->m_heap_prev = prev;
+	obj->m_heap_next = obj->m_heap_prev = nullptr;
+	sched.m_deadlines = meld(sched.m_deadlines, obj);
+}
+
+bool active::scheduler::has_work() const throw()
+{
+	if( !m_activated_objects.empty() || m_lane_count.load(std::memory_order_relaxed) ) return true;
+	if( m_deadline_count.load(std::memory_order_relaxed) ) return true;
+	for(worker * w=m_workers.load(std::memory_order_acquire); w; w=w->m_next)
+		if( !w->m_queue.empty() || w->m_run_next.load(std::memory_order_relaxed) ) return true;
+	return false;
+}
+
+/*	Blocks an idle worker until activate() or the end of work wakes it.
+	The worker announces itself in m_parked before looking for work one
+	last time, and activate() publishes work before reading m_parked, so
+	one of them is guaranteed to see the other.
+ */
+void active::scheduler::park(worker * w, const std::atomic<bool> * stop)
+{
+	platform::unique_lock<platform::mutex> lock(m_mutex);
+	m_parked.fetch_add(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if( has_work() || (stop ? stop->load() : m_busy_count==0) )
+	{
+		m_parked.fetch_sub(1);
+		return;
+	}
+	w->m_wakeup = false;
+	w->m_next_idle = m_idle;
+	m_idle = w;
+
+	// One parked worker sleeps only until the next timer is due.
+	// add_timer() wakes it if an earlier timer is added.
+	if( !m_timer_waiter && next_timer() != timer_wheel::clock::time_point::max() )
+		m_timer_waiter = w;
+
+	while( !w->m_wakeup )
+	{
+		const timer_wheel::clock::time_point deadline = m_timer_waiter==w ?
+			next_timer() : timer_wheel::clock::time_point::max();
+		if( deadline == timer_wheel::clock::time_point::max() )
+			w->m_wake.wait(lock);
+		else if( timer_wheel::clock::now() >= deadline )
+			break;
+		else
+#ifdef ACTIVE_USE_BOOST
+			w->m_wake.timed_wait(lock, boost::posix_time::milliseconds(
+				1 + std::chrono::duration_cast<std::chrono::milliseconds>(deadline - timer_wheel::clock::now()).count()));
+#else
+			w->m_wake.wait_until(lock, deadline);
+#endif
+	}
+
+	if( m_timer_waiter == w )
+		m_timer_waiter = nullptr;
+
+	if( !w->m_wakeup )
+	{
+		// Timed out, so nobody removed us from the idle list.
+		worker ** p = &m_idle;
+		while( *p != w ) p = &(*p)->m_next_idle;
+		*p = w->m_next_idle;
+		m_parked.fetch_sub(1);
+	}
+}
+
+/*	Holds the poller while a thread calls it, so that set_poller() can wait
+	until the previous poller is no longer used. The count is raised before
+	the pointer is loaded, so set_poller() either sees the count, or this
+	sees the new pointer.
+ */
+struct active::scheduler::poller_use
+{
+	poller_use(scheduler & s) : m_scheduler(s)
+	{
+		m_scheduler.m_poller_users.fetch_add(1);
+		++this_poller_uses;
+		p = m_scheduler.m_poller.load();
+	}
+
+	~poller_use()
+	{
+		--this_poller_uses;
+		m_scheduler.m_poller_users.fetch_sub(1);
+	}
+
+	scheduler & m_scheduler;
+	poller * p;
+};
+
+void active::scheduler::set_poller(poller * p)
+{
+	poller * previous = m_poller.exchange(p);
+	if( !previous || previous==p ) return;
+
+	// Uses by this thread, for example a poller destroyed by a message it sent, have to finish later.
+	while( m_poller_users.load() > this_poller_uses )
+	{
+		if( m_polling.load() ) previous->interrupt();
+		platform::this_thread::yield();
+	}
+}
+
+void active::scheduler::interrupt_poller() throw()
+{
+	poller_use use(*this);
+	if( use.p ) use.p->interrupt();
+}
+
+void active::scheduler::flush_poller()
+{
+	if( !m_poller.load(std::memory_order_relaxed) ) return;
+	poller_use use(*this);
+	if( use.p ) use.p->flush();
+}
+
+/*	Lets an idle worker wait in the poller instead of parking.
+	Returns false if another thread is already polling, or there is no poller.
+	As with park(), the worker announces itself in m_polling before looking for
+	work one last time, so activate() either sees it and interrupts the poll,
+	or has already published its work.
+ */
+bool active::scheduler::poll(worker * w, const std::atomic<bool> * stop)
+{
+	if( !m_poller.load(std::memory_order_relaxed) ) return false;
+	poller_use use(*this);
+	bool polling = false;
+	if( !use.p || !m_polling.compare_exchange_strong(polling, true) )
+		return false;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if( !has_work() && !(stop ? stop->load() : m_busy_count==0) )
+	{
+		int timeout = ACTIVE_OBJECT_POLL_TIMEOUT;
+		const timer_wheel::clock::time_point t = next_timer();
+		if( t != timer_wheel::clock::time_point::max() )
+		{
+			const timer_wheel::clock::duration d = t - timer_wheel::clock::now();
+			if( d < std::chrono::milliseconds(timeout) )
+				timeout = d > timer_wheel::clock::duration::zero() ?
+					int(std::chrono::duration_cast<std::chrono::milliseconds>(d).count()) + 1 : 0;
+		}
+		w->m_polling = true;
+		use.p->poll(timeout);
+		w->m_polling = false;
+	}
+	m_polling.store(false);
+	return true;
+}
+
+void active::scheduler::wake_one() throw()
+{
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+	if( worker * w = m_idle )
+	{
+		m_idle = w->m_next_idle;
+		m_parked.fetch_sub(1);
+		w->m_wakeup = true;
+		w->m_wake.notify_one();
+	}
+}
+
+void active::scheduler::wake_all() throw()
+{
+	if( m_polling.load() ) interrupt_poller();
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+	while( worker * w = m_idle )
+	{
+		m_idle = w->m_next_idle;
+		m_parked.fetch_sub(1);
+		w->m_wakeup = true;
+		w->m_wake.notify_one();
+	}
+}
+
+// Called when m_busy_count reaches 0.
+void active::scheduler::notify_idle() throw()
+{
+	if( m_idle_waiters.load() )
+	{
+		platform::lock_guard<platform::mutex> lock(m_mutex);
+		m_ready.notify_all();
+	}
+}
+
+active::timer_wheel::clock::time_point active::scheduler::next_timer() const throw()
+{
+	return timer_wheel::clock::time_point( timer_wheel::clock::duration(m_next_timer.load()) );
+}
+
+void active::scheduler::set_next_timer(timer_wheel::clock::time_point t) throw()
+{
+	m_next_timer.store( t.time_since_epoch().count() );
+}
+
+active::timer_id active::scheduler::add_timer(timer_wheel::clock::duration delay, timer_wheel::clock::duration period,
+	const timer_wheel::callback_ptr & cb)
+{
+	const timer_wheel::clock::time_point deadline = timer_wheel::clock::now() + delay;
+	start_work();	// Until it fires or is cancelled
+	timer_id id;
+	bool earlier;
+	{
+		platform::lock_guard<platform::mutex> lock(m_timer_mutex);
+		id = m_timers.add(deadline, period, cb);
+		earlier = deadline < next_timer();
+		if( earlier ) set_next_timer(deadline);
+	}
+
+	if( earlier )
+	{
+		// Make sure that a thread waits for the new time.
+		worker * w = nullptr;
+		{
+			platform::lock_guard<platform::mutex> lock(m_mutex);
+			if( m_timer_waiter )
+			{
+				m_timer_waiter->m_wake.notify_one();
+				w = m_timer_waiter;
+			}
+		}
+		if( !w )
+		{
+			if( m_parked.load() ) wake_one();
+			if( m_polling.load() ) interrupt_poller();
+		}
+	}
+	return id;
+}
+
+bool active::scheduler::cancel_timer(timer_id id)
+{
+	bool cancelled;
+	{
+		platform::lock_guard<platform::mutex> lock(m_timer_mutex);
+		cancelled = m_timers.cancel(id);
+		if( cancelled ) set_next_timer(m_timers.next_expiry());
+	}
+	if( cancelled ) stop_work();
+	return cancelled;
+}
+
+/*	Fires the timers which are due, outside the lock, so that they can add
+	and cancel timers. Returns false if none were due, or another thread is
+	already expiring them.
+ */
+bool active::scheduler::expire_timers()
+{
+	const timer_wheel::clock::time_point now = timer_wheel::clock::now();
+	if( now < next_timer() ) return false;
+
+	std::vector<timer_wheel::callback_ptr> due;
+	std::size_t removed;
+	{
+		platform::unique_lock<platform::mutex> lock(m_timer_mutex, platform::try_to_lock);
+		if( !lock.owns_lock() ) return false;
+		removed = m_timers.expire(now, due);
+		set_next_timer(m_timers.next_expiry());
+	}
+
+	for( std::size_t i=0; i<due.size(); ++i )
+	{
+		try
+		{
+			due[i]->fire();
+		}
+		catch( ... )
+		{
+			fprintf(stderr, "Unhandled exception in timer\n");
+		}
+	}
+
+	// Only now, so that the messages sent keep run() going.
+	for( ; removed>0; --removed )
+		stop_work();
+	return !due.empty();
+}
+
+void active::scheduler::set_quantum(int messages, int microseconds)
+{
+	m_quantum_messages = messages>0 ? messages : 0;
+	m_quantum_microseconds = microseconds>0 ? microseconds : 0;
+	m_quantum_cycles = m_quantum_microseconds ?
+		(unsigned long long)(m_quantum_microseconds * cycles_per_microsecond()) : 0;
+}
+
+void active::scheduler::wait_idle()
+{
+	platform::unique_lock<platform::mutex> lock(m_mutex);
+	m_idle_waiters.fetch_add(1);
+	while( m_busy_count.load()!=0 || has_work() )
+		m_ready.wait(lock);
+	m_idle_waiters.fetch_sub(1);
+}
+#endif
+
 active::any_object::~any_object()
 {
 }
@@ -32,7 +703,41 @@ active::any_object::~any_object()
 void active::scheduler::activate(ObjectPtr p) throw()
 {
 #ifdef ACTIVE_USE_CXX11
-	m_activated_objects.push(p);
+	worker * w = current_worker();
+	if( p->m_lane>0 )
+	{
+		// Lanes are shared, so that any worker runs the object next.
+		m_lanes[p->m_lane-1].push(p);
+		m_lane_count.fetch_add(1, std::memory_order_relaxed);
+	}
+	else if( m_mode==policy::earliest_deadline )
+	{
+		// Not run next, as that would go ahead of earlier deadlines.
+		push_deadline(p);
+	}
+	else
+	{
+		if( w && m_run_next && p!=w->m_running )
+		{
+			// The owner runs this next, but it may be partway through a long slice,
+			// so an idle worker is still woken below to steal it. An older object
+			// which is displaced is queued.
+			p = static_cast<ObjectPtr>(w->m_run_next.exchange(p, std::memory_order_acq_rel));
+		}
+
+		if( p && (!w || m_mode!=policy::work_stealing || !w->m_queue.push(p)) )
+			m_activated_objects.push(p);
+	}
+
+	// Only wake a worker if nobody is already looking for work.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if( !m_spinning.load(std::memory_order_relaxed) )
+	{
+		if( m_parked.load(std::memory_order_relaxed) )
+			wake_one();
+		else if( m_polling.load(std::memory_order_relaxed) && !(w && w->m_polling) )
+			interrupt_poller();
+	}
 #else
 	// Not using atomics
 	platform::lock_guard<platform::mutex> lock(m_mutex);
@@ -49,9 +754,47 @@ void active::scheduler::activate(ObjectPtr p) throw()
 bool active::scheduler::locked_run_one()
 {
 #ifdef ACTIVE_USE_CXX11
-	if(atomic_node * n = m_activated_objects.pop())
+	worker * w = current_worker();
+	atomic_node * n = nullptr;
+	if( m_lane_count.load(std::memory_order_relaxed) )
+		n = pop_lane(w, true);
+	if( !n && m_mode==policy::earliest_deadline )
+		n = pop_deadline();
+	if( !n && w && w->m_run_next_count < ACTIVE_OBJECT_RUN_NEXT_LIMIT && (n = take_run_next(w)) )
+		++w->m_run_next_count;
+
+	if( !n )
 	{
-		static_cast<ObjectPtr>(n)->run_some();
+		if( w ) w->m_run_next_count = 0;
+		if( m_mode==policy::work_stealing )
+		{
+			if( w && ++w->m_tick % ACTIVE_OBJECT_SHARED_QUEUE_INTERVAL == 0 )
+				n = m_activated_objects.pop();
+			if( !n && w ) n = w->m_queue.pop();
+		}
+		if( !n ) n = m_activated_objects.pop();
+		if( !n && w ) n = take_run_next(w);
+		if( !n ) n = steal(w);
+		if( !n && m_lane_count.load(std::memory_order_relaxed) ) n = pop_lane(w, false);
+	}
+
+	if( n )
+	{
+		ObjectPtr p = static_cast<ObjectPtr>(n);
+		const int limit = m_quantum_messages ? m_quantum_messages : INT_MAX;
+		if( w )
+		{
+			any_object * previous = w->m_running;
+			const worker::slice previous_slice = w->m_slice;
+			w->m_running = p;
+			w->m_slice.start = 0;
+			p->run_some(limit);
+			w->m_running = previous;
+			w->m_slice = previous_slice;
+		}
+		else
+			p->run_some(limit);
+		flush_poller();
 		return true;
 	}
 #else
@@ -76,12 +819,24 @@ bool active::scheduler::run_managed() throw()
 	platform::unique_lock<platform::mutex> lock(m_mutex);
 #endif
 	++m_busy_count;
+#ifdef ACTIVE_USE_CXX11
+	for( unsigned n=1; locked_run_one(); ++n )
+		if( n % ACTIVE_OBJECT_TIMER_INTERVAL == 0 )
+			expire_timers();
+#else
 	while( locked_run_one() )
 		;
+#endif
 
 	// Can be non-zero if the queues are empty, but other threads are processing.
 	// the result of processing could be to add more signalled objects.
+#ifdef ACTIVE_USE_CXX11
+	if( 0!=--m_busy_count ) return true;
+	notify_idle();
+	return false;
+#else
 	return 0!=--m_busy_count;
+#endif
 }
 
 bool active::scheduler::run_one()
@@ -98,7 +853,7 @@ bool active::scheduler::run_one()
 active::run::run(int num_threads, scheduler & sched) :
 	m_scheduler(sched)
 {
-	if( num_threads<1 ) num_threads=4;
+	if( num_threads<1 ) num_threads=topology::system().concurrency();
 	m_scheduler.start_work();	// Prevent threads from exiting prematurely
 	for( int t=0; t<num_threads; ++t )
 #ifdef ACTIVE_USE_BOOST
@@ -121,6 +876,30 @@ active::run::~run()
 
 void active::scheduler::run()
 {
+#ifdef ACTIVE_USE_CXX11
+	worker * previous = this_worker;
+	worker * w = this_worker = attach_worker();
+	if( w->m_cpu!=-1 ) topology::pin(w->m_cpu);
+
+	while( run_managed() )
+	{
+		// Other threads are still busy, so more work may arrive.
+		// Spin for a short while, then park until activate() wakes us.
+		m_spinning.fetch_add(1);
+		for(int spin=0; spin<ACTIVE_OBJECT_SPIN_COUNT && !has_work(); ++spin)
+			platform::this_thread::yield();
+		m_spinning.fetch_sub(1);
+		if( expire_timers() )
+			continue;
+		if( !poll(w, nullptr) )
+			park(w, nullptr);
+	}
+	wake_all();
+
+	// Our run queue is empty, otherwise run_managed() would not have returned.
+	w->m_in_use.store(false, std::memory_order_release);
+	this_worker = previous;
+#else
 	while( run_managed() )
 	{
 		platform::unique_lock<platform::mutex> lock(m_mutex);
@@ -135,8 +914,64 @@ void active::scheduler::run()
 #endif
 	}
 	m_ready.notify_one();
+#endif
+}
+
+#ifdef ACTIVE_USE_CXX11
+void active::scheduler::run_until(const std::atomic<bool> & stop)
+{
+	worker * previous = this_worker;
+	worker * w = this_worker = attach_worker();
+	if( w->m_cpu!=-1 ) topology::pin(w->m_cpu);
+
+	while( !stop.load() )
+	{
+		run_managed();
+		m_spinning.fetch_add(1);
+		for(int spin=0; spin<ACTIVE_OBJECT_SPIN_COUNT && !has_work() && !stop.load(std::memory_order_relaxed); ++spin)
+			platform::this_thread::yield();
+		m_spinning.fetch_sub(1);
+		if( expire_timers() )
+			continue;
+		if( !poll(w, &stop) )
+			park(w, &stop);
+	}
+
+	w->m_in_use.store(false, std::memory_order_release);
+	this_worker = previous;
 }
 
+active::pool::pool(int num_threads, scheduler & sched) :
+	m_scheduler(sched), m_stop(false)
+{
+	if( num_threads<1 ) num_threads=topology::system().concurrency();
+	for( int t=0; t<num_threads; ++t )
+#ifdef ACTIVE_USE_BOOST
+		m_threads.add_thread(new platform::thread( platform::bind(&scheduler::run_until, &sched, platform::cref(m_stop)) ) );
+#else
+		m_threads.push_back(platform::thread( platform::bind(&scheduler::run_until, &sched, platform::cref(m_stop)) ) );
+#endif
+}
+
+active::pool::~pool()
+{
+	m_scheduler.wait_idle();
+	m_stop = true;
+	m_scheduler.wake_all();
+#ifdef ACTIVE_USE_BOOST
+	m_threads.join_all();
+#else
+	for(threads::iterator t=m_threads.begin(); t!=m_threads.end(); ++t)
+		t->join();
+#endif
+}
+
+void active::pool::wait_idle()
+{
+	m_scheduler.wait_idle();
+}
+#endif
+
 void active::scheduler::run_in_thread()
 {
 	run();
@@ -175,9 +1010,11 @@ void active::scheduler::stop_work() throw()
 	if(0==--m_busy_count)
 	{
 #ifdef ACTIVE_USE_CXX11
-		platform::lock_guard<platform::mutex> lock(m_mutex);	// Needed for VS2011
-#endif
+		wake_all();
+		notify_idle();
+#else
 		m_ready.notify_one();
+#endif
 	}
 }
 
@@ -279,6 +1116,12 @@ active::schedule::own_thread::~own_thread()
 	}
 }
 
+void active::schedule::own_thread::set_scheduler(type & p)
+{
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+	m_pool = &p;
+}
+
 active::scheduler & active::schedule::own_thread::get_scheduler() const
 {
 	return *m_pool;
@@ -338,3 +1181,52 @@ bool active::idle(scheduler & sched) throw()
 {
 	return sched.run_one();
 }
+
+/*	The first chunk is as many messages as fit in the time budget at the
+	object's measured cost, or one message if it has not been measured.
+	Each chunk which does not empty the queue ran exactly that many messages,
+	so its time gives the cost of a message, which sizes the next chunk and
+	updates the object's estimate. The estimate is averaged, so that one
+	preempted chunk does not shrink it too far.
+	Chunks which empty the queue are not measured, as the object may already
+	be running on another thread.
+ */
+int active::begin_slice(any_object * obj, int n) throw()
+{
+#ifdef ACTIVE_USE_CXX11
+	scheduler::worker * w = this_worker;
+	if( !w || w->m_running!=obj || !w->m_scheduler.m_quantum_cycles ) return n;
+
+	w->m_slice.start = w->m_slice.chunk_start = cycles();
+	w->m_slice.left = n;
+	return obj->m_quantum ? std::min(obj->m_quantum, n) : 1;
+#else
+	(void)obj;
+	return n;
+#endif
+}
+
+int active::continue_slice(any_object * obj, int ran) throw()
+{
+#ifdef ACTIVE_USE_CXX11
+	scheduler::worker * w = this_worker;
+	if( !w || w->m_running!=obj || !w->m_slice.start ) return 0;
+
+	const unsigned long long now = cycles();
+	const unsigned long long budget = w->m_scheduler.m_quantum_cycles;
+	const unsigned long long cost = std::max(1ull, (now - w->m_slice.chunk_start) / ran);
+	const int fit = int(std::min<unsigned long long>(std::max(1ull, budget / cost), ACTIVE_OBJECT_MAX_QUANTUM));
+	obj->m_quantum = obj->m_quantum ? (obj->m_quantum + fit + 1) / 2 : fit;
+
+	w->m_slice.left -= ran;
+	const unsigned long long used = now - w->m_slice.start;
+	if( w->m_slice.left<=0 || used>=budget ) return 0;
+	const unsigned long long next = (budget - used) / cost;
+	if( !next ) return 0;
+	w->m_slice.chunk_start = now;
+	return int(std::min<unsigned long long>(next, std::min(w->m_slice.left, ACTIVE_OBJECT_MAX_QUANTUM)));
+#else
+	(void)obj; (void)ran;
+	return 0;
+#endif
+}
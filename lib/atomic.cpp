@@ -1,5 +1,6 @@
 #include <active/atomic_fifo.hpp>
 #include <active/atomic_lifo.hpp>
+#include <active/run_queue.hpp>
 #include <thread>
 #include <cassert>
 
@@ -101,6 +102,12 @@ active::atomic_node * active::atomic_fifo::pop()
 	}
 }
 
+bool active::atomic_fifo::empty() const
+{
+	// A busy output_queue counts as non-empty.
+	return !input_queue.load(std::memory_order_acquire) && !output_queue.load(std::memory_order_acquire);
+}
+
 active::atomic_lifo::atomic_lifo() : list(nullptr) { }
 
 void active::atomic_lifo::push(atomic_node * n)
@@ -115,3 +122,44 @@ active::atomic_node * active::atomic_lifo::pop()
 	release(list,n?n->next:nullptr);
 	return n;
 }
+
+/*	run_queue is a ring buffer in the style of the Go scheduler's local run queue.
+	The owner publishes an item by storing it and then releasing m_tail.
+	Consumers claim an item by advancing m_head with a CAS. If the owner wraps
+	around and overwrites a slot that a consumer has read, then m_head must have
+	moved on, so the consumer's CAS fails and the stale value is discarded.
+ */
+
+active::run_queue::run_queue() : m_head(0), m_tail(0)
+{
+	for(unsigned i=0; i<capacity; ++i)
+		m_items[i].store(nullptr, std::memory_order_relaxed);
+}
+
+bool active::run_queue::push(atomic_node * n)
+{
+	unsigned tail = m_tail.load(std::memory_order_relaxed);
+	unsigned head = m_head.load(std::memory_order_acquire);
+	if( tail-head >= capacity ) return false;
+	m_items[tail%capacity].store(n, std::memory_order_relaxed);
+	m_tail.store(tail+1, std::memory_order_release);
+	return true;
+}
+
+active::atomic_node * active::run_queue::pop()
+{
+	unsigned head = m_head.load(std::memory_order_acquire);
+	for(;;)
+	{
+		unsigned tail = m_tail.load(std::memory_order_acquire);
+		if( head==tail ) return nullptr;
+		atomic_node * n = m_items[head%capacity].load(std::memory_order_relaxed);
+		if( m_head.compare_exchange_weak(head, head+1, std::memory_order_acq_rel, std::memory_order_acquire) )
+			return n;
+	}
+}
+
+bool active::run_queue::empty() const
+{
+	return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+}
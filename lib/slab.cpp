@@ -0,0 +1,171 @@
+#include <active/slab_allocator.hpp>
+#include <active/atomic_lifo.hpp>
+
+/*	Size classes are multiples of 16 bytes, up to slab::max_size.
+	Each thread keeps a list of free blocks for each class. When a list is empty,
+	it takes a batch of blocks from the depot for that class, or carves a new slab.
+	When a list grows too long, a batch is pushed back onto the depot.
+	So a consumer which frees messages feeds a producer which allocates them.
+	Allocating and freeing only touch the depot once per batch, and the depot
+	is an atomic_lifo, which holds its list for a short spin.
+ */
+
+namespace
+{
+	const std::size_t granularity = 16;
+	const std::size_t class_count = active::slab::max_size / granularity;
+	const unsigned batch_size = 32;
+	const std::size_t slab_bytes = 64*1024;
+
+	// A free block. next links batches in the depot, and m_next_free links the blocks
+	// in a batch or in a thread's list.
+	struct free_block : public active::atomic_node
+	{
+		free_block * m_next_free;
+	};
+
+	std::size_t size_class(std::size_t bytes)
+	{
+		return bytes ? (bytes-1)/granularity : 0;
+	}
+
+	// A function-local static, so that it is usable from other static initializers.
+	active::atomic_lifo & depot(std::size_t c)
+	{
+		static active::atomic_lifo depots[class_count];
+		return depots[c];
+	}
+
+	void push_batch(std::size_t c, free_block * batch)
+	{
+		depot(c).push(batch);
+	}
+
+	class thread_cache
+	{
+	public:
+		thread_cache();
+		~thread_cache();
+		void * allocate(std::size_t c);
+		void deallocate(void * p, std::size_t c);
+	private:
+		void refill(std::size_t c);
+
+		struct list
+		{
+			free_block * m_front;
+			unsigned m_count;
+		};
+		list m_lists[class_count];
+	};
+
+	enum cache_state { cache_unused, cache_alive, cache_destroyed };
+	ACTIVE_THREAD_LOCAL cache_state this_cache_state = cache_unused;
+
+	// Returns null once the thread's cache has been destroyed at thread exit.
+	thread_cache * get_cache()
+	{
+		if( this_cache_state == cache_destroyed ) return nullptr;
+		static ACTIVE_THREAD_LOCAL thread_cache cache;
+		return &cache;
+	}
+
+	thread_cache::thread_cache()
+	{
+		for(std::size_t c=0; c<class_count; ++c)
+		{
+			m_lists[c].m_front = nullptr;
+			m_lists[c].m_count = 0;
+		}
+		this_cache_state = cache_alive;
+	}
+
+	thread_cache::~thread_cache()
+	{
+		for(std::size_t c=0; c<class_count; ++c)
+			if( m_lists[c].m_front ) push_batch(c, m_lists[c].m_front);
+		this_cache_state = cache_destroyed;
+	}
+
+	void * thread_cache::allocate(std::size_t c)
+	{
+		list & l = m_lists[c];
+		if( !l.m_front ) refill(c);
+		free_block * b = l.m_front;
+		l.m_front = b->m_next_free;
+		--l.m_count;
+		return b;
+	}
+
+	void thread_cache::deallocate(void * p, std::size_t c)
+	{
+		list & l = m_lists[c];
+		free_block * b = static_cast<free_block*>(p);
+		b->m_next_free = l.m_front;
+		l.m_front = b;
+
+		if( ++l.m_count > 2*batch_size )
+		{
+			// Keep the most recently freed blocks, which are likely to be in cache.
+			free_block * last = l.m_front;
+			for(unsigned i=1; i<batch_size; ++i)
+				last = last->m_next_free;
+			push_batch(c, last->m_next_free);
+			last->m_next_free = nullptr;
+			l.m_count = batch_size;
+		}
+	}
+
+	void thread_cache::refill(std::size_t c)
+	{
+		list & l = m_lists[c];
+		free_block * batch = static_cast<free_block*>(depot(c).pop());
+		if( batch )
+		{
+			l.m_front = batch;
+			for( ; batch; batch = batch->m_next_free)
+				++l.m_count;
+			return;
+		}
+
+		const std::size_t size = (c+1)*granularity;
+		char * slab = static_cast<char*>(::operator new(slab_bytes));
+		for(std::size_t i=slab_bytes/size; i-->0; )
+		{
+			free_block * b = reinterpret_cast<free_block*>(slab + i*size);
+			b->m_next_free = l.m_front;
+			l.m_front = b;
+			++l.m_count;
+		}
+	}
+}
+
+void * active::slab::allocate(std::size_t bytes)
+{
+	if( bytes > max_size ) return ::operator new(bytes);
+	std::size_t c = size_class(bytes);
+	thread_cache * cache = get_cache();
+	return cache ? cache->allocate(c) : ::operator new((c+1)*granularity);
+}
+
+void active::slab::deallocate(void * p, std::size_t bytes) throw()
+{
+	if( !p ) return;
+	if( bytes > max_size )
+	{
+		::operator delete(p);
+		return;
+	}
+
+	std::size_t c = size_class(bytes);
+	if( thread_cache * cache = get_cache() )
+	{
+		cache->deallocate(p, c);
+	}
+	else
+	{
+		free_block * b = static_cast<free_block*>(p);
+		b->m_next_free = nullptr;
+		push_batch(c, b);
+	}
+}
@@ -0,0 +1,226 @@
+#include <active/timer_wheel.hpp>
+#include <cstring>
+
+/*	Level l holds timers which are due within 256^(l+1) ticks of m_now, in the
+	slot given by bits 8l..8l+7 of their deadline. When the wheel reaches the
+	start of a slot at level l, the timers in it are inserted again, which moves
+	them to a lower level. Timers at level 0 are due in the tick of their slot.
+	Nodes are linked by index, and a free node's generation is incremented, so
+	that a stale timer_id cannot cancel a timer which reuses its node.
+ */
+
+namespace
+{
+	int lowest(unsigned long long bits)
+	{
+#ifdef __GNUC__
+		return __builtin_ctzll(bits);
+#else
+		int i=0;
+		for( ; !(bits&1); bits>>=1) ++i;
+		return i;
+#endif
+	}
+}
+
+active::timer_wheel::timer_wheel() : m_origin(clock::now()), m_now(0), m_free(-1), m_size(0)
+{
+	for( int s=0; s<levels*slots; ++s )
+		m_heads[s] = -1;
+	std::memset( m_bits, 0, sizeof(m_bits) );
+}
+
+active::timer_wheel::ticks active::timer_wheel::to_ticks(clock::time_point t, bool round_up) const
+{
+	if( t <= m_origin ) return 0;
+	clock::duration d = t - m_origin;
+	ticks result = std::chrono::duration_cast<tick>(d).count();
+	if( round_up && tick(result) < d ) ++result;
+	return result;
+}
+
+active::timer_id active::timer_wheel::add(clock::time_point deadline, clock::duration period, const callback_ptr & cb)
+{
+	int n = m_free;
+	if( n != -1 )
+		m_free = m_nodes[n].next;
+	else
+	{
+		n = int(m_nodes.size());
+		node empty = node();
+		m_nodes.push_back(empty);
+	}
+
+	node & x = m_nodes[n];
+	x.deadline = to_ticks(deadline, true);
+	x.period = period > clock::duration::zero() ? to_ticks(m_origin + period, true) : 0;
+	x.cb = cb;
+	++m_size;
+	insert(n);
+
+	timer_id id = { unsigned(n), x.generation };
+	return id;
+}
+
+bool active::timer_wheel::cancel(timer_id id)
+{
+	if( id.index >= m_nodes.size() ) return false;
+	node & x = m_nodes[id.index];
+	if( x.slot == -1 || x.generation != id.generation ) return false;
+	unlink(id.index);
+	release(id.index);
+	return true;
+}
+
+// Timers which are already due go in the next tick.
+// Timers beyond the top level wait in its furthest slot, and are moved again from there.
+void active::timer_wheel::insert(int n)
+{
+	node & x = m_nodes[n];
+	ticks due = x.deadline > m_now ? x.deadline : m_now+1;
+	int level = 0;
+	while( level < levels-1 && due-m_now >= ticks(1) << (slot_bits*(level+1)) )
+		++level;
+	if( level == levels-1 && due-m_now >= ticks(1) << (slot_bits*levels) )
+		due = m_now + (ticks(mask) << (slot_bits*level));
+
+	const int index = int(due >> (slot_bits*level)) & mask;
+	const int slot = level*slots + index;
+	x.slot = slot;
+	x.prev = -1;
+	x.next = m_heads[slot];
+	if( x.next != -1 )
+		m_nodes[x.next].prev = n;
+	m_heads[slot] = n;
+	m_bits[level][index>>6] |= 1ull << (index&63);
+}
+
+void active::timer_wheel::unlink(int n)
+{
+	node & x = m_nodes[n];
+	if( x.prev != -1 )
+		m_nodes[x.prev].next = x.next;
+	else
+		m_heads[x.slot] = x.next;
+	if( x.next != -1 )
+		m_nodes[x.next].prev = x.prev;
+
+	if( m_heads[x.slot] == -1 )
+	{
+		const int level = x.slot / slots, index = x.slot % slots;
+		m_bits[level][index>>6] &= ~(1ull << (index&63));
+	}
+}
+
+void active::timer_wheel::release(int n)
+{
+	node & x = m_nodes[n];
+	x.cb.reset();
+	x.slot = -1;
+	++x.generation;
+	x.next = m_free;
+	m_free = n;
+	--m_size;
+}
+
+// Moves the timers in the current slot of a level down, when m_now reaches the start of the slot.
+void active::timer_wheel::cascade(int level)
+{
+	const int index = int(m_now >> (slot_bits*level)) & mask;
+	if( index == 0 && level+1 < levels )
+		cascade(level+1);
+
+	const int slot = level*slots + index;
+	int n = m_heads[slot];
+	m_heads[slot] = -1;
+	m_bits[level][index>>6] &= ~(1ull << (index&63));
+	while( n != -1 )
+	{
+		const int next = m_nodes[n].next;
+		insert(n);
+		n = next;
+	}
+}
+
+// The number of slots after from until the next occupied slot, from 1 to 256, or 0 if none.
+int active::timer_wheel::distance(int level, int from) const
+{
+	for( int step=1; step<=slots; )
+	{
+		const int index = (from+step) & mask;
+		const unsigned long long bits = m_bits[level][index>>6] >> (index&63);
+		if( bits )
+		{
+			const int d = step + lowest(bits);
+			return d <= slots ? d : 0;
+		}
+		step += 64 - (index&63);
+	}
+	return 0;
+}
+
+std::size_t active::timer_wheel::expire(clock::time_point now, std::vector<callback_ptr> & due)
+{
+	const ticks target = to_ticks(now, false);
+	std::size_t removed = 0;
+
+	while( m_size && m_now < target )
+	{
+		// Skip to the next occupied slot at level 0, or the start of the next rotation.
+		const ticks rotation = (m_now | mask) + 1;
+		const int d = distance(0, int(m_now & mask));
+		const ticks next = d && m_now+d < rotation ? m_now+d : rotation;
+		if( next > target ) break;
+
+		m_now = next;
+		if( (m_now & mask) == 0 )
+			cascade(1);
+
+		const int slot = int(m_now & mask);
+		while( m_heads[slot] != -1 )
+		{
+			const int n = m_heads[slot];
+			unlink(n);
+			node & x = m_nodes[n];
+			if( x.deadline > m_now )
+			{
+				// Was beyond the range of the wheel
+				insert(n);
+				continue;
+			}
+
+			due.push_back(x.cb);
+			if( x.period )
+			{
+				x.deadline += ((m_now - x.deadline) / x.period + 1) * x.period;
+				insert(n);
+			}
+			else
+			{
+				release(n);
+				++removed;
+			}
+		}
+	}
+
+	if( m_now < target ) m_now = target;
+	return removed;
+}
+
+active::timer_wheel::clock::time_point active::timer_wheel::next_expiry() const
+{
+	if( !m_size ) return clock::time_point::max();
+
+	// Level 0 gives the exact tick. Higher levels give the time that their
+	// next slot is moved down, which is no later than any timer in it.
+	ticks next = ~ticks(0);
+	for( int level=0; level<levels; ++level )
+	{
+		const int shift = slot_bits*level;
+		const int d = distance(level, int(m_now >> shift) & mask);
+		if( !d ) continue;
+		const ticks t = level ? ((m_now >> shift) + d) << shift : m_now + d;
+		if( t < next ) next = t;
+	}
+	return m_origin + tick(next);
+}
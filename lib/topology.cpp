@@ -0,0 +1,300 @@
+#include <active/topology.hpp>
+#include <active/object.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+	#include <dirent.h>
+	#include <sched.h>
+#endif
+
+namespace
+{
+	bool read_line(const std::string & path, std::string & line)
+	{
+		std::ifstream file(path.c_str());
+		return std::getline(file, line) && !line.empty();
+	}
+
+	int read_int(const std::string & path, int default_value)
+	{
+		std::string line;
+		return read_line(path, line) ? std::atoi(line.c_str()) : default_value;
+	}
+
+	std::string cpu_path(const std::string & cpu_dir, int id)
+	{
+		std::ostringstream ss;
+		ss << cpu_dir << "/cpu" << id;
+		return ss.str();
+	}
+
+	// Parses a list such as "0-3,8,10-11", returning the numbers in order.
+	std::vector<int> parse_list(const std::string & list)
+	{
+		std::vector<int> result;
+		std::istringstream ss(list);
+		std::string range;
+		while( std::getline(ss, range, ',') )
+		{
+			if( range.empty() ) continue;
+			const std::string::size_type dash = range.find('-');
+			const int first = std::atoi(range.c_str());
+			const int last = dash==std::string::npos ? first : std::atoi(range.c_str()+dash+1);
+			for( int id=first; id<=last; ++id )
+				result.push_back(id);
+		}
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+#ifdef __linux__
+	// The NUMA node is given by a cpuN/nodeM link.
+	int node_of(const std::string & dir)
+	{
+		int node = 0;
+		if( DIR * d = opendir(dir.c_str()) )
+		{
+			while( dirent * e = readdir(d) )
+			{
+				if( std::strncmp(e->d_name, "node", 4)==0 && e->d_name[4]>='0' && e->d_name[4]<='9' )
+				{
+					node = std::atoi(e->d_name+4);
+					break;
+				}
+			}
+			closedir(d);
+		}
+		return node;
+	}
+
+	// The first CPU sharing the highest level of cache, or the CPU itself.
+	int cache_of(const std::string & dir, int id)
+	{
+		int cache = id, highest = 0;
+		for( int index=0; index<16; ++index )
+		{
+			std::ostringstream ss;
+			ss << dir << "/cache/index" << index;
+			const int level = read_int(ss.str()+"/level", -1);
+			if( level==-1 ) break;
+			std::string shared;
+			if( level > highest && read_line(ss.str()+"/shared_cpu_list", shared) )
+			{
+				const std::vector<int> cpus = parse_list(shared);
+				if( !cpus.empty() )
+				{
+					highest = level;
+					cache = cpus.front();
+				}
+			}
+		}
+		return cache;
+	}
+#endif
+}
+
+active::topology::topology(const std::string & cpu_dir, const std::string & cgroup_dir) : m_quota(0)
+{
+#ifdef __linux__
+	std::string online;
+	if( read_line(cpu_dir+"/online", online) )
+	{
+		const std::vector<int> ids = parse_list(online);
+		for( std::size_t i=0; i<ids.size(); ++i )
+		{
+			const std::string dir = cpu_path(cpu_dir, ids[i]);
+			cpu c;
+			c.id = ids[i];
+			c.core = read_int(dir+"/topology/core_id", ids[i]);
+			c.package = read_int(dir+"/topology/physical_package_id", 0);
+			c.node = node_of(dir);
+			c.cache = cache_of(dir, ids[i]);
+			m_cpus.push_back(c);
+		}
+	}
+#endif
+
+	if( m_cpus.empty() )
+	{
+		const int n = std::max(1, int(platform::thread::hardware_concurrency()));
+		for( int id=0; id<n; ++id )
+		{
+			const cpu c = { id, id, 0, 0, id };
+			m_cpus.push_back(c);
+		}
+	}
+
+	if( !cgroup_dir.empty() )
+		read_cgroup(cgroup_dir);
+}
+
+// Reads the limits in a cgroup directory, using the file names of version 2 or version 1.
+void active::topology::read_cgroup(const std::string & dir)
+{
+	double quota = 0;
+	std::string line;
+	if( read_line(dir+"/cpu.max", line) )
+	{
+		std::istringstream ss(line);
+		std::string max;
+		double period = 0;
+		if( ss >> max >> period && max!="max" && period>0 )
+			quota = std::atof(max.c_str()) / period;
+	}
+	else
+	{
+		const int q = read_int(dir+"/cpu.cfs_quota_us", -1), period = read_int(dir+"/cpu.cfs_period_us", 0);
+		if( q>0 && period>0 )
+			quota = double(q) / period;
+	}
+	if( quota>0 && (m_quota==0 || quota<m_quota) )
+		m_quota = quota;
+
+	if( read_line(dir+"/cpuset.cpus.effective", line) || read_line(dir+"/cpuset.effective_cpus", line) )
+		restrict(parse_list(line));
+}
+
+// Removes the CPUs which are not allowed, unless that would remove them all.
+void active::topology::restrict(const std::vector<int> & allowed)
+{
+	std::vector<cpu> cpus;
+	for( std::size_t i=0; i<m_cpus.size(); ++i )
+		if( std::binary_search(allowed.begin(), allowed.end(), m_cpus[i].id) )
+			cpus.push_back(m_cpus[i]);
+	if( !cpus.empty() )
+		m_cpus.swap(cpus);
+}
+
+active::topology active::topology::read_system()
+{
+	topology t("/sys/devices/system/cpu");
+#ifdef __linux__
+	// Lines of /proc/self/cgroup are hierarchy:controllers:path, with no
+	// controllers for version 2, which is mounted either at /sys/fs/cgroup
+	// or at /sys/fs/cgroup/unified alongside version 1.
+	std::ifstream file("/proc/self/cgroup");
+	std::string line;
+	while( std::getline(file, line) )
+	{
+		const std::string::size_type colon1 = line.find(':'), colon2 = line.find(':', colon1+1);
+		if( colon1==std::string::npos || colon2==std::string::npos ) continue;
+		const std::string controllers = line.substr(colon1+1, colon2-colon1-1), path = line.substr(colon2+1);
+		if( controllers.empty() )
+		{
+			std::ifstream v2("/sys/fs/cgroup/cgroup.controllers");
+			t.read_cgroup((v2 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified") + path);
+		}
+		else
+		{
+			std::istringstream ss(controllers);
+			std::string controller;
+			while( std::getline(ss, controller, ',') )
+			{
+				if( controller=="cpu" || controller=="cpuset" )
+				{
+					t.read_cgroup("/sys/fs/cgroup/" + controllers + path);
+					break;
+				}
+			}
+		}
+	}
+
+	// The affinity mask already excludes CPUs outside the cpuset.
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if( sched_getaffinity(0, sizeof(set), &set)==0 )
+	{
+		std::vector<int> allowed;
+		for( int id=0; id<CPU_SETSIZE; ++id )
+			if( CPU_ISSET(id, &set) ) allowed.push_back(id);
+		t.restrict(allowed);
+	}
+#endif
+	return t;
+}
+
+const active::topology & active::topology::system()
+{
+	static const topology t = read_system();
+	return t;
+}
+
+int active::topology::concurrency() const
+{
+	int n = int(m_cpus.size());
+	if( m_quota>0 && std::ceil(m_quota) < n )
+		n = int(std::ceil(m_quota));
+	return n<1 ? 1 : n;
+}
+
+const active::topology::cpu * active::topology::find(int id) const
+{
+	for( std::size_t i=0; i<m_cpus.size(); ++i )
+		if( m_cpus[i].id==id ) return &m_cpus[i];
+	return 0;
+}
+
+int active::topology::distance(int cpu1, int cpu2) const
+{
+	const cpu * a = find(cpu1), * b = find(cpu2);
+	if( !a || !b ) return 4;
+	if( a==b ) return 0;
+	if( a->package==b->package && a->core==b->core ) return 1;
+	if( a->cache==b->cache ) return 2;
+	if( a->package==b->package || a->node==b->node ) return 3;
+	return 4;
+}
+
+namespace
+{
+	// Sort key for placement: SMT rank within the core, then NUMA node, package and core.
+	struct placement_key
+	{
+		int rank, node, package, core, id;
+		bool operator<(const placement_key & other) const
+		{
+			if( rank!=other.rank ) return rank<other.rank;
+			if( node!=other.node ) return node<other.node;
+			if( package!=other.package ) return package<other.package;
+			if( core!=other.core ) return core<other.core;
+			return id<other.id;
+		}
+	};
+}
+
+std::vector<int> active::topology::placement() const
+{
+	std::vector<placement_key> keys;
+	for( std::size_t i=0; i<m_cpus.size(); ++i )
+	{
+		placement_key k = { 0, m_cpus[i].node, m_cpus[i].package, m_cpus[i].core, m_cpus[i].id };
+		for( std::size_t j=0; j<i; ++j )
+			if( m_cpus[j].package==k.package && m_cpus[j].core==k.core ) ++k.rank;
+		keys.push_back(k);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<int> result;
+	for( std::size_t i=0; i<keys.size(); ++i )
+		result.push_back(keys[i].id);
+	return result;
+}
+
+bool active::topology::pin(int cpu)
+{
+#ifdef __linux__
+	if( cpu<0 || cpu>=CPU_SETSIZE ) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set)==0;
+#else
+	return false;
+#endif
+}
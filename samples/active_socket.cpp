@@ -1,5 +1,9 @@
 #include "active_socket.hpp"
+#ifdef ACTIVE_USE_CXX11
+	#include <active/timer.hpp>
+#endif
 #include <iostream>
+#include <stdexcept>
 #include <cassert>
 
 #ifdef WIN32
@@ -19,9 +23,292 @@
 	#define _read read
 	#define ENABLE_SELECT 1
 	#define closesocket close
+	#include <fcntl.h>
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <netinet/tcp.h>
+	#include <climits>
+	#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+	#define ENABLE_ZERO_COPY 1
+	#include <sys/sendfile.h>
+#else
+	#define ENABLE_ZERO_COPY 0
+#endif
+#include <cerrno>
+
+#if ACTIVE_SOCKET_EPOLL
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+	#include <stdint.h>
+#endif
+
+#if ACTIVE_SOCKET_URING
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <poll.h>
+	#include <cstring>
+#endif
+
+namespace
+{
+	// Read/write either a socket or a file
+	int io_read(int fd, void * buffer, int size)
+	{
+		return fd<=2 ?
+			::_read( fd, buffer, size ) :
+			::recv( fd, (char*)buffer, size, 0 );
+	}
+
+	int io_write(int fd, const void * buffer, int size)
+	{
+		return fd<=2 ?
+			::_write( fd, buffer, size ) :
+			::send( fd, (const char*)buffer, size, 0 );
+	}
+
+	bool would_block(int error)
+	{
+		return error == EAGAIN || error == EWOULDBLOCK;
+	}
+
+	typedef std::deque<active::socket::write> write_queue;
+
+	// Writes as much of the queued data as possible in one call.
+	int gather_write(int fd, const write_queue & writes)
+	{
+#ifdef WIN32
+		return io_write( fd, writes.front().buffer, writes.front().buffer_size );
+#else
+	#ifdef IOV_MAX
+		const int max_iov = IOV_MAX < 256 ? IOV_MAX : 256;
+	#else
+		const int max_iov = 16;
+	#endif
+		iovec iov[max_iov];
+		int count=0;
+		for( write_queue::const_iterator w=writes.begin(); w!=writes.end() && count<max_iov; ++w )
+		{
+			if( w->buffer_size )
+			{
+				iov[count].iov_base = const_cast<void*>(w->buffer);
+				iov[count].iov_len = w->buffer_size;
+				++count;
+			}
+		}
+
+		if( count<=1 )
+			return count ? io_write( fd, iov[0].iov_base, int(iov[0].iov_len) ) : 0;
+		return ::writev( fd, iov, count );
+#endif
+	}
+
+	// Removes written data from the queue, and responds to each completed write.
+	void complete_writes(write_queue & writes, int bytes)
+	{
+		while( !writes.empty() )
+		{
+			active::socket::write & w = writes.front();
+			int n = bytes < w.buffer_size ? bytes : w.buffer_size;
+			w.buffer = (const char*)w.buffer + n;
+			w.buffer_size -= n;
+			bytes -= n;
+			if( w.buffer_size ) return;
+
+			active::socket::write_response response = { 0, w.buffer, 0, w.data };
+			if( w.response )
+				w.response->send(response);
+			writes.pop_front();
+		}
+	}
+
+	// Responds to each write with the data which was not written.
+	void fail_writes(write_queue & writes, int error)
+	{
+		for( write_queue::const_iterator w=writes.begin(); w!=writes.end(); ++w )
+		{
+			active::socket::write_response response = { error, w->buffer, w->buffer_size, w->data };
+			if( w->response )
+				w->response->send(response);
+		}
+		writes.clear();
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+// Buffers
+
+struct active::io_buffer::block
+{
+#ifdef ACTIVE_USE_CXX11
+	std::atomic<int> refs;
+#else
+	int refs;	// Protected by the pool mutex
+#endif
+	io_buffer_pool * pool;
+	int size_class;	// -1 if not pooled
+	block * next;	// In the free list
+
+	char * data() { return reinterpret_cast<char*>(this+1); }
+};
+
+active::io_buffer_pool active::default_io_buffer_pool;
+
+active::io_buffer::io_buffer(block * b, char * data, std::size_t size) :
+	m_block(b), m_data(data), m_size(size)
+{
+}
+
+active::io_buffer::io_buffer(const io_buffer & other) :
+	m_block(other.m_block), m_data(other.m_data), m_size(other.m_size)
+{
+	if( m_block )
+	{
+#ifdef ACTIVE_USE_CXX11
+		m_block->refs.fetch_add(1, std::memory_order_relaxed);
+#else
+		platform::lock_guard<platform::mutex> lock(m_block->pool->m_mutex);
+		++m_block->refs;
+#endif
+	}
+}
+
+active::io_buffer & active::io_buffer::operator=(const io_buffer & other)
+{
+	io_buffer copy(other);
+	std::swap(m_block, copy.m_block);
+	std::swap(m_data, copy.m_data);
+	std::swap(m_size, copy.m_size);
+	return *this;
+}
+
+active::io_buffer::~io_buffer()
+{
+	reset();
+}
+
+void active::io_buffer::reset()
+{
+	if( block * b = m_block )
+	{
+		m_block = 0;
+		m_data = 0;
+		m_size = 0;
+		b->pool->recycle(b);
+	}
+}
+
+active::io_buffer active::io_buffer::slice(std::size_t offset, std::size_t length) const
+{
+	assert( offset+length <= m_size );
+	io_buffer result(*this);
+	result.m_data += offset;
+	result.m_size = length;
+	return result;
+}
+
+active::io_buffer_pool::io_buffer_pool(std::size_t max_free_per_class) :
+	m_max_free(max_free_per_class)
+{
+	for( int c=0; c<classes; ++c )
+	{
+		m_free[c] = 0;
+		m_free_count[c] = 0;
+	}
+}
+
+active::io_buffer_pool::~io_buffer_pool()
+{
+	trim();
+}
+
+active::io_buffer active::io_buffer_pool::allocate(std::size_t size)
+{
+	int size_class = 0;
+	std::size_t class_size = min_size;
+	while( class_size < size && class_size < max_size )
+	{
+		++size_class;
+		class_size *= 2;
+	}
+
+	io_buffer::block * b = 0;
+	if( size <= max_size )
+	{
+		size = class_size;
+		platform::lock_guard<platform::mutex> lock(m_mutex);
+		if( (b = m_free[size_class]) )
+		{
+			m_free[size_class] = b->next;
+			--m_free_count[size_class];
+		}
+	}
+
+	if( !b )
+	{
+		b = static_cast<io_buffer::block*>( ::operator new( sizeof(io_buffer::block) + size ) );
+		b->pool = this;
+		b->size_class = size <= max_size ? size_class : -1;
+	}
+	b->refs = 1;
+	return io_buffer( b, b->data(), size );
+}
+
+// Called when the last reference to a block is released.
+void active::io_buffer_pool::recycle(io_buffer::block * b) throw()
+{
+#ifdef ACTIVE_USE_CXX11
+	if( b->refs.fetch_sub(1, std::memory_order_acq_rel) != 1 ) return;
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+#else
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+	if( --b->refs ) return;
 #endif
+	if( b->size_class >= 0 && m_free_count[b->size_class] < m_max_free )
+	{
+		b->next = m_free[b->size_class];
+		m_free[b->size_class] = b;
+		++m_free_count[b->size_class];
+	}
+	else
+		::operator delete(b);
+}
+
+std::size_t active::io_buffer_pool::free_count() const
+{
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+	std::size_t count = 0;
+	for( int c=0; c<classes; ++c )
+		count += m_free_count[c];
+	return count;
+}
+
+void active::io_buffer_pool::trim()
+{
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+	for( int c=0; c<classes; ++c )
+	{
+		while( io_buffer::block * b = m_free[c] )
+		{
+			m_free[c] = b->next;
+			::operator delete(b);
+		}
+		m_free_count[c] = 0;
+	}
+}
 
-active::socket::socket(int fd) : m_fd(fd), m_reader(fd), m_writer(fd)
+/////////////////////////////////////////////////////////////////////
+// Socket
+
+active::socket::socket(int fd) :
+	m_fd(fd), m_waiting_read(false), m_waiting_write(false), m_connect_pending(false), m_flush_pending(false),
+#if ACTIVE_SOCKET_URING
+	m_uring(nullptr), m_submitted(0),
+#endif
+	m_reader(fd), m_writer(fd)
 {
 }
 
@@ -34,17 +321,79 @@ active::socket::~socket()
 }
 
 active::socket::socket(int domain, int type, int protocol) :
-	m_fd( ::socket( domain, type, protocol ) ), m_reader(m_fd), m_writer(m_fd)
+	m_fd( ::socket( domain, type, protocol ) ),
+	m_waiting_read(false), m_waiting_write(false), m_connect_pending(false), m_flush_pending(false),
+#if ACTIVE_SOCKET_URING
+	m_uring(nullptr), m_submitted(0),
+#endif
+	m_reader(m_fd), m_writer(m_fd)
+{
+	if( m_fd == -1 ) throw std::runtime_error("Could not create socket");
+}
+
+active::socket::socket(int fd, select::ptr sel) :
+	m_fd(fd), m_select(sel),
+	m_waiting_read(false), m_waiting_write(false), m_connect_pending(false), m_flush_pending(false),
+#if ACTIVE_SOCKET_URING
+	m_uring(nullptr), m_submitted(0),
+#endif
+	m_reader(fd), m_writer(fd)
+{
+	set_nonblocking();
+}
+
+active::socket::socket(int domain, int type, int protocol, select::ptr sel) :
+	m_fd( ::socket( domain, type, protocol ) ), m_select(sel),
+	m_waiting_read(false), m_waiting_write(false), m_connect_pending(false), m_flush_pending(false),
+#if ACTIVE_SOCKET_URING
+	m_uring(nullptr), m_submitted(0),
+#endif
+	m_reader(m_fd), m_writer(m_fd)
 {
 	if( m_fd == -1 ) throw std::runtime_error("Could not create socket");
+	set_nonblocking();
+}
+
+void active::socket::set_nonblocking()
+{
+	assert( m_select );
+#ifdef WIN32
+	throw std::runtime_error("Non-blocking sockets are not supported");
+#else
+	int flags = ::fcntl( m_fd, F_GETFL );
+	if( flags == -1 || ::fcntl( m_fd, F_SETFL, flags | O_NONBLOCK ) == -1 )
+		throw std::runtime_error("Could not make socket non-blocking");
+#endif
+#if ACTIVE_SOCKET_URING
+	m_uring = m_select->get_uring();
+#endif
 }
 
 void active::socket::active_method( connect_in connect_in )
 {
+#if ACTIVE_SOCKET_URING
+	if( m_uring )
+	{
+		m_connect_pending = true;
+		m_connecting = connect_in.response;
+		m_connect_address = connect_in.sa;
+		return submit(uring_connect);
+	}
+#endif
+
 	connect_response response;
 	int result = ::connect( m_fd, (sockaddr*)&connect_in.sa, sizeof(connect_in.sa) );
 	response.error = result ? errno : 0;
 
+	if( m_select && response.error == EINPROGRESS )
+	{
+		// Completes when the socket becomes writable
+		m_connect_pending = true;
+		m_connecting = connect_in.response;
+		wait_write();
+		return;
+	}
+
 	if( connect_in.response )
 	{
 		connect_in.response->send(response);
@@ -76,6 +425,13 @@ void active::socket::active_method( listen listen )
 
 void active::socket::active_method( accept accept )
 {
+	if( m_select )
+	{
+		m_accepts.push_back(accept);
+		if( !m_waiting_read ) do_accepts();
+		return;
+	}
+
 	accept_response response;
 	response.fd = ::accept( m_fd, 0, 0 );
 	response.error = response.fd>=0 ? 0 : errno;
@@ -86,38 +442,79 @@ void active::socket::active_method( accept accept )
 	}
 }
 
+// Writes which are already queued behind this one are sent together,
+// by a flush message after them.
 void active::socket::active_method( write write )
 {
-	m_writer(write);
+	if( m_select )
+	{
+		m_writes.push_back(write);
+		if( m_waiting_write || m_flush_pending ) return;
+		if( empty() )
+			do_writes();
+		else
+		{
+			m_flush_pending = true;
+			(*this)(flush());
+		}
+	}
+	else
+		m_writer(write);
 }
 
-void active::socket::writer::active_method( write write )
+void active::socket::active_method( flush )
 {
-	active::socket::write_response response;
+	m_flush_pending = false;
+	if( !m_waiting_write ) do_writes();
+}
 
-	int bytes = m_fd<=2 ?
-		::_write( m_fd, write.buffer, write.buffer_size ) :
-		::send( m_fd, (const char*)write.buffer, write.buffer_size, 0 );
+void active::socket::active_method( cork cork )
+{
+#if defined(TCP_CORK)
+	int value = cork.enabled;
+	::setsockopt( m_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value) );
+#elif defined(TCP_NOPUSH)
+	int value = cork.enabled;
+	::setsockopt( m_fd, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value) );
+#endif
+}
 
-	if( bytes <= 0 )
+void active::socket::writer::active_method( write write )
+{
+	m_writes.push_back(write);
+	if( m_flush_pending ) return;
+	if( empty() )
+		active_method( flush() );
+	else
 	{
-		response.buffer = write.buffer;
-		response.buffer_size = write.buffer_size;
-		response.error = bytes==0 ? -1 : errno;
+		m_flush_pending = true;
+		(*this)(flush());
 	}
-	else
+}
+
+// Unlike a single send(), only responds once all of the data has been written,
+// or on error.
+void active::socket::writer::active_method( flush )
+{
+	m_flush_pending = false;
+	while( !m_writes.empty() )
 	{
-		response.buffer_size = write.buffer_size - bytes;
-		response.buffer = (char*)write.buffer + bytes;
-		response.error = 0;
+		int bytes = gather_write( m_fd, m_writes );
+		if( bytes<0 || (bytes==0 && m_writes.front().buffer_size) )
+			return fail_writes( m_writes, bytes==0 ? -1 : errno );
+		complete_writes( m_writes, bytes );
 	}
-	if( write.response )
-		write.response->send(response);
 }
 
 void active::socket::active_method( read read )
 {
-	m_reader(read);
+	if( m_select )
+	{
+		m_reads.push_back(read);
+		if( m_reads.size()==1 && !m_waiting_read ) do_reads();
+	}
+	else
+		m_reader(read);
 }
 
 void active::socket::reader::active_method( read read )
@@ -125,10 +522,9 @@ void active::socket::reader::active_method( read read )
 	active::socket::read_response response = { 0 };
 
 	response.buffer = read.buffer;
+	response.data = read.data;
 
-	response.bytes_read = m_fd <=2 ?
-		::_read( m_fd, read.buffer, read.buffer_size ) :
-		::recv( m_fd, (char*)read.buffer, read.buffer_size, 0 );
+	response.bytes_read = io_read( m_fd, read.buffer, read.buffer_size );
 
 	if( response.bytes_read>0 )
 		response.error = 0;
@@ -146,97 +542,449 @@ void active::socket::active_method( shutdown shutdown )
 	::shutdown( m_fd, shutdown.mode );
 }
 
-active::socket::reader::reader(int fd) : m_fd(fd)
+void active::socket::active_method( read_ready )
 {
+	m_waiting_read = false;
+	do_accepts();
+	do_reads();
 }
 
-active::socket::writer::writer(int fd) : m_fd(fd)
+void active::socket::active_method( write_ready )
 {
-}
+	m_waiting_write = false;
 
-/////////////////////////////////////////////////////////////////////
-// Select
+	if( m_connect_pending )
+	{
+		m_connect_pending = false;
 
-active::select::select() :
-#if ENABLE_SELECT
-	m_loop( (::pipe(m_pipe) >=0 ? m_pipe[0] : -1) )
-#else
-	m_loop( -1 )
-#endif
+		connect_response response = { 0 };
+		socklen_t size = sizeof(response.error);
+		if( ::getsockopt( m_fd, SOL_SOCKET, SO_ERROR, (char*)&response.error, &size ) )
+			response.error = errno;
+
+		if( m_connecting )
+			m_connecting->send(response);
+		m_connecting.reset();
+	}
+
+	do_writes();
+}
+
+void active::socket::wait_read()
 {
+	if( !m_waiting_read )
+	{
+		m_waiting_read = true;
+		select::read read = { m_fd, shared_from_this() };
+		(*m_select)(read);
+	}
 }
 
-void active::select::active_method( read read )
+void active::socket::wait_write()
 {
-#if ENABLE_SELECT
-	// Note: We must queue the write BEFORE we interrupt the select
-	m_loop(read);
-	::_write( m_pipe[1], "X", 1 );
-#else
-	read.response->send(read_ready());
-#endif
+	if( !m_waiting_write )
+	{
+		m_waiting_write = true;
+		select::write write = { m_fd, shared_from_this() };
+		(*m_select)(write);
+	}
 }
 
-void active::select::active_method( write write )
+void active::socket::do_reads()
 {
-#if ENABLE_SELECT
-	m_loop(write);
-	::_write( m_pipe[1], "X", 1 );
-#else
-	write.response->send(write_ready());
+#if ACTIVE_SOCKET_URING
+	if( m_uring ) return submit(uring_read);
 #endif
+	while( !m_reads.empty() )
+	{
+		read & read = m_reads.front();
+
+		read_response response = { 0 };
+		response.buffer = read.buffer;
+		response.data = read.data;
+		response.bytes_read = io_read( m_fd, read.buffer, read.buffer_size );
+
+		if( response.bytes_read>0 )
+			response.error = 0;
+		else if( response.bytes_read==0 )
+			response.error = -1;
+		else if( would_block(errno) )
+			return wait_read();
+		else
+			response.error = errno;
+
+		if( read.response )
+			read.response->send(response);
+		m_reads.pop_front();
+	}
 }
 
-active::select::~select()
+void active::socket::do_accepts()
 {
-#if ENABLE_SELECT
-	::_close(m_pipe[0]);
-	::_close(m_pipe[1]);
+#if ACTIVE_SOCKET_URING
+	if( m_uring ) return submit(uring_accept);
 #endif
+	while( !m_accepts.empty() )
+	{
+		accept_response response;
+		response.fd = ::accept( m_fd, 0, 0 );
+		response.error = response.fd>=0 ? 0 : errno;
+
+		if( response.error && would_block(response.error) )
+			return wait_read();
+
+		if( m_accepts.front().response )
+			m_accepts.front().response->send(response);
+		m_accepts.pop_front();
+	}
 }
 
-active::select::select_loop::select_loop(int fd) : m_interrupt_fd(fd)
+// The response is only sent when all of the data has been written, or on error.
+void active::socket::do_writes()
 {
+#if ACTIVE_SOCKET_URING
+	if( m_uring ) return submit(uring_write);
+#endif
+	while( !m_writes.empty() && !m_connect_pending )
+	{
+		int bytes = gather_write( m_fd, m_writes );
+
+		if( bytes<0 && would_block(errno) )
+			return wait_write();
+		if( bytes<0 || (bytes==0 && m_writes.front().buffer_size) )
+			return fail_writes( m_writes, bytes==0 ? -1 : errno );
+
+		complete_writes( m_writes, bytes );
+	}
 }
 
-void active::select::select_loop::active_method( do_select do_select )
+#if ACTIVE_SOCKET_URING
+namespace
 {
-	if( m_readers.empty() && m_writers.empty()) return;
-
-	int max_fd=m_interrupt_fd;
+	// Sends the result of a request back to the socket.
+	struct socket_result : public active::uring::completion
+	{
+		socket_result(const active::socket::ptr & sock, unsigned request) :
+			m_socket(sock), m_request(request)
+		{
+		}
 
-	fd_set rfds, wfds;
+		void complete(int result)
+		{
+			active::socket::uring_result msg = { m_request, result };
+			(*m_socket)(msg);
+		}
 
-	FD_ZERO( &rfds );
-	FD_ZERO( &wfds );
+		active::socket::ptr m_socket;
+		const unsigned m_request;
+	};
+}
 
-	FD_SET( m_interrupt_fd, &rfds );
+// Submits the request at the front of its queue, unless one is already in flight.
+// Only one request of each kind is in flight, so that they complete in order.
+void active::socket::submit(unsigned request)
+{
+	if( m_submitted & request ) return;
 
-	for( std::list<read>::const_iterator r=m_readers.begin(); r!=m_readers.end(); ++r)
+	bool queued = true;
+	switch( request )
 	{
-		assert( r->fd>=0 );	// Could happen if we select a deleted/closed socket
-		assert( r->response );	// Semantic bug
-		FD_SET( r->fd, &rfds );
-		max_fd = std::max( max_fd, r->fd );
+	case uring_read:
+		if( m_reads.empty() || m_waiting_read ) return;
+		queued = m_uring->read( m_fd, m_reads.front().buffer, m_reads.front().buffer_size,
+			new socket_result(shared_from_this(), request) );
+		break;
+	case uring_accept:
+		if( m_accepts.empty() || m_waiting_read ) return;
+		queued = m_uring->accept( m_fd, new socket_result(shared_from_this(), request) );
+		break;
+	case uring_write:
+		{
+			if( m_writes.empty() || m_waiting_write || m_connect_pending ) return;
+	#ifdef IOV_MAX
+			const std::size_t max_iov = IOV_MAX < 256 ? IOV_MAX : 256;
+	#else
+			const std::size_t max_iov = 16;
+	#endif
+			m_iov.clear();
+			for( write_queue::const_iterator w=m_writes.begin(); w!=m_writes.end() && m_iov.size()<max_iov; ++w )
+			{
+				if( w->buffer_size )
+				{
+					iovec v = { const_cast<void*>(w->buffer), std::size_t(w->buffer_size) };
+					m_iov.push_back(v);
+				}
+			}
+			if( m_iov.empty() ) return complete_writes( m_writes, 0 );
+			queued = m_uring->writev( m_fd, &m_iov[0], unsigned(m_iov.size()),
+				new socket_result(shared_from_this(), request) );
+		}
+		break;
+	case uring_connect:
+		queued = m_uring->connect( m_fd, (const sockaddr*)&m_connect_address, sizeof(m_connect_address),
+			new socket_result(shared_from_this(), request) );
+		break;
 	}
 
-	for( std::list<write>::const_iterator w=m_writers.begin(); w!=m_writers.end(); ++w )
+	if( !queued )
 	{
-		assert( w->fd>=0 );
-		assert( w->response );
-		FD_SET( w->fd, &wfds );
-		max_fd = std::max( max_fd, w->fd );
+		// The ring is full, so wait for readiness instead, or connect directly.
+		uring_result r = { request, -EAGAIN };
+		if( request == uring_connect )
+			r.result = ::connect( m_fd, (const sockaddr*)&m_connect_address, sizeof(m_connect_address) ) ? -errno : 0;
+		return active_method(r);
 	}
+	m_submitted |= request;
+}
 
-#if DEBUG_SELECT
-	std::cout << "Selecting " << (m_readers.size()) << " readers, " << m_writers.size() << " writers\n";
-	int result =
-#endif
-		::select( max_fd+1, &rfds, &wfds, NULL, NULL );
-#if DEBUG_SELECT
-	std::cout << "Select complete: " << result << std::endl;
-	if( result<0 ) std::cerr << "Select error code: " << errno << std::endl;
-#endif
+// Results which would have blocked on older kernels wait for readiness as usual,
+// then submit the request again.
+void active::socket::active_method( uring_result r )
+{
+	m_submitted &= ~r.request;
+
+	switch( r.request )
+	{
+	case uring_read:
+		{
+			if( r.result == -EAGAIN ) return wait_read();
+
+			read & read = m_reads.front();
+			read_response response = { 0 };
+			response.buffer = read.buffer;
+			response.data = read.data;
+			response.bytes_read = r.result<0 ? -1 : r.result;
+			response.error = r.result>0 ? 0 : r.result==0 ? -1 : -r.result;
+
+			if( read.response )
+				read.response->send(response);
+			m_reads.pop_front();
+			do_reads();
+		}
+		break;
+	case uring_accept:
+		{
+			if( r.result == -EAGAIN ) return wait_read();
+
+			accept_response response;
+			response.fd = r.result>=0 ? r.result : -1;
+			response.error = r.result>=0 ? 0 : -r.result;
+
+			if( m_accepts.front().response )
+				m_accepts.front().response->send(response);
+			m_accepts.pop_front();
+			do_accepts();
+		}
+		break;
+	case uring_write:
+		if( r.result == -EAGAIN ) return wait_write();
+
+		if( r.result<0 || (r.result==0 && m_writes.front().buffer_size) )
+			fail_writes( m_writes, r.result==0 ? -1 : -r.result );
+		else
+			complete_writes( m_writes, r.result );
+		do_writes();
+		break;
+	case uring_connect:
+		{
+			// Completes in write_ready()
+			if( r.result == -EINPROGRESS || r.result == -EAGAIN ) return wait_write();
+
+			m_connect_pending = false;
+			connect_response response = { -r.result };
+			if( m_connecting )
+				m_connecting->send(response);
+			m_connecting.reset();
+			do_writes();
+		}
+		break;
+	}
+}
+#endif
+
+active::socket::reader::reader(int fd) : m_fd(fd)
+{
+}
+
+active::socket::writer::writer(int fd) : m_fd(fd), m_flush_pending(false)
+{
+}
+
+/////////////////////////////////////////////////////////////////////
+// Select
+
+#if ACTIVE_SOCKET_EPOLL
+
+active::select::select() : m_reactor(new reactor(reactor::level_triggered))
+{
+}
+
+active::select::select(scheduler & sched, bool use_uring)
+{
+	set_scheduler(sched);
+#if ACTIVE_SOCKET_URING
+	if( use_uring )
+	{
+		try
+		{
+			m_uring.reset( new uring(sched) );
+			return;
+		}
+		catch( std::runtime_error & )
+		{
+			// Not supported by this kernel, so use epoll instead
+		}
+	}
+#endif
+	m_reactor.reset( new reactor(sched, reactor::level_triggered) );
+}
+
+#if ACTIVE_SOCKET_URING
+namespace
+{
+	// Sends a readiness notification once a poll request completes.
+	template<typename Ready>
+	struct notify_ready : public active::uring::completion
+	{
+		notify_ready(const typename active::sink<Ready>::sp & response) : m_response(response) { }
+
+		void complete(int)
+		{
+			// Errors are reported too, and seen by the next read or write.
+			if( m_response )
+				m_response->send(Ready());
+		}
+
+		typename active::sink<Ready>::sp m_response;
+	};
+}
+#endif
+
+void active::select::active_method( read read )
+{
+#if ACTIVE_SOCKET_URING
+	if( m_uring )
+	{
+		// If the ring is full, try again after the messages already queued.
+		if( !m_uring->poll_add( read.fd, POLLIN, new notify_ready<read_ready>(read.response) ) )
+			(*this)(read);
+		return;
+	}
+#endif
+	(*m_reactor)(read);
+}
+
+void active::select::active_method( write write )
+{
+#if ACTIVE_SOCKET_URING
+	if( m_uring )
+	{
+		if( !m_uring->poll_add( write.fd, POLLOUT, new notify_ready<write_ready>(write.response) ) )
+			(*this)(write);
+		return;
+	}
+#endif
+	(*m_reactor)(write);
+}
+
+active::select::~select()
+{
+}
+
+#else
+
+active::select::select() :
+#if ENABLE_SELECT
+	m_loop( (::pipe(m_pipe) >=0 ? m_pipe[0] : -1) )
+#else
+	m_loop( -1 )
+#endif
+{
+}
+
+active::select::select(scheduler & sched, bool) :
+#if ENABLE_SELECT
+	m_loop( (::pipe(m_pipe) >=0 ? m_pipe[0] : -1) )
+#else
+	m_loop( -1 )
+#endif
+{
+	set_scheduler(sched);
+}
+
+void active::select::active_method( read read )
+{
+#if ENABLE_SELECT
+	// Note: We must queue the write BEFORE we interrupt the select
+	m_loop(read);
+	::_write( m_pipe[1], "X", 1 );
+#else
+	read.response->send(read_ready());
+#endif
+}
+
+void active::select::active_method( write write )
+{
+#if ENABLE_SELECT
+	m_loop(write);
+	::_write( m_pipe[1], "X", 1 );
+#else
+	write.response->send(write_ready());
+#endif
+}
+
+active::select::~select()
+{
+#if ENABLE_SELECT
+	::_close(m_pipe[0]);
+	::_close(m_pipe[1]);
+#endif
+}
+
+#endif
+
+active::select::select_loop::select_loop(int fd) : m_interrupt_fd(fd)
+{
+}
+
+void active::select::select_loop::active_method( do_select do_select )
+{
+	if( m_readers.empty() && m_writers.empty()) return;
+
+	int max_fd=m_interrupt_fd;
+
+	fd_set rfds, wfds;
+
+	FD_ZERO( &rfds );
+	FD_ZERO( &wfds );
+
+	FD_SET( m_interrupt_fd, &rfds );
+
+	for( std::list<read>::const_iterator r=m_readers.begin(); r!=m_readers.end(); ++r)
+	{
+		assert( r->fd>=0 );	// Could happen if we select a deleted/closed socket
+		assert( r->response );	// Semantic bug
+		FD_SET( r->fd, &rfds );
+		max_fd = std::max( max_fd, r->fd );
+	}
+
+	for( std::list<write>::const_iterator w=m_writers.begin(); w!=m_writers.end(); ++w )
+	{
+		assert( w->fd>=0 );
+		assert( w->response );
+		FD_SET( w->fd, &wfds );
+		max_fd = std::max( max_fd, w->fd );
+	}
+
+#if DEBUG_SELECT
+	std::cout << "Selecting " << (m_readers.size()) << " readers, " << m_writers.size() << " writers\n";
+	int result =
+#endif
+		::select( max_fd+1, &rfds, &wfds, NULL, NULL );
+#if DEBUG_SELECT
+	std::cout << "Select complete: " << result << std::endl;
+	if( result<0 ) std::cerr << "Select error code: " << errno << std::endl;
+#endif
 
 	for( std::list<read>::iterator r = m_readers.begin(); r!=m_readers.end(); )
 	{
@@ -291,82 +1039,1318 @@ void active::select::select_loop::active_method( write write )
 }
 
 
-////////////////////////////////////////////////////////////////////////
-// Pipe
+#if ACTIVE_SOCKET_EPOLL
 
-active::pipe::pipe(socket::ptr input,
-				   socket::ptr output,
-				   select::ptr sel,
-				   sink<closed>::sp closed_response ) :
-	m_input(input), m_output(output), m_select(sel), m_closed_response(closed_response)
-{
-}
+/////////////////////////////////////////////////////////////////////
+// Reactor
 
-void active::pipe::active_method( start start )
+active::reactor::reactor(trigger mode) :
+	m_epoll_fd( ::epoll_create1(EPOLL_CLOEXEC) ),
+	m_event_fd( ::eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK) ),
+	m_scheduler( nullptr ),
+	m_interrupted( false ),
+	m_loop( m_epoll_fd, m_event_fd, mode, nullptr )
 {
-	select::read read = { m_input->m_fd, shared_from_this() };
-	(*m_select)(read);
+	init();
 }
 
-void active::pipe::active_method( read_ready read_ready )
+active::reactor::reactor(scheduler & sched, trigger mode) :
+	m_epoll_fd( ::epoll_create1(EPOLL_CLOEXEC) ),
+	m_event_fd( ::eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK) ),
+	m_scheduler( &sched ),
+	m_interrupted( false ),
+	m_loop( m_epoll_fd, m_event_fd, mode, &sched )
 {
-	socket::read read = { m_buffer, sizeof(m_buffer), shared_from_this() };
-	(*m_input)(read);
+	init();
+	set_scheduler(sched);
+	m_loop.set_scheduler(sched);
+	sched.set_poller(this);
 }
 
-void active::pipe::active_method( read_response read_response )
+void active::reactor::init()
 {
-	if( read_response.error )
-	{
-		socket::shutdown sr = { SHUT_RD };
-		(*m_input)(sr);
-		socket::shutdown sw = { SHUT_WR };
-		(*m_output)(sw);
+	epoll_event ev = epoll_event();
+	ev.events = EPOLLIN;
+	ev.data.fd = m_event_fd;
 
-		if( m_closed_response )
-			m_closed_response->send(closed());
-	}
-	else
+	if( m_epoll_fd == -1 || m_event_fd == -1 ||
+		::epoll_ctl( m_epoll_fd, EPOLL_CTL_ADD, m_event_fd, &ev ) == -1 )
 	{
-		m_write_buffer = m_buffer;
-		m_write_remaining = read_response.bytes_read;
-		select::write write = { m_output->m_fd, shared_from_this() };
-		(*m_select)(write);
+		if( m_epoll_fd != -1 ) ::_close(m_epoll_fd);
+		if( m_event_fd != -1 ) ::_close(m_event_fd);
+		throw std::runtime_error("Could not create epoll reactor");
 	}
 }
 
-void active::pipe::active_method( write_ready write_ready )
+active::reactor::~reactor()
 {
-	socket::write write = { m_write_buffer, m_write_remaining, shared_from_this() };
-	(*m_output)(write);
+	if( m_scheduler && m_scheduler->get_poller()==this )
+		m_scheduler->set_poller(nullptr);
+	::_close(m_epoll_fd);
+	::_close(m_event_fd);
 }
 
-void active::pipe::active_method( write_response write_response )
+// Interrupts the wait in the loop, which may then see changed registrations.
+// Not needed when polled by a scheduler, because the changes are made in
+// worker threads which are not waiting.
+void active::reactor::wake()
 {
-	if( write_response.error )
+	if( !m_scheduler )
 	{
-		if( m_closed_response )
-			m_closed_response->send(closed());
+		uint64_t one = 1;
+		::_write( m_event_fd, &one, sizeof(one) );
 	}
-	else
+}
+
+// Note: We must queue the message BEFORE we interrupt the wait
+
+void active::reactor::active_method( add add )
+{
+	m_loop(add);
+	wake();
+}
+
+void active::reactor::active_method( arm arm )
+{
+	m_loop(arm);
+	wake();
+}
+
+void active::reactor::active_method( remove remove )
+{
+	m_loop(remove);
+	wake();
+}
+
+void active::reactor::active_method( select::read read )
+{
+	m_loop(read);
+	wake();
+}
+
+void active::reactor::active_method( select::write write )
+{
+	m_loop(write);
+	wake();
+}
+
+// Called by an idle worker of m_scheduler.
+// The events are handled by the loop, which owns the registrations.
+void active::reactor::poll(int timeout_ms)
+{
+	const int max_events = 256;
+	epoll_event events[max_events];
+
+	int count = ::epoll_wait( m_epoll_fd, events, max_events, timeout_ms );
+
+	ready msg;
+	msg.events.reserve( count>0 ? count : 0 );
+
+	for( int i=0; i<count; ++i )
 	{
-		if( write_response.buffer_size )
+		if( events[i].data.fd == m_event_fd )
 		{
-			// For some reason, not all data could be written
-			// So we enqueue another write
-			m_write_buffer = write_response.buffer;
-			m_write_remaining = write_response.buffer_size;
-			select::write write = { m_output->m_fd, shared_from_this() };
-			(*m_select)(write);
+			uint64_t value;
+			::_read( m_event_fd, &value, sizeof(value) );
+			m_interrupted = false;	// After the read, so that no interrupt is lost
 		}
 		else
 		{
-			select::read read = { m_input->m_fd, shared_from_this() };
-			(*m_select)(read);
+			event e = { events[i].data.fd, events[i].events };
+			msg.events.push_back(e);
 		}
 	}
+
+	if( !msg.events.empty() )
+		m_loop(msg);
+}
+
+void active::reactor::interrupt() throw()
+{
+	if( !m_interrupted.exchange(true) )
+	{
+		uint64_t one = 1;
+		::_write( m_event_fd, &one, sizeof(one) );
+	}
+}
+
+active::reactor::loop::loop(int epoll_fd, int event_fd, trigger mode, scheduler * sched) :
+	m_epoll_fd(epoll_fd), m_event_fd(event_fd), m_mode(mode), m_scheduler(sched),
+	m_active(0), m_waiting(false)
+{
+}
+
+active::reactor::loop::~loop()
+{
+	if( m_scheduler && m_waiting )
+		m_scheduler->stop_work();
+}
+
+active::reactor::loop::registration & active::reactor::loop::get(int fd)
+{
+	assert( fd>=0 );
+	if( std::size_t(fd) >= m_registrations.size() )
+		m_registrations.resize( fd+1 );
+	return m_registrations[fd];
+}
+
+void active::reactor::loop::active_method( add add )
+{
+	registration & r = get(add.fd);
+	r.reader = add.reader;
+	r.writer = add.writer;
+	r.armed = (add.reader ? armed_read : 0) | (add.writer ? armed_write : 0);
+	r.once = 0;
+	update(add.fd);
+	start();
+}
+
+void active::reactor::loop::active_method( arm arm )
+{
+	registration & r = get(arm.fd);
+	r.armed |= (arm.read ? armed_read : 0) | (arm.write ? armed_write : 0);
+	update(arm.fd);
+	start();
+}
+
+void active::reactor::loop::active_method( remove remove )
+{
+	registration & r = get(remove.fd);
+	if( r.in_set )
+		::epoll_ctl( m_epoll_fd, EPOLL_CTL_DEL, remove.fd, 0 );
+	if( r.interest ) --m_active;
+	r = registration();
+	start();
 }
 
+void active::reactor::loop::active_method( select::read read )
+{
+	assert( read.response );
+	registration & r = get(read.fd);
+	r.reader = read.response;
+	r.armed |= armed_read;
+	r.once |= armed_read;
+	update(read.fd);
+	start();
+}
+
+void active::reactor::loop::active_method( select::write write )
+{
+	assert( write.response );
+	registration & r = get(write.fd);
+	r.writer = write.response;
+	r.armed |= armed_write;
+	r.once |= armed_write;
+	update(write.fd);
+	start();
+}
+
+// Tells epoll which events we want for fd.
+void active::reactor::loop::update(int fd)
+{
+	registration & r = m_registrations[fd];
+
+	unsigned interest = 0;
+	if( r.reader && (r.armed & armed_read) ) interest |= EPOLLIN | EPOLLRDHUP;
+	if( r.writer && (r.armed & armed_write) ) interest |= EPOLLOUT;
+
+	if( !interest != !r.interest ) m_active += interest ? 1 : -1;
+	r.interest = interest;
+
+	// A one-shot registration is already disabled once it has fired.
+	if( !interest && (m_mode==level_triggered || !r.in_set) ) return;
+
+	epoll_event ev = epoll_event();
+	ev.events = interest | (m_mode==edge_triggered ? EPOLLET : EPOLLONESHOT);
+	ev.data.fd = fd;
+
+	if( r.in_set && ::epoll_ctl( m_epoll_fd, EPOLL_CTL_MOD, fd, &ev ) == 0 ) return;
+
+	// The descriptor may have been closed and its number reused.
+	if( ::epoll_ctl( m_epoll_fd, EPOLL_CTL_ADD, fd, &ev ) == 0 ||
+		(errno == EEXIST && ::epoll_ctl( m_epoll_fd, EPOLL_CTL_MOD, fd, &ev ) == 0) )
+	{
+		r.in_set = true;
+		return;
+	}
+
+	// Not supported by epoll (e.g. EPERM for a regular file), so treat as ready.
+	r.in_set = false;
+	unsigned ready = r.armed;
+	r.armed = 0;
+	if( interest ) --m_active;
+	r.interest = 0;
+	notify(fd, ready);
+}
+
+// Sends notifications for the armed directions in ready.
+void active::reactor::loop::notify(int fd, unsigned ready)
+{
+	registration & r = m_registrations[fd];
+
+	sink<read_ready>::sp reader;
+	sink<write_ready>::sp writer;
+
+	if( ready & armed_read ) reader = r.reader;
+	if( ready & armed_write ) writer = r.writer;
+
+	if( r.once & ready & armed_read ) r.reader.reset();
+	if( r.once & ready & armed_write ) r.writer.reset();
+	r.once &= ~ready;
+
+	if( reader ) reader->send(read_ready());
+	if( writer ) writer->send(write_ready());
+}
+
+void active::reactor::loop::active_method( wait )
+{
+	// Registrations may have been removed since the wait was queued.
+	if( !m_active )
+	{
+		m_waiting = false;
+		return;
+	}
+
+	const int max_events = 256;
+	epoll_event events[max_events];
+
+	int count = ::epoll_wait( m_epoll_fd, events, max_events, -1 );
+
+	for( int i=0; i<count; ++i )
+	{
+		const int fd = events[i].data.fd;
+		const unsigned e = events[i].events;
+
+		if( fd == m_event_fd )
+		{
+			uint64_t value;
+			::_read( m_event_fd, &value, sizeof(value) );
+			continue;
+		}
+
+		dispatch(fd, e);
+	}
+
+	m_waiting = false;
+	start();
+}
+
+void active::reactor::loop::active_method( ready ready )
+{
+	for( std::vector<event>::const_iterator e=ready.events.begin(); e!=ready.events.end(); ++e )
+		dispatch(e->fd, e->events);
+	start();
+}
+
+// Handles the epoll events for a registered descriptor.
+void active::reactor::loop::dispatch(int fd, unsigned events)
+{
+	registration & r = get(fd);
+	unsigned ready = 0;
+	if( events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR) ) ready |= armed_read;
+	if( events & (EPOLLOUT|EPOLLHUP|EPOLLERR) ) ready |= armed_write;
+	ready &= r.armed;
+
+	const unsigned released = ready & r.once;
+	r.armed &= m_mode == level_triggered ? ~ready : ~released;
+
+	notify(fd, ready);
+
+	// Edge-triggered registrations stay enabled, so only need updating
+	// when a one-shot sink has been released.
+	if( m_mode == level_triggered || released )
+		update(fd);
+}
+
+// Queue another wait if there is anything to wait for.
+// When polled by a scheduler, keep it working instead.
+void active::reactor::loop::start()
+{
+	if( m_scheduler )
+	{
+		if( !m_waiting != !m_active )
+		{
+			m_waiting = m_active!=0;
+			if( m_waiting )
+				m_scheduler->start_work();
+			else
+				m_scheduler->stop_work();
+		}
+	}
+	else if( !m_waiting && m_active )
+	{
+		m_waiting = true;
+		(*this)(wait());
+	}
+}
+
+#endif
+
+
+#if ACTIVE_SOCKET_URING
+
+/////////////////////////////////////////////////////////////////////
+// io_uring
+
+struct active::uring::sqe : public io_uring_sqe
+{
+	explicit sqe(int opcode) : io_uring_sqe()
+	{
+		this->opcode = opcode;
+	}
+};
+
+namespace
+{
+	// The kernel reads and writes the ring indexes concurrently.
+	unsigned load_acquire(const unsigned * p)
+	{
+		return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+	}
+
+	void store_release(unsigned * p, unsigned value)
+	{
+		__atomic_store_n(p, value, __ATOMIC_RELEASE);
+	}
+
+	int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+		const void * arg = 0, std::size_t arg_size = 0)
+	{
+		return int( ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size) );
+	}
+}
+
+active::uring::uring(scheduler & sched, unsigned entries) :
+	m_scheduler(sched), m_fd(-1), m_event_fd(-1),
+	m_rings(MAP_FAILED), m_sqes(MAP_FAILED), m_rings_size(0), m_sqes_size(0),
+	m_unsubmitted(0), m_interrupted(false), m_in_flight(0)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	m_fd = int( ::syscall(__NR_io_uring_setup, entries, &params) );
+
+	// Completions must not be dropped, and poll() needs a timeout.
+	const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if( m_fd == -1 || (params.features & required) != required )
+	{
+		release();
+		throw std::runtime_error("io_uring is not available");
+	}
+
+	m_rings_size = std::max( params.sq_off.array + params.sq_entries*sizeof(unsigned),
+		params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe) );
+	m_sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+	m_rings = ::mmap( 0, m_rings_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQ_RING );
+	m_sqes = ::mmap( 0, m_sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQES );
+	m_event_fd = ::eventfd( 0, EFD_CLOEXEC|EFD_NONBLOCK );
+
+	if( m_rings == MAP_FAILED || m_sqes == MAP_FAILED || m_event_fd == -1 )
+	{
+		release();
+		throw std::runtime_error("Could not create io_uring");
+	}
+
+	char * rings = static_cast<char*>(m_rings);
+	m_sq_head = reinterpret_cast<unsigned*>(rings + params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned*>(rings + params.sq_off.tail);
+	m_sq_array = reinterpret_cast<unsigned*>(rings + params.sq_off.array);
+	m_sq_mask = *reinterpret_cast<unsigned*>(rings + params.sq_off.ring_mask);
+	m_sq_entries = params.sq_entries;
+	m_cq_head = reinterpret_cast<unsigned*>(rings + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned*>(rings + params.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<unsigned*>(rings + params.cq_off.ring_mask);
+	m_cqes = rings + params.cq_off.cqes;
+
+	// Each slot of the submission queue always holds the same entry.
+	for( unsigned i=0; i<m_sq_entries; ++i )
+		m_sq_array[i] = i;
+
+	arm_wakeup();
+	sched.set_poller(this);
+}
+
+// set_poller() waits for other workers to leave poll(), flush() and interrupt(),
+// so the ring can then be unmapped. A worker reaping in this thread has already
+// finished with the ring, since reap() deletes completions last.
+active::uring::~uring()
+{
+	if( m_scheduler.get_poller()==this )
+		m_scheduler.set_poller(nullptr);
+	release();
+
+	// Requests still in flight are cancelled by closing the ring.
+	while( completion * c = m_in_flight )
+	{
+		m_in_flight = c->m_next;
+		delete c;
+		m_scheduler.stop_work();
+	}
+}
+
+void active::uring::release()
+{
+	if( m_rings != MAP_FAILED ) ::munmap( m_rings, m_rings_size );
+	if( m_sqes != MAP_FAILED ) ::munmap( m_sqes, m_sqes_size );
+	if( m_event_fd != -1 ) ::_close( m_event_fd );
+	if( m_fd != -1 ) ::_close( m_fd );
+}
+
+// Copies the request into the submission queue. It is submitted later, by flush() or poll().
+// Each request keeps the scheduler working until its completion has run.
+// The last slot is kept for the wake-up request, so that it can always be re-armed.
+bool active::uring::queue(const sqe & e, completion * c)
+{
+	platform::lock_guard<platform::mutex> lock(m_mutex);
+
+	const unsigned tail = *m_sq_tail, limit = c ? m_sq_entries-1 : m_sq_entries;
+	if( tail - load_acquire(m_sq_head) >= limit )
+	{
+		submit();
+		if( tail - load_acquire(m_sq_head) >= limit )
+		{
+			delete c;
+			return false;
+		}
+	}
+
+	io_uring_sqe * slot = static_cast<io_uring_sqe*>(m_sqes) + (tail & m_sq_mask);
+	*slot = e;
+	slot->user_data = reinterpret_cast<uintptr_t>(c);
+	store_release( m_sq_tail, tail+1 );
+	m_unsubmitted.fetch_add(1, std::memory_order_relaxed);
+
+	// The wake-up request has no completion.
+	if( c )
+	{
+		c->m_prev = 0;
+		c->m_next = m_in_flight;
+		if( m_in_flight ) m_in_flight->m_prev = c;
+		m_in_flight = c;
+		m_scheduler.start_work();
+	}
+	return true;
+}
+
+void active::uring::submit()
+{
+	unsigned count = m_unsubmitted.load(std::memory_order_relaxed);
+	while( count )
+	{
+		int submitted = io_uring_enter( m_fd, count, 0, 0 );
+		if( submitted < 0 && errno == EINTR ) continue;
+		if( submitted <= 0 ) break;	// Try again later, for example after reaping
+		count -= submitted;
+	}
+	m_unsubmitted.store(count, std::memory_order_relaxed);
+}
+
+// Completions are deleted after the ring and its locks are no longer used, because
+// deleting one can release the last reference to the select which owns this.
+void active::uring::reap()
+{
+	scheduler & sched = m_scheduler;
+	completion * done = 0;
+
+	{
+		platform::unique_lock<platform::mutex> lock(m_reap_mutex, platform::try_to_lock);
+		if( !lock.owns_lock() ) return;	// Another worker is reaping
+
+		const unsigned batch = 64;
+		uint64_t user_data[batch];
+		int results[batch];
+
+		for(;;)
+		{
+			unsigned head = *m_cq_head, count = 0;
+			const unsigned tail = load_acquire(m_cq_tail);
+			for( ; head != tail && count < batch; ++head, ++count )
+			{
+				const io_uring_cqe & cqe = static_cast<io_uring_cqe*>(m_cqes)[head & m_cq_mask];
+				user_data[count] = cqe.user_data;
+				results[count] = cqe.res;
+			}
+			if( !count ) break;
+			store_release( m_cq_head, head );
+
+			for( unsigned i=0; i<count; ++i )
+			{
+				completion * c = reinterpret_cast<completion*>(uintptr_t(user_data[i]));
+				if( !c )
+				{
+					uint64_t value;
+					::_read( m_event_fd, &value, sizeof(value) );
+					m_interrupted = false;	// After the read, so that no interrupt is lost
+					arm_wakeup();
+					continue;
+				}
+
+				{
+					platform::lock_guard<platform::mutex> lock(m_mutex);
+					if( c->m_prev ) c->m_prev->m_next = c->m_next;
+					else m_in_flight = c->m_next;
+					if( c->m_next ) c->m_next->m_prev = c->m_prev;
+				}
+
+				try
+				{
+					c->complete(results[i]);
+				}
+				catch( ... )
+				{
+					// Message could not be sent
+				}
+				c->m_next = done;
+				done = c;
+			}
+		}
+	}
+
+	while( completion * c = done )
+	{
+		done = c->m_next;
+		delete c;
+		sched.stop_work();	// After complete(), whose messages keep it working
+	}
+}
+
+void active::uring::arm_wakeup()
+{
+	sqe e(IORING_OP_POLL_ADD);
+	e.fd = m_event_fd;
+	e.poll32_events = POLLIN;
+	queue(e, 0);
+}
+
+bool active::uring::poll_add(int fd, unsigned events, completion * c)
+{
+	sqe e(IORING_OP_POLL_ADD);
+	e.fd = fd;
+	e.poll32_events = events;
+	return queue(e, c);
+}
+
+// Offset -1 means the current file position, so this also works with pipes and sockets.
+bool active::uring::read(int fd, void * buffer, unsigned size, completion * c)
+{
+	sqe e(IORING_OP_READ);
+	e.fd = fd;
+	e.addr = reinterpret_cast<uintptr_t>(buffer);
+	e.len = size;
+	e.off = uint64_t(-1);
+	return queue(e, c);
+}
+
+bool active::uring::writev(int fd, const iovec * iov, unsigned count, completion * c)
+{
+	sqe e(IORING_OP_WRITEV);
+	e.fd = fd;
+	e.addr = reinterpret_cast<uintptr_t>(iov);
+	e.len = count;
+	e.off = uint64_t(-1);
+	return queue(e, c);
+}
+
+bool active::uring::accept(int fd, completion * c)
+{
+	sqe e(IORING_OP_ACCEPT);
+	e.fd = fd;
+	return queue(e, c);
+}
+
+bool active::uring::connect(int fd, const sockaddr * address, socklen_t length, completion * c)
+{
+	sqe e(IORING_OP_CONNECT);
+	e.fd = fd;
+	e.addr = reinterpret_cast<uintptr_t>(address);
+	e.off = length;
+	return queue(e, c);
+}
+
+// Called by an idle worker of m_scheduler.
+void active::uring::poll(int timeout_ms)
+{
+	{
+		platform::lock_guard<platform::mutex> lock(m_mutex);
+		submit();
+	}
+
+	if( load_acquire(m_cq_tail) == load_acquire(m_cq_head) )
+	{
+		__kernel_timespec ts = { timeout_ms/1000, (timeout_ms%1000) * 1000000LL };
+		io_uring_getevents_arg arg;
+		std::memset(&arg, 0, sizeof(arg));
+		arg.ts = reinterpret_cast<uintptr_t>(&ts);
+		io_uring_enter( m_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg) );
+	}
+
+	reap();
+}
+
+void active::uring::interrupt() throw()
+{
+	if( !m_interrupted.exchange(true) )
+	{
+		uint64_t one = 1;
+		::_write( m_event_fd, &one, sizeof(one) );
+	}
+}
+
+// Called by a worker after each slice, so only does anything when there is something to do.
+void active::uring::flush()
+{
+	if( m_unsubmitted.load(std::memory_order_relaxed) )
+	{
+		platform::lock_guard<platform::mutex> lock(m_mutex);
+		submit();
+	}
+
+	if( load_acquire(m_cq_tail) != load_acquire(m_cq_head) )
+		reap();
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Acceptor
+
+namespace
+{
+	int listen_socket()
+	{
+#ifdef __linux__
+		return ::socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+#else
+		return ::socket( AF_INET, SOCK_STREAM, 0 );
+#endif
+	}
+
+	int accept_nonblocking(int fd, sockaddr_in & address)
+	{
+		socklen_t size = sizeof(address);
+#ifdef __linux__
+		return ::accept4( fd, (sockaddr*)&address, &size, SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
+		int result = ::accept( fd, (sockaddr*)&address, &size );
+	#ifndef WIN32
+		if( result != -1 )
+			::fcntl( result, F_SETFL, ::fcntl( result, F_GETFL ) | O_NONBLOCK );
+	#endif
+		return result;
+#endif
+	}
+}
+
+active::acceptor::acceptor(int port, select::ptr sel, sink<accepted>::sp handler,
+	bool reuse_port, int backlog) :
+	m_fd( listen_socket() ), m_stopped(false), m_backoff_ms(0), m_select(sel), m_handler(handler)
+{
+	if( m_fd == -1 ) throw std::runtime_error("Could not create socket");
+
+	int one = 1;
+	::setsockopt( m_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one) );
+
+	bool ok = true;
+	if( reuse_port )
+	{
+#ifdef SO_REUSEPORT
+		ok = ::setsockopt( m_fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&one, sizeof(one) ) == 0;
+#else
+		ok = false;
+#endif
+	}
+
+#if !defined(__linux__) && !defined(WIN32)
+	if( ok )
+		ok = ::fcntl( m_fd, F_SETFL, ::fcntl( m_fd, F_GETFL ) | O_NONBLOCK ) == 0;
+#endif
+
+	sockaddr_in sa = sockaddr_in();
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if( !ok || ::bind( m_fd, (sockaddr*)&sa, sizeof(sa) ) || ::listen( m_fd, backlog ) )
+	{
+		::closesocket(m_fd);
+		throw std::runtime_error("Could not listen on port");
+	}
+}
+
+active::acceptor::~acceptor()
+{
+	::closesocket(m_fd);
+}
+
+void active::acceptor::active_method( start )
+{
+	select::read read = { m_fd, shared_from_this() };
+	(*m_select)(read);
+}
+
+// Shutting down the listening socket wakes up the pending select.
+void active::acceptor::active_method( stop )
+{
+	m_stopped = true;
+	::shutdown( m_fd, SHUT_RDWR );
+}
+
+void active::acceptor::active_method( read_ready )
+{
+	if( m_stopped )
+	{
+		m_select.reset();
+		m_handler.reset();
+		return;
+	}
+
+	bool exhausted = false;
+	for( int n=0; n<max_accepts; ++n )
+	{
+		accepted msg;
+		msg.fd = accept_nonblocking( m_fd, msg.address );
+		if( msg.fd == -1 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED ) continue;
+			exhausted = errno == EMFILE || errno == ENFILE;
+			break;	// The backlog is empty, or an error. Try again later.
+		}
+		m_handler->send(msg);
+		m_backoff_ms = 0;
+	}
+
+#ifdef ACTIVE_USE_CXX11
+	// The pending connections keep the socket readable, so waiting for it
+	// straight away would spin until a descriptor is freed.
+	if( exhausted )
+	{
+		m_backoff_ms = m_backoff_ms ? std::min(2*m_backoff_ms, int(max_backoff_ms)) : int(min_backoff_ms);
+		send_after( shared_from_this(), std::chrono::milliseconds(m_backoff_ms), start() );
+		return;
+	}
+#else
+	(void)exhausted;
+#endif
+
+	// Wait for more connections
+	select::read read = { m_fd, shared_from_this() };
+	(*m_select)(read);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Datagram socket
+
+#ifdef __linux__
+	#define ENABLE_MMSG 1
+#else
+	#define ENABLE_MMSG 0
+#endif
+
+active::datagram_socket::datagram_socket(int port, select::ptr sel, sink<received>::sp handler,
+	std::size_t max_size) :
+	m_fd( ::socket( AF_INET, SOCK_DGRAM, 0 ) ), m_max_size(max_size), m_select(sel), m_handler(handler),
+	m_waiting_read(false), m_waiting_write(false), m_flush_pending(false), m_stopped(false)
+{
+	if( m_fd == -1 ) throw std::runtime_error("Could not create socket");
+
+	sockaddr_in sa = sockaddr_in();
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+
+#ifdef WIN32
+	bool ok = false;
+#else
+	bool ok = ::fcntl( m_fd, F_SETFL, ::fcntl( m_fd, F_GETFL ) | O_NONBLOCK ) == 0;
+#endif
+
+	if( !ok || ::bind( m_fd, (sockaddr*)&sa, sizeof(sa) ) )
+	{
+		::closesocket(m_fd);
+		throw std::runtime_error("Could not bind datagram socket");
+	}
+}
+
+active::datagram_socket::~datagram_socket()
+{
+	::closesocket(m_fd);
+}
+
+int active::datagram_socket::port() const
+{
+	sockaddr_in sa = sockaddr_in();
+	socklen_t size = sizeof(sa);
+	return ::getsockname( m_fd, (sockaddr*)&sa, &size ) ? -1 : ntohs(sa.sin_port);
+}
+
+void active::datagram_socket::active_method( start )
+{
+	wait_read();
+}
+
+// Shutting down the socket wakes up the pending select.
+void active::datagram_socket::active_method( stop )
+{
+	m_stopped = true;
+	::shutdown( m_fd, SHUT_RDWR );
+	if( !m_waiting_read )
+	{
+		m_select.reset();
+		m_handler.reset();
+	}
+}
+
+void active::datagram_socket::wait_read()
+{
+	if( !m_waiting_read )
+	{
+		m_waiting_read = true;
+		select::read read = { m_fd, shared_from_this() };
+		(*m_select)(read);
+	}
+}
+
+void active::datagram_socket::wait_write()
+{
+	if( !m_waiting_write )
+	{
+		m_waiting_write = true;
+		select::write write = { m_fd, shared_from_this() };
+		(*m_select)(write);
+	}
+}
+
+// Receives a few batches, then waits again so that other objects get a turn.
+// The buffer is only allocated once data is ready.
+void active::datagram_socket::active_method( read_ready )
+{
+	m_waiting_read = false;
+	if( m_stopped )
+	{
+		m_select.reset();
+		m_handler.reset();
+		return;
+	}
+
+	for( int batches=0; batches<8; ++batches )
+	{
+		io_buffer buffer = default_io_buffer_pool.allocate( max_batch * m_max_size );
+		received msg;
+
+#if ENABLE_MMSG
+		mmsghdr headers[max_batch];
+		iovec iov[max_batch];
+		sockaddr_in addresses[max_batch];
+		for( int i=0; i<max_batch; ++i )
+		{
+			iov[i].iov_base = buffer.data() + i*m_max_size;
+			iov[i].iov_len = m_max_size;
+			headers[i].msg_hdr = msghdr();
+			headers[i].msg_hdr.msg_name = &addresses[i];
+			headers[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			headers[i].msg_hdr.msg_iov = &iov[i];
+			headers[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int count = ::recvmmsg( m_fd, headers, max_batch, MSG_DONTWAIT, 0 );
+		if( count<0 && errno == EINTR ) continue;
+
+		for( int i=0; i<count; ++i )
+		{
+			datagram d;
+			d.address = addresses[i];
+			d.data = buffer.slice( i*m_max_size, std::min<std::size_t>(headers[i].msg_len, m_max_size) );
+			msg.datagrams.push_back(d);
+		}
+#else
+		int count = 0;
+		for( ; count<max_batch; ++count )
+		{
+			datagram d;
+			socklen_t size = sizeof(d.address);
+			int bytes = ::recvfrom( m_fd, buffer.data() + count*m_max_size, int(m_max_size), 0,
+				(sockaddr*)&d.address, &size );
+			if( bytes<0 ) break;
+			d.data = buffer.slice( count*m_max_size, bytes );
+			msg.datagrams.push_back(d);
+		}
+#endif
+
+		if( !msg.datagrams.empty() )
+			m_handler->send(msg);
+		if( count < max_batch ) break;	// Drained, or an error such as ECONNREFUSED
+	}
+
+	wait_read();
+}
+
+void active::datagram_socket::active_method( write_ready )
+{
+	m_waiting_write = false;
+	do_sends();
+}
+
+// Datagrams which are already queued behind this one are sent together,
+// by a flush message after them.
+void active::datagram_socket::active_method( datagram d )
+{
+	m_sends.push_back(d);
+	if( m_waiting_write || m_flush_pending ) return;
+	if( empty() )
+		do_sends();
+	else
+	{
+		m_flush_pending = true;
+		(*this)(flush());
+	}
+}
+
+void active::datagram_socket::active_method( send send )
+{
+	m_sends.insert( m_sends.end(), send.datagrams.begin(), send.datagrams.end() );
+	if( m_waiting_write || m_flush_pending ) return;
+	if( empty() )
+		do_sends();
+	else
+	{
+		m_flush_pending = true;
+		(*this)(flush());
+	}
+}
+
+void active::datagram_socket::active_method( flush )
+{
+	m_flush_pending = false;
+	if( !m_waiting_write ) do_sends();
+}
+
+// A datagram which fails for any reason other than a full buffer is dropped.
+void active::datagram_socket::do_sends()
+{
+	while( !m_sends.empty() )
+	{
+#if ENABLE_MMSG
+		mmsghdr headers[max_batch];
+		iovec iov[max_batch];
+		int count = 0;
+		for( std::deque<datagram>::iterator d=m_sends.begin(); d!=m_sends.end() && count<max_batch; ++d, ++count )
+		{
+			iov[count].iov_base = d->data.data();
+			iov[count].iov_len = d->data.size();
+			headers[count].msg_hdr = msghdr();
+			headers[count].msg_hdr.msg_name = &d->address;
+			headers[count].msg_hdr.msg_namelen = sizeof(d->address);
+			headers[count].msg_hdr.msg_iov = &iov[count];
+			headers[count].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = ::sendmmsg( m_fd, headers, count, 0 );
+#else
+		const datagram & d = m_sends.front();
+		int sent = ::sendto( m_fd, d.data.data(), int(d.data.size()), 0,
+			(const sockaddr*)&d.address, sizeof(d.address) ) < 0 ? -1 : 1;
+#endif
+		if( sent<0 )
+		{
+			if( would_block(errno) ) return wait_write();
+			if( errno != EINTR ) m_sends.pop_front();
+			continue;
+		}
+		m_sends.erase( m_sends.begin(), m_sends.begin()+sent );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Pipe
+
+active::pipe::pipe(socket::ptr input,
+				   socket::ptr output,
+				   select::ptr sel,
+				   sink<closed>::sp closed_response,
+				   bool zero_copy ) :
+	m_reading(false), m_writing(false), m_eof(false), m_closed(false),
+	m_transfer(copy_data), m_in_kernel_pipe(0),
+	m_input(input), m_output(output), m_select(sel), m_closed_response(closed_response)
+{
+	m_kernel_pipe[0] = m_kernel_pipe[1] = -1;
+
+#if ENABLE_ZERO_COPY
+	if( zero_copy )
+	{
+		struct stat st;
+		if( ::fstat( m_input->m_fd, &st )==0 && S_ISREG(st.st_mode) )
+			m_transfer = sendfile_data;
+		else if( ::pipe2( m_kernel_pipe, O_NONBLOCK | O_CLOEXEC )==0 )
+			m_transfer = splice_data;
+	}
+#endif
+}
+
+active::pipe::~pipe()
+{
+	if( m_kernel_pipe[0] != -1 ) ::_close( m_kernel_pipe[0] );
+	if( m_kernel_pipe[1] != -1 ) ::_close( m_kernel_pipe[1] );
+}
+
+void active::pipe::active_method( start start )
+{
+	// A file is always readable, so sendfile only waits for the output.
+	if( m_transfer == sendfile_data )
+		request_write();
+	else
+		request_read();
+}
+
+bool active::pipe::has_output() const
+{
+	return !m_pending.empty() || m_in_kernel_pipe ||
+		(m_transfer == sendfile_data && !m_eof);
+}
+
+// Waits for data, unless enough is already waiting to be written.
+// Even non-blocking sockets wait for readiness first, so that no buffer is
+// held while the input is idle.
+void active::pipe::request_read()
+{
+	if( m_reading || m_eof || m_closed || m_pending.size() >= max_buffers ||
+		m_in_kernel_pipe >= splice_size || m_transfer == sendfile_data ) return;
+
+	m_reading = true;
+	select::read read = { m_input->m_fd, shared_from_this() };
+	(*m_select)(read);
+}
+
+// Non-blocking sockets wait by themselves when they can't write,
+// but zero-copy transfers always wait for the output to be ready.
+void active::pipe::request_write()
+{
+	if( m_writing || m_closed || !has_output() ) return;
+
+	m_writing = true;
+	if( m_output->nonblocking() && m_transfer == copy_data )
+	{
+		active_method( write_ready() );
+	}
+	else
+	{
+		select::write write = { m_output->m_fd, shared_from_this() };
+		(*m_select)(write);
+	}
+}
+
+void active::pipe::active_method( read_ready read_ready )
+{
+	if( m_transfer == splice_data )
+		return splice_in();
+
+	// The buffer is only allocated once there is data to read.
+	io_buffer data = default_io_buffer_pool.allocate(read_size);
+	socket::read read = { data.data(), read_size, shared_from_this(), data };
+	(*m_input)(read);
+}
+
+void active::pipe::active_method( read_response read_response )
+{
+	m_reading = false;
+
+	if( read_response.error )
+	{
+		m_eof = true;
+		finish();
+	}
+	else
+	{
+		m_pending.push_back( read_response.data.slice(0, read_response.bytes_read) );
+		request_write();
+		request_read();
+	}
+}
+
+void active::pipe::active_method( write_ready write_ready )
+{
+	if( m_in_kernel_pipe )
+		return splice_out();
+	if( m_transfer == sendfile_data )
+		return send_file();
+
+	const io_buffer & data = m_pending.front();
+	socket::write write = { data.data(), int(data.size()), shared_from_this(), data };
+	(*m_output)(write);
+}
+
+void active::pipe::active_method( write_response write_response )
+{
+	m_writing = false;
+
+	if( write_response.error )
+	{
+		m_closed = true;
+		m_pending.clear();
+		if( m_closed_response )
+			m_closed_response->send(closed());
+	}
+	else
+	{
+		if( write_response.buffer_size )
+		{
+			// For some reason, not all data could be written
+			// So we enqueue another write
+			io_buffer & data = m_pending.front();
+			data = data.slice( data.size()-write_response.buffer_size, write_response.buffer_size );
+		}
+		else
+		{
+			m_pending.pop_front();	// Returns the buffer to the pool
+		}
+		request_write();
+		request_read();
+		finish();
+	}
+}
+
+// Once all data has been written after the end of the input, shut down.
+void active::pipe::finish()
+{
+	if( m_eof && !m_closed && !has_output() )
+	{
+		m_closed = true;
+
+		socket::shutdown sr = { SHUT_RD };
+		(*m_input)(sr);
+		socket::shutdown sw = { SHUT_WR };
+		(*m_output)(sw);
+
+		if( m_closed_response )
+			m_closed_response->send(closed());
+	}
+}
+
+#if ENABLE_ZERO_COPY
+
+// Moves data from the input into the kernel pipe.
+void active::pipe::splice_in()
+{
+	m_reading = false;
+
+	ssize_t bytes = ::splice( m_input->m_fd, 0, m_kernel_pipe[1], 0,
+		splice_size - m_in_kernel_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+
+	if( bytes>0 )
+	{
+		m_in_kernel_pipe += bytes;
+		request_write();
+		request_read();
+	}
+	else if( bytes<0 && would_block(errno) )
+	{
+		request_read();
+	}
+	else if( bytes<0 && (errno==EINVAL || errno==ENOSYS) )
+	{
+		stop_zero_copy();
+		request_read();
+	}
+	else
+	{
+		// End of input, or error
+		m_eof = true;
+		finish();
+	}
+}
+
+// Moves data from the kernel pipe to the output.
+void active::pipe::splice_out()
+{
+	m_writing = false;
+
+	ssize_t bytes = ::splice( m_kernel_pipe[0], 0, m_output->m_fd, 0,
+		m_in_kernel_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+
+	if( bytes>0 )
+	{
+		m_in_kernel_pipe -= bytes;
+		request_write();
+		request_read();
+		finish();
+	}
+	else if( bytes<0 && would_block(errno) )
+	{
+		request_write();
+	}
+	else if( bytes<0 && (errno==EINVAL || errno==ENOSYS) )
+	{
+		// The data is already in the kernel pipe, so it is copied out from there.
+		stop_zero_copy();
+		request_write();
+	}
+	else
+	{
+		m_closed = true;
+		if( m_closed_response )
+			m_closed_response->send(closed());
+	}
+}
+
+void active::pipe::send_file()
+{
+	m_writing = false;
+
+	ssize_t bytes = ::sendfile( m_output->m_fd, m_input->m_fd, 0, splice_size );
+
+	if( bytes>0 )
+	{
+		request_write();
+	}
+	else if( bytes<0 && would_block(errno) )
+	{
+		request_write();
+	}
+	else if( bytes<0 && (errno==EINVAL || errno==ENOSYS) )
+	{
+		stop_zero_copy();
+		request_read();
+	}
+	else
+	{
+		m_eof = true;
+		finish();
+	}
+}
+
+// Reverts to copying through user space.
+void active::pipe::stop_zero_copy()
+{
+	while( m_in_kernel_pipe>0 )
+	{
+		io_buffer data = default_io_buffer_pool.allocate( m_in_kernel_pipe );
+		int bytes = ::_read( m_kernel_pipe[0], data.data(), m_in_kernel_pipe );
+		if( bytes<=0 ) break;
+		m_pending.push_back( data.slice(0, bytes) );
+		m_in_kernel_pipe -= bytes;
+	}
+	m_in_kernel_pipe = 0;
+	m_transfer = copy_data;
+}
+
+#else
+
+void active::pipe::splice_in()
+{
+}
+
+void active::pipe::splice_out()
+{
+}
+
+void active::pipe::send_file()
+{
+}
+
+void active::pipe::stop_zero_copy()
+{
+}
+
+#endif
+
 void active::pipe::send(read_ready msg)
 {
 	(*this)(msg);
@@ -4,8 +4,11 @@
 
 #include <active/shared.hpp>
 #include <active/sink.hpp>
+#include <active/scheduler.hpp>
 
 #include <list>
+#include <deque>
+#include <vector>
 
 #ifdef WIN32
 	#include <WinSock2.h>
@@ -13,16 +16,47 @@
 	#include <netinet/in.h>
 #endif
 
+#if defined(__linux__) && defined(ACTIVE_USE_CXX11) && !defined(ACTIVE_SOCKET_NO_EPOLL)
+	#define ACTIVE_SOCKET_EPOLL 1
+	#include <atomic>
+#endif
+
+#if ACTIVE_SOCKET_EPOLL && defined(__has_include) && !defined(ACTIVE_SOCKET_NO_URING)
+	#if __has_include(<linux/io_uring.h>)
+		#define ACTIVE_SOCKET_URING 1
+		#include <sys/uio.h>
+		#include <sys/socket.h>
+	#endif
+#endif
+
 namespace active
 {
+#if ACTIVE_SOCKET_EPOLL
+	struct reactor;
+#endif
+#if ACTIVE_SOCKET_URING
+	class uring;
+#endif
+
 	// Perform a select() statement on any waiting sockets.
 	// Note: This is bypassed on Windows because select does not work
 	// with heterogenous file descriptors on Windows.
+	// On Linux, requests are forwarded to a level-triggered reactor instead.
 	struct select : public shared<select>
 	{
 		select();
+
+		// Where supported, waits in the idle threads of sched instead of in a thread of its own.
+		// With use_uring, non-blocking sockets submit their I/O through io_uring where
+		// the kernel supports it, and otherwise fall back to waiting for readiness.
+		explicit select(scheduler & sched, bool use_uring = false);
 		~select();
 
+#if ACTIVE_SOCKET_URING
+		// The ring used by non-blocking sockets, or 0.
+		uring * get_uring() const { return m_uring.get(); }
+#endif
+
 		struct read_ready { };
 		struct write_ready { };
 
@@ -62,15 +96,310 @@ namespace active
 		};
 
 	private:
+#if ACTIVE_SOCKET_EPOLL
+		platform::shared_ptr<reactor> m_reactor;
+	#if ACTIVE_SOCKET_URING
+		platform::shared_ptr<uring> m_uring;	// Replaces m_reactor, if set
+	#endif
+#else
 		int m_pipe[2];
 		select_loop m_loop;
+#endif
 	};
 
 
+#if ACTIVE_SOCKET_EPOLL
+	/* Waits for sockets to become ready using epoll (Linux only).
+	 * Registrations persist until removed, and each wait only visits the descriptors
+	 * which are ready, so the cost does not grow with the number of connections.
+	 * The wait is interrupted through an eventfd whenever registrations change.
+	 * Descriptors which epoll cannot wait on, such as regular files, are reported
+	 * ready immediately.
+	 *
+	 * A reactor constructed with a scheduler becomes that scheduler's poller:
+	 * idle worker threads wait for I/O instead of a thread of the reactor's own.
+	 * Notifications may then occasionally be spurious, so should be handled
+	 * by non-blocking sockets.
+	 */
+	struct reactor : public shared<reactor>, public scheduler::poller
+	{
+		enum trigger
+		{
+			// Notify once, then wait for an arm message before notifying again.
+			level_triggered,
+
+			// Notify each time the descriptor becomes ready.
+			// The handler must then read or write until EAGAIN.
+			edge_triggered
+		};
+
+		reactor(trigger mode = level_triggered);
+		explicit reactor(scheduler & sched, trigger mode = level_triggered);
+		~reactor();
+
+		// scheduler::poller
+		void poll(int timeout_ms);
+		void interrupt() throw();
+
+		typedef select::read_ready read_ready;
+		typedef select::write_ready write_ready;
+
+		// Register a descriptor. Either sink may be empty.
+		struct add
+		{
+			int fd;
+			sink<read_ready>::sp reader;
+			sink<write_ready>::sp writer;
+		};
+
+		void active_method( add );
+
+		// Request another notification after a level-triggered notification,
+		// or force readiness to be checked again when edge-triggered.
+		struct arm
+		{
+			int fd;
+			bool read, write;
+		};
+
+		void active_method( arm );
+
+		struct remove
+		{
+			int fd;
+		};
+
+		void active_method( remove );
+
+		// One-shot requests, as for select.
+		// The sink is released after it has been notified.
+		void active_method( select::read );
+		void active_method( select::write );
+
+	private:
+		reactor(const reactor&); // = delete
+		reactor & operator=(const reactor&); // = delete
+
+		void init();
+		void wake();
+
+		struct wait { };
+
+		// Events returned by poll()
+		struct event
+		{
+			int fd;
+			unsigned events;
+		};
+
+		struct ready
+		{
+			std::vector<event> events;
+		};
+
+		struct loop : public object<loop>
+		{
+			loop(int epoll_fd, int event_fd, trigger mode, scheduler * sched);
+			~loop();
+			void active_method( add );
+			void active_method( arm );
+			void active_method( remove );
+			void active_method( select::read );
+			void active_method( select::write );
+			void active_method( wait );
+			void active_method( ready );
+		private:
+			enum { armed_read=1, armed_write=2 };
+
+			struct registration
+			{
+				registration() : armed(0), once(0), interest(0), in_set(false) { }
+				sink<read_ready>::sp reader;
+				sink<write_ready>::sp writer;
+				unsigned armed;		// Directions to notify
+				unsigned once;		// Directions whose sink is released after notifying
+				unsigned interest;	// Events requested from epoll
+				bool in_set;
+			};
+
+			registration & get(int fd);
+			void update(int fd);
+			void dispatch(int fd, unsigned events);
+			void notify(int fd, unsigned ready);
+			void start();
+
+			const int m_epoll_fd, m_event_fd;
+			const trigger m_mode;
+			scheduler * const m_scheduler;	// Polls for us, if set
+			std::vector<registration> m_registrations;	// Indexed by fd
+			int m_active;	// Number of registrations with a non-zero interest
+			bool m_waiting;	// Waiting in a thread, or holding m_scheduler's work
+		};
+
+		int m_epoll_fd, m_event_fd;
+		scheduler * const m_scheduler;
+		std::atomic<bool> m_interrupted;
+		loop m_loop;
+	};
+#endif
+
+#if ACTIVE_SOCKET_URING
+	/* Submits I/O through io_uring (Linux 5.11 or later), and becomes the poller
+	 * of a scheduler.
+	 * Requests from any thread are queued in the submission ring, and submitted
+	 * together by one system call after each slice of messages, or when the ring
+	 * is full. Workers reap completions between slices, and wait for them when idle.
+	 * The constructor throws std::runtime_error if io_uring is unavailable,
+	 * for example on older kernels or where it has been disabled.
+	 */
+	class uring : public scheduler::poller
+	{
+	public:
+		explicit uring(scheduler & sched, unsigned entries = 256);
+		~uring();
+
+		// Runs once a request has finished, with its result or -errno.
+		// Should only send messages.
+		struct completion
+		{
+			completion() : m_prev(0), m_next(0) { }
+			virtual ~completion() { }
+			virtual void complete(int result)=0;
+		private:
+			friend class uring;
+			completion * m_prev, * m_next;	// Requests in flight
+		};
+
+		// Each request takes ownership of its completion, which is deleted once it has run.
+		// Buffers must remain valid until then.
+		// Returns false, and deletes the completion without running it, if the submission
+		// queue is still full after submitting it. Try again later, or without the ring.
+		bool poll_add(int fd, unsigned events, completion * c);
+		bool read(int fd, void * buffer, unsigned size, completion * c);
+		bool writev(int fd, const iovec * iov, unsigned count, completion * c);
+		bool accept(int fd, completion * c);
+		bool connect(int fd, const sockaddr * address, socklen_t length, completion * c);
+
+		// scheduler::poller
+		void poll(int timeout_ms);
+		void interrupt() throw();
+		void flush();
+
+	private:
+		uring(const uring&); // = delete
+		uring & operator=(const uring&); // = delete
+
+		struct sqe;
+		bool queue(const sqe & e, completion * c);
+		void submit();	// With m_mutex held
+		void reap();
+		void arm_wakeup();
+		void release();
+
+		scheduler & m_scheduler;
+		int m_fd, m_event_fd;
+
+		// Shared with the kernel
+		void * m_rings, * m_sqes;
+		std::size_t m_rings_size, m_sqes_size;
+		unsigned * m_sq_head, * m_sq_tail, * m_sq_array, m_sq_mask, m_sq_entries;
+		unsigned * m_cq_head, * m_cq_tail, m_cq_mask;
+		void * m_cqes;
+
+		platform::mutex m_mutex;	// Protects the submission ring and m_in_flight
+		platform::mutex m_reap_mutex;	// Protects the completion ring
+		std::atomic<unsigned> m_unsubmitted;
+		std::atomic<bool> m_interrupted;
+		completion * m_in_flight;
+	};
+#endif
+
+
+	/* A reference-counted slice of memory from an io_buffer_pool.
+	 * Copies share the same memory, which returns to its pool
+	 * when the last copy is destroyed, so buffers can be sent between objects
+	 * in messages without copying the data.
+	 */
+	class io_buffer
+	{
+	public:
+		io_buffer() : m_block(0), m_data(0), m_size(0) { }
+		io_buffer(const io_buffer & other);
+		io_buffer & operator=(const io_buffer & other);
+		~io_buffer();
+
+		char * data() const { return m_data; }
+		std::size_t size() const { return m_size; }
+		bool empty() const { return !m_block; }
+
+		// A slice of this buffer, sharing the same memory.
+		io_buffer slice(std::size_t offset, std::size_t length) const;
+
+		// Releases the memory.
+		void reset();
+
+		struct block;
+	private:
+		friend class io_buffer_pool;
+		io_buffer(block * b, char * data, std::size_t size);
+
+		block * m_block;
+		char * m_data;
+		std::size_t m_size;
+	};
+
+	/* Allocates io_buffers in power-of-two size classes, from min_size to max_size,
+	 * and keeps up to a limited number of free buffers of each class for reuse.
+	 * Larger buffers are not pooled.
+	 */
+	class io_buffer_pool
+	{
+	public:
+		static const std::size_t min_size = 4096;
+		static const std::size_t max_size = 65536;
+
+		io_buffer_pool(std::size_t max_free_per_class = 64);
+		~io_buffer_pool();
+
+		// A buffer of at least size bytes.
+		io_buffer allocate(std::size_t size);
+
+		// Number of free buffers held by the pool.
+		std::size_t free_count() const;
+
+		// Frees the buffers held by the pool.
+		void trim();
+
+	private:
+		io_buffer_pool(const io_buffer_pool&); // = delete
+		io_buffer_pool & operator=(const io_buffer_pool&); // = delete
+
+		friend class io_buffer;
+		void recycle(io_buffer::block * b) throw();
+
+		enum { classes = 5 };	// 4K, 8K, 16K, 32K and 64K
+		const std::size_t m_max_free;
+		io_buffer::block * m_free[classes];
+		std::size_t m_free_count[classes];
+		mutable platform::mutex m_mutex;
+	};
+
+	// Used by pipe.
+	extern io_buffer_pool default_io_buffer_pool;
+
+
 	/* This is a fairly complete socket implementation.
 	 * It wraps POSIX/Winsock sockets and file descriptors in general.
+	 *
+	 * By default, reads and writes are blocking calls made by separate reader and
+	 * writer objects. Sockets constructed with a select object are non-blocking instead:
+	 * each call is attempted inline, and only waits on the select object when it would
+	 * block, so never ties up a thread. Non-blocking sockets are not supported on Windows.
 	 */
-	struct socket : public shared<socket>
+	struct socket :
+		public shared<socket>,
+		handle<socket, select::read_ready>,
+		handle<socket, select::write_ready>
 	{
 		// Tell the socket to shut down
 		struct shutdown { int mode; };
@@ -82,6 +411,7 @@ namespace active
 			int error;
 			void * buffer;
 			int bytes_read;
+			io_buffer data;	// As given in read
 		};
 
 		struct read
@@ -89,6 +419,7 @@ namespace active
 			void * buffer;
 			int buffer_size;
 			sink<read_response>::sp response;
+			io_buffer data;	// Optional: keeps buffer alive, and is passed to the response
 		};
 
 		void active_method( read );
@@ -99,6 +430,7 @@ namespace active
 			int error;
 			const void * buffer;	// The remaining data which didn't get sent
 			int buffer_size;	// 0 Means all data sent successfully
+			io_buffer data;	// As given in write
 		};
 
 		struct write
@@ -106,10 +438,24 @@ namespace active
 			const void * buffer;
 			int buffer_size;
 			sink<write_response>::sp response;
+			io_buffer data;	// Optional: keeps buffer alive, and is passed to the response
 		};
 
 		void active_method( write );
 
+		// Hold back partial packets until uncorked, or for a short while (TCP_CORK),
+		// so that small writes are sent in fewer packets. For latency-tolerant streams.
+		struct cork
+		{
+			bool enabled;
+		};
+
+		void active_method( cork );
+
+		// Sends queued writes. Sent internally.
+		struct flush { };
+		void active_method( flush );
+
 		struct accept_response
 		{
 			int fd;
@@ -138,8 +484,20 @@ namespace active
 
 		socket(int fd);
 		socket(int domain, int type, int protocol);
+
+		// Non-blocking sockets
+		socket(int fd, select::ptr sel);
+		socket(int domain, int type, int protocol, select::ptr sel);
 		~socket();
 
+		bool nonblocking() const { return m_select.get() != 0; }
+
+		typedef select::read_ready read_ready;
+		typedef select::write_ready write_ready;
+
+		void active_method( read_ready );
+		void active_method( write_ready );
+
 		// Can be public because it's const
 		const int m_fd;
 
@@ -173,6 +531,44 @@ namespace active
 		socket(const socket&); // = delete
 		socket & operator=(const socket&); // = delete
 
+		void set_nonblocking();
+
+		// Non-blocking operations which are waiting for the socket to be ready.
+		// Each runs until it would block, then queues a request on m_select.
+		void do_reads();
+		void do_accepts();
+		void do_writes();
+		void wait_read();
+		void wait_write();
+
+		select::ptr m_select;
+		std::deque<read> m_reads;
+		std::deque<accept> m_accepts;
+		std::deque<write> m_writes;
+		sink<connect_response>::sp m_connecting;
+		bool m_waiting_read, m_waiting_write, m_connect_pending, m_flush_pending;
+
+#if ACTIVE_SOCKET_URING
+	public:
+		// The result of a request submitted through io_uring. Sent internally.
+		struct uring_result
+		{
+			unsigned request;
+			int result;
+		};
+
+		void active_method( uring_result );
+	private:
+		enum { uring_read=1, uring_write=2, uring_accept=4, uring_connect=8 };
+
+		void submit(unsigned request);
+
+		uring * m_uring;	// Owned by m_select
+		unsigned m_submitted;	// Requests in flight
+		std::vector<iovec> m_iov;	// Of the write in flight
+		sockaddr_in m_connect_address;
+#endif
+
 		// Perform a blocking read without blocking the whole socket
 		struct reader : public object<reader>
 		{
@@ -182,14 +578,162 @@ namespace active
 		} m_reader;
 
 		// Perform a blocking write without blocking the whole object.
+		// Writes which are queued together are sent in one writev().
 		struct writer : public object<writer>
 		{
 			void active_method( write );
+			struct flush { };
+			void active_method( flush );
 			writer(int fd);
 			const int m_fd;
+		private:
+			std::deque<write> m_writes;
+			bool m_flush_pending;
 		} m_writer;
 	};
 
+	/* Listens on a TCP port, and accepts all waiting connections each time the
+	 * listening socket becomes readable. Accepted sockets are non-blocking.
+	 * Several acceptors can share a port with SO_REUSEPORT, where supported.
+	 * The kernel then spreads connections between them, so each can be driven
+	 * by its own scheduler and select object.
+	 */
+	struct acceptor :
+		public shared<acceptor>,
+		handle<acceptor, select::read_ready>
+	{
+		struct accepted
+		{
+			int fd;
+			sockaddr_in address;
+		};
+
+		// Throws std::runtime_error if the port cannot be listened on.
+		acceptor(int port, select::ptr sel, sink<accepted>::sp handler,
+			bool reuse_port = false, int backlog = 1024);
+		~acceptor();
+
+		struct start { };
+		void active_method( start );
+
+		// Stops accepting connections, and releases the select object.
+		struct stop { };
+		void active_method( stop );
+
+		typedef select::read_ready read_ready;
+		void active_method( read_ready );
+
+		// Most connections accepted per notification, so that other objects get a turn.
+		static const int max_accepts = 256;
+
+		// How long to wait before accepting again after running out of descriptors,
+		// doubling while they stay exhausted. Requires ACTIVE_USE_CXX11.
+		static const int min_backoff_ms = 10, max_backoff_ms = 1000;
+
+		const int m_fd;
+	private:
+		acceptor(const acceptor&); // = delete
+		acceptor & operator=(const acceptor&); // = delete
+
+		bool m_stopped;
+		int m_backoff_ms;	// 0 unless out of descriptors
+		select::ptr m_select;
+		sink<accepted>::sp m_handler;
+	};
+
+
+	/* A non-blocking UDP socket.
+	 * Each time the socket becomes readable, it receives up to max_batch datagrams
+	 * per system call with recvmmsg() (one at a time where unavailable), and sends
+	 * each batch to the handler in one message. The datagrams of a batch share one
+	 * pooled buffer. Datagrams queued together are sent with one sendmmsg().
+	 * Not supported on Windows.
+	 */
+	struct datagram_socket :
+		public shared<datagram_socket>,
+		handle<datagram_socket, select::read_ready>,
+		handle<datagram_socket, select::write_ready>
+	{
+		struct datagram
+		{
+			sockaddr_in address;	// Source when received, destination when sent
+			io_buffer data;
+		};
+
+		// Datagrams which were received together.
+		struct received
+		{
+			std::vector<datagram> datagrams;
+		};
+
+		// Binds to the port on all interfaces, or to any free port if 0.
+		// Longer datagrams are truncated to max_size.
+		// Throws std::runtime_error on failure.
+		datagram_socket(int port, select::ptr sel, sink<received>::sp handler, std::size_t max_size = 2048);
+		~datagram_socket();
+
+		// Starts receiving.
+		struct start { };
+		void active_method( start );
+
+		// Stops receiving, and releases the handler and select object.
+		struct stop { };
+		void active_method( stop );
+
+		// Queues a datagram to send. There is no response: like any datagram,
+		// it is dropped if it cannot be sent.
+		void active_method( datagram );
+
+		// Queues several datagrams, for example to reply to a batch.
+		struct send
+		{
+			std::vector<datagram> datagrams;
+		};
+
+		void active_method( send );
+
+		// Sends queued datagrams. Sent internally.
+		struct flush { };
+		void active_method( flush );
+
+		typedef select::read_ready read_ready;
+		typedef select::write_ready write_ready;
+		void active_method( read_ready );
+		void active_method( write_ready );
+
+		// The bound port.
+		int port() const;
+
+		// Most datagrams per system call.
+		static const int max_batch = 32;
+
+		const int m_fd;
+	private:
+		datagram_socket(const datagram_socket&); // = delete
+		datagram_socket & operator=(const datagram_socket&); // = delete
+
+		void do_sends();
+		void wait_read();
+		void wait_write();
+
+		const std::size_t m_max_size;
+		select::ptr m_select;
+		sink<received>::sp m_handler;
+		std::deque<datagram> m_sends;
+		bool m_waiting_read, m_waiting_write, m_flush_pending, m_stopped;
+	};
+
+
+	/* Copies data from one socket to another.
+	 * Data is read into buffers from default_io_buffer_pool. While a buffer is being
+	 * written, the next can be read, up to max_buffers. An idle pipe holds no buffers.
+	 *
+	 * A zero-copy pipe (Linux only) instead moves data with splice() through a kernel
+	 * pipe, or with sendfile() when the input is a regular file, so the data never
+	 * enters user space. The copy is done by the pipe itself, so this is best suited
+	 * to non-blocking sockets. It falls back to copying if either descriptor
+	 * does not support it.
+	 */
 	struct pipe :
 		public shared<pipe>,
 		sink<select::read_ready>,
@@ -202,7 +746,9 @@ namespace active
 		pipe(	socket::ptr input,
 				socket::ptr output,
 				select::ptr sel,
-				sink<closed>::sp closed_response = sink<closed>::sp() );
+				sink<closed>::sp closed_response = sink<closed>::sp(),
+				bool zero_copy = false );
+		~pipe();
 
 		struct start { };
 
@@ -223,9 +769,29 @@ namespace active
 		void send(read_response);
 		void send(write_response);
 
-		char m_buffer[4096];
-		const void * m_write_buffer;
-		int m_write_remaining;
+		static const int read_size = 16384;
+		static const std::size_t max_buffers = 2;
+		static const int splice_size = 65536;
+
+	private:
+		enum transfer { copy_data, splice_data, sendfile_data };
+
+		void request_read();
+		void request_write();
+		void finish();
+		bool has_output() const;
+
+		void splice_in();
+		void splice_out();
+		void send_file();
+		void stop_zero_copy();
+
+		std::deque<io_buffer> m_pending;	// Read but not yet written. The front is being written.
+		bool m_reading, m_writing, m_eof, m_closed;
+
+		transfer m_transfer;
+		int m_kernel_pipe[2];	// For splice_data
+		int m_in_kernel_pipe;	// Bytes spliced in but not yet out
 
 		socket::ptr m_input, m_output;
 		select::ptr m_select;
@@ -0,0 +1,170 @@
+/*	Echoes datagrams over the loopback interface, and reports the rate.
+	The client keeps a window of datagrams in flight, and sends another
+	each time one is echoed. The server replies to each batch in one message.
+	Datagrams are not resent, so the client gives up if nothing is echoed for
+	a few seconds, in case one is dropped.
+
+	Usage: datagram_echo [datagrams] [size] [window] [threads] [epoll|uring]
+ */
+
+#include "active_socket.hpp"
+#include <active/timer.hpp>
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+struct reflector :
+	public active::shared<reflector>,
+	active::handle<reflector, active::datagram_socket::received>
+{
+	typedef active::datagram_socket::received received;
+
+	// The datagrams already hold the address to reply to.
+	void active_method( received received )
+	{
+		active::datagram_socket::send reply = { received.datagrams };
+		(*m_socket)(reply);
+	}
+
+	active::datagram_socket::ptr m_socket;
+};
+
+struct client :
+	public active::shared<client>,
+	active::handle<client, active::datagram_socket::received>
+{
+	client(int total, int size, int window, int server_port) :
+		m_total(total), m_received(0), m_window(window), m_sent(0), m_checked(0), m_watchdog()
+	{
+		m_server = sockaddr_in();
+		m_server.sin_family = AF_INET;
+		m_server.sin_port = htons(server_port);
+		m_server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		m_payload = active::default_io_buffer_pool.allocate(size).slice(0, size);
+		std::memset( m_payload.data(), 'x', size );
+	}
+
+	struct start { };
+
+	void active_method( start )
+	{
+		send_more( m_window );
+		m_watchdog = active::send_after( shared_from_this(), stall_timeout, check() );
+	}
+
+	// Stops if nothing has been echoed since the last check.
+	struct check { };
+
+	void active_method( check )
+	{
+		if( m_received >= m_total )
+			return;	// Finished as the timer fired
+		if( m_received == m_checked )
+		{
+			std::cerr << "Stalled after " << m_received << " datagrams\n";
+			stop();
+		}
+		else
+		{
+			m_checked = m_received;
+			m_watchdog = active::send_after( shared_from_this(), stall_timeout, check() );
+		}
+	}
+
+	typedef active::datagram_socket::received received;
+
+	void active_method( received received )
+	{
+		m_received += int(received.datagrams.size());
+		if( m_received >= m_total )
+		{
+			active::cancel_timer( shared_from_this(), m_watchdog );
+			stop();
+		}
+		else
+			send_more( int(received.datagrams.size()) );
+	}
+
+	active::datagram_socket::ptr m_socket, m_server_socket;
+	const int m_total;
+	int m_received;
+
+private:
+	static const std::chrono::seconds stall_timeout;
+
+	void stop()
+	{
+		(*m_socket)(active::datagram_socket::stop());
+		(*m_server_socket)(active::datagram_socket::stop());
+	}
+
+	void send_more(int n)
+	{
+		active::datagram_socket::send send;
+		for( ; n>0 && m_sent<m_total; --n, ++m_sent )
+		{
+			active::datagram_socket::datagram d = { m_server, m_payload };
+			send.datagrams.push_back(d);
+		}
+		if( !send.datagrams.empty() )
+			(*m_socket)(send);
+	}
+
+	const int m_window;
+	int m_sent;
+	sockaddr_in m_server;
+	active::io_buffer m_payload;
+	int m_checked;	// m_received at the last check
+	active::timer_id m_watchdog;
+};
+
+const std::chrono::seconds client::stall_timeout(5);
+
+int main(int argc, char**argv)
+{
+	const int total = argc>1 ? atoi(argv[1]) : 100000;
+	const int size = argc>2 ? atoi(argv[2]) : 64;
+	const int window = argc>3 ? atoi(argv[3]) : 64;
+	const int threads = argc>4 ? atoi(argv[4]) : 2;
+	const bool use_uring = argc>5 && std::string(argv[5])=="uring";
+
+	active::scheduler sched;
+	active::select::ptr select( new active::select(sched, use_uring) );
+
+	reflector::ptr server( new reflector() );
+	server->set_scheduler(sched);
+	server->m_socket.reset( new active::datagram_socket(0, select, server) );
+	server->m_socket->set_scheduler(sched);
+
+	client::ptr c( new client(total, size, window, server->m_socket->port()) );
+	c->set_scheduler(sched);
+	c->m_socket.reset( new active::datagram_socket(0, select, c) );
+	c->m_socket->set_scheduler(sched);
+	c->m_server_socket = server->m_socket;
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	{
+		active::run r(threads, sched);
+		(*server->m_socket)(active::datagram_socket::start());
+		(*c->m_socket)(active::datagram_socket::start());
+		(*c)(client::start());
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+	std::cout << "Echoed " << c->m_received << " datagrams of " << size << " bytes in " << seconds << " s: "
+		<< c->m_received / seconds << " datagrams/s\n";
+
+	// Break the cycles between the handlers and their sockets
+	server->m_socket.reset();
+	c->m_socket.reset();
+	c->m_server_socket.reset();
+	return c->m_received >= total ? 0 : 1;
+}
@@ -6,7 +6,7 @@ int main(int argc, char**argv)
 	active::socket::ptr input( new active::socket(0));
 	active::socket::ptr output( new active::socket(1));
 	active::select::ptr sel(new active::select());
-	active::pipe::ptr p(new active::pipe(input, output, sel));
+	active::pipe::ptr p(new active::pipe(input, output, sel, active::sink<active::pipe::closed>::sp(), true));
 
 	(*p)(active::pipe::start());
 	active::run();
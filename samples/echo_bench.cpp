@@ -0,0 +1,263 @@
+/*	Load generator and latency benchmark for the socket classes.
+	Starts an echo_server on 127.0.0.1 in this process, and drives it from
+	a number of concurrent connections. Each connection keeps up to "depth"
+	messages in flight, and times each one from being sent until its last
+	byte has been echoed back.
+
+	Usage: echo_bench [connections] [message size] [depth] [messages per connection]
+		[server threads] [client threads] [shards] [epoll|uring]
+
+	MB/s counts each echoed byte once.
+ */
+
+#include "echo_server.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <arpa/inet.h>
+#endif
+
+typedef std::chrono::high_resolution_clock clock_type;
+
+struct settings
+{
+	int connections, message_size, depth, messages;
+};
+
+struct client :
+	public active::shared<client>,
+	active::handle<client, active::socket::connect_response>,
+	active::handle<client, active::socket::read_response>,
+	active::handle<client, active::socket::write_response>
+{
+	client(const settings & s, const std::vector<char> & payload, active::select::ptr select, active::scheduler & sched) :
+		m_errors(0), m_finished(false), m_settings(s), m_payload(payload),
+		m_sock( new active::socket(AF_INET, SOCK_STREAM, 0, select) ),
+		m_buffer(65536), m_sent(0), m_completed(0), m_received(0)
+	{
+		set_scheduler(sched);
+		m_sock->set_scheduler(sched);
+
+		int one = 1;
+		::setsockopt( m_sock->m_fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one) );
+		m_latencies.reserve(s.messages);
+	}
+
+	struct start { int port; };
+
+	void active_method( start start )
+	{
+		active::socket::connect_in sc;
+		sc.sa = sockaddr_in();
+		sc.sa.sin_family = AF_INET;
+		sc.sa.sin_port = htons(start.port);
+		sc.sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sc.response = shared_from_this();
+		(*m_sock)(sc);
+	}
+
+	typedef active::socket::connect_response connect_response;
+	typedef active::socket::read_response read_response;
+	typedef active::socket::write_response write_response;
+
+	void active_method( connect_response connect_response )
+	{
+		if( connect_response.error )
+		{
+			fail();
+			return;
+		}
+
+		while( m_sent < m_settings.messages && m_sent < m_settings.depth )
+			send_one();
+		read_more();
+	}
+
+	void active_method( write_response write_response )
+	{
+		if( write_response.error || write_response.buffer_size ) fail();
+	}
+
+	void active_method( read_response read_response )
+	{
+		if( m_finished ) return;
+		if( read_response.error || read_response.bytes_read <= 0 )
+		{
+			fail();
+			return;
+		}
+
+		const clock_type::time_point now = clock_type::now();
+		m_received += read_response.bytes_read;
+		while( m_completed < m_sent && m_received >= (long long)(m_completed+1) * m_settings.message_size )
+		{
+			m_latencies.push_back( std::chrono::duration<double, std::micro>(now - m_send_times.front()).count() );
+			m_send_times.pop_front();
+			++m_completed;
+			if( m_sent < m_settings.messages ) send_one();
+		}
+
+		if( m_completed == m_settings.messages )
+		{
+			m_finished = true;
+			m_finish_time = now;
+		}
+		else
+			read_more();
+	}
+
+	// Read these once the clients' threads have finished.
+	std::vector<double> m_latencies;	// Microseconds
+	clock_type::time_point m_finish_time;
+	int m_errors;
+	bool m_finished;
+
+private:
+	void send_one()
+	{
+		m_send_times.push_back( clock_type::now() );
+		++m_sent;
+		active::socket::write w = { &m_payload[0], m_settings.message_size, shared_from_this() };
+		(*m_sock)(w);
+	}
+
+	void read_more()
+	{
+		active::socket::read r = { &m_buffer[0], int(m_buffer.size()), shared_from_this() };
+		(*m_sock)(r);
+	}
+
+	void fail()
+	{
+		++m_errors;
+		m_finished = true;
+		m_finish_time = clock_type::now();
+	}
+
+	const settings m_settings;
+	const std::vector<char> & m_payload;
+	active::socket::ptr m_sock;
+	std::vector<char> m_buffer;
+	std::deque<clock_type::time_point> m_send_times;
+	int m_sent, m_completed;
+	long long m_received;
+};
+
+double percentile(std::vector<double> & v, double p)
+{
+	std::size_t i = std::min(v.size()-1, std::size_t(p*v.size()));
+	std::nth_element(v.begin(), v.begin()+i, v.end());
+	return v[i];
+}
+
+// A port which is free at the moment.
+int free_port()
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in sa = sockaddr_in();
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t size = sizeof(sa);
+	int port = 12345;
+	if( fd != -1 && ::bind(fd, (sockaddr*)&sa, sizeof(sa))==0 && ::getsockname(fd, (sockaddr*)&sa, &size)==0 )
+		port = ntohs(sa.sin_port);
+	if( fd != -1 ) ::close(fd);
+	return port;
+}
+
+int main(int argc, char**argv)
+{
+	settings s;
+	s.connections = argc>1 ? atoi(argv[1]) : 16;
+	s.message_size = argc>2 ? atoi(argv[2]) : 1024;
+	s.depth = argc>3 ? atoi(argv[3]) : 4;
+	s.messages = argc>4 ? atoi(argv[4]) : 10000;
+	const int server_threads = argc>5 ? atoi(argv[5]) : 2;
+	const int client_threads = argc>6 ? atoi(argv[6]) : 2;
+	const int num_shards = argc>7 ? atoi(argv[7]) : 1;
+	const bool use_uring = argc>8 && std::string(argv[8])=="uring";
+
+	if( s.connections<1 || s.message_size<1 || s.depth<1 || s.messages<1 || num_shards<1 )
+	{
+		std::cerr << "Usage: echo_bench [connections] [message size] [depth] [messages per connection] "
+			"[server threads] [client threads] [shards] [epoll|uring]\n";
+		return 1;
+	}
+
+	const int port = free_port();
+
+	std::vector<echo_server::ptr> servers;
+	std::vector<active::platform::shared_ptr<active::run> > server_threads_list;
+	for( int i=0; i<num_shards; ++i )
+	{
+		servers.push_back( echo_server::ptr(new echo_server(use_uring)) );
+		servers.back()->listen(port, num_shards>1);
+		(*servers.back())(echo_server::start());
+		server_threads_list.push_back( active::platform::shared_ptr<active::run>(
+			new active::run(server_threads, servers.back()->m_scheduler) ) );
+	}
+
+	// Clients run on their own scheduler
+	active::scheduler client_scheduler;
+	active::select::ptr select( new active::select(client_scheduler, use_uring) );
+	const std::vector<char> payload( s.message_size, 'x' );
+
+	std::vector<client::ptr> clients;
+	for( int c=0; c<s.connections; ++c )
+	{
+		clients.push_back( client::ptr(new client(s, payload, select, client_scheduler)) );
+	}
+
+	const clock_type::time_point start_time = clock_type::now();
+	{
+		active::run r(client_threads, client_scheduler);
+		for( int c=0; c<s.connections; ++c )
+		{
+			client::start start = { port };
+			(*clients[c])(start);
+		}
+	}
+
+	std::vector<double> latencies;
+	clock_type::time_point finish_time = start_time;
+	int errors = 0;
+	for( int c=0; c<s.connections; ++c )
+	{
+		latencies.insert( latencies.end(), clients[c]->m_latencies.begin(), clients[c]->m_latencies.end() );
+		finish_time = std::max( finish_time, clients[c]->m_finish_time );
+		errors += clients[c]->m_errors;
+	}
+
+	// Close the connections, and let the server threads finish.
+	clients.clear();
+	for( int i=0; i<num_shards; ++i )
+		(*servers[i])(echo_server::stop());
+	server_threads_list.clear();
+
+	if( latencies.empty() )
+	{
+		std::cerr << "No messages were echoed\n";
+		return 1;
+	}
+
+	const double seconds = std::chrono::duration<double>(finish_time - start_time).count();
+	const double messages = double(latencies.size());
+
+	std::cout << "Connections,Size,Depth,Messages,Errors,MB/s,Msgs/s,p50(us),p99(us),p99.9(us)\n";
+	std::cout << s.connections << "," << s.message_size << "," << s.depth << ","
+		<< latencies.size() << "," << errors << ","
+		<< messages * s.message_size / seconds / 1e6 << ","
+		<< messages / seconds << ","
+		<< percentile(latencies, 0.5) << "," << percentile(latencies, 0.99) << ","
+		<< percentile(latencies, 0.999) << std::endl;
+
+	return errors ? 1 : 0;
+}
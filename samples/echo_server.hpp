@@ -0,0 +1,93 @@
+#include "active_socket.hpp"
+
+#include <stdexcept>
+
+#ifndef WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+// One shard of an echo server.
+// Each shard has its own listening socket, scheduler and select object,
+// and its connections stay on that shard. Run threads on m_scheduler.
+struct echo_server :
+	public active::shared<echo_server>,
+	active::handle<echo_server, active::acceptor::accepted>
+{
+	struct connection: public active::shared<connection>
+	{
+		connection(int fd, active::select::ptr select, active::scheduler & sched) :
+			m_sock(new active::socket(fd, select)), m_select(select), m_scheduler(sched)
+		{
+			set_scheduler(sched);
+			m_sock->set_scheduler(sched);
+
+			// Echo each message straight back
+			int one = 1;
+			::setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one) );
+		}
+
+		struct start { };
+
+		void active_method( start start )
+		{
+			m_pipe.reset( new active::pipe(m_sock, m_sock, m_select, active::sink<active::pipe::closed>::sp(), true ) );
+			m_pipe->set_scheduler(m_scheduler);
+			(*m_pipe)(active::pipe::start());
+		}
+
+	private:
+		active::socket::ptr m_sock;
+		active::select::ptr m_select;
+		active::scheduler & m_scheduler;
+		active::pipe::ptr m_pipe;
+	};
+
+	typedef active::acceptor::accepted accepted;
+
+	void active_method( accepted accepted )
+	{
+		connection::ptr conn( new connection(accepted.fd, m_select, m_scheduler) );
+		(*conn)(connection::start());
+	}
+
+	// With use_uring, sockets submit their I/O through io_uring where supported.
+	explicit echo_server(bool use_uring = false) : m_select(new active::select(m_scheduler, use_uring))
+	{
+		set_scheduler(m_scheduler);
+	}
+
+	// Listens on the port, so connections are queued from now on.
+	// Throws std::runtime_error on failure. Call before any threads run the server.
+	void listen(int port, bool reuse_port)
+	{
+		m_acceptor.reset( new active::acceptor(port, m_select, shared_from_this(), reuse_port) );
+		m_acceptor->set_scheduler(m_scheduler);
+	}
+
+	// Starts accepting connections.
+	struct start { };
+
+	void active_method(start start)
+	{
+		if( m_acceptor )
+			(*m_acceptor)(active::acceptor::start());
+	}
+
+	// Stop accepting connections. The threads finish once existing connections have closed.
+	struct stop { };
+
+	void active_method(stop stop)
+	{
+		if( m_acceptor )
+		{
+			(*m_acceptor)(active::acceptor::stop());
+			m_acceptor.reset();
+		}
+	}
+
+	active::scheduler m_scheduler;
+	active::select::ptr m_select;
+private:
+	active::acceptor::ptr m_acceptor;
+};
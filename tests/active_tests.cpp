@@ -11,15 +11,33 @@
 #include <active/promise.hpp>
 #include <active/thread.hpp>
 #include <active/advanced.hpp>
+#include <active/bucketed.hpp>
 #include <active/shared.hpp>
 #include <active/direct.hpp>
 #include <active/synchronous.hpp>
 #include <active/fast.hpp>
+#include <active/topology.hpp>
+#ifdef ACTIVE_USE_CXX11
+#include <active/lock_free.hpp>
+#include <active/slab_allocator.hpp>
+#include <active/timer.hpp>
+#include <active/deadline.hpp>
+#endif
 
 #include <iostream>
 #include <cassert>
 #include <vector>
 #include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <ftw.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 struct counter : public active::object<counter>
 {
@@ -449,6 +467,721 @@ void test_thread_pool()
 	}
 }
 
+void test_work_stealing()
+{
+	active::scheduler sched(active::policy::work_stealing);
+	assert( sched.get_scheduling() == active::policy::work_stealing );
+
+	const int N=1000, M=100;
+	object1 o1[N];
+	object2 o2[N];
+	for(int i=0; i<N; ++i)
+	{
+		o1[i].set_scheduler(sched);
+		o2[i].set_scheduler(sched);
+		o1[i].other = &o2[i];
+		o2[i].other = &o1[i];
+		object1::foo f = { M };
+		o1[i](f);
+	}
+	active::run(23, sched);
+	for(int i=0; i<N; ++i)
+	{
+		assert( o1[i].foo_value == M * (M+2) / 4 );	// 10+8+6+4+2
+		assert( o2[i].foo_value == M * M / 4 );	// 9+7+5+3+1
+	}
+}
+
+#ifdef __linux__
+void write_file(const std::string & path, const std::string & text)
+{
+	std::ofstream file(path.c_str());
+	file << text << std::endl;
+}
+
+int remove_entry(const char * path, const struct stat *, int, FTW *)
+{
+	return remove(path);
+}
+
+// Two packages of two cores with two threads each, numbered like Linux does.
+// Returns a new directory under the temp directory; remove it with remove_topology().
+std::string make_topology()
+{
+	const char * tmp = getenv("TMPDIR");
+	std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/active_topology_XXXXXX";
+	std::vector<char> name(pattern.begin(), pattern.end());
+	name.push_back(0);
+	const char * created = mkdtemp(&name[0]);
+	assert( created );
+	const std::string root(created);
+
+	mkdir((root+"/cpu").c_str(), 0755);
+	mkdir((root+"/cgroup").c_str(), 0755);
+	write_file(root+"/cpu/online", "0-7");
+	for(int id=0; id<8; ++id)
+	{
+		const int package = id/2 % 2, core = id % 2;
+		std::ostringstream dir, siblings, shared;
+		dir << root << "/cpu/cpu" << id;
+		siblings << id%4 << "," << id%4+4;
+		shared << package*2 << "-" << package*2+1 << "," << package*2+4 << "-" << package*2+5;
+		const char * subdirs[] = { "", "/topology", "/cache", "/cache/index0", "/cache/index1", package ? "/node1" : "/node0" };
+		for(int d=0; d<6; ++d)
+			mkdir((dir.str()+subdirs[d]).c_str(), 0755);
+		std::ostringstream c, p;
+		c << core;
+		p << package;
+		write_file(dir.str()+"/topology/core_id", c.str());
+		write_file(dir.str()+"/topology/physical_package_id", p.str());
+		write_file(dir.str()+"/cache/index0/level", "1");
+		write_file(dir.str()+"/cache/index0/shared_cpu_list", siblings.str());
+		write_file(dir.str()+"/cache/index1/level", "3");
+		write_file(dir.str()+"/cache/index1/shared_cpu_list", shared.str());
+	}
+	write_file(root+"/cgroup/cpu.max", "250000 100000");
+	write_file(root+"/cgroup/cpuset.cpus.effective", "0-6");
+	return root;
+}
+
+void remove_topology(const std::string & root)
+{
+	nftw(root.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+#endif
+
+void test_topology()
+{
+	const active::topology & system = active::topology::system();
+	assert( !system.cpus().empty() );
+	assert( system.concurrency() >= 1 );
+	assert( system.placement().size() == system.cpus().size() );
+
+#ifdef __linux__
+	const std::string root = make_topology();
+	const active::topology t(root+"/cpu");
+	assert( t.cpus().size()==8 );
+	assert( t.get_quota()==0 && t.concurrency()==8 );
+	assert( t.cpus()[2].node==1 && t.cpus()[2].package==1 && t.cpus()[6].cache==2 );
+	assert( t.distance(0,0)==0 );
+	assert( t.distance(0,4)==1 );	// SMT siblings
+	assert( t.distance(0,1)==2 );	// Same L3
+	assert( t.distance(0,2)==4 );	// Remote package
+	assert( t.distance(0,9)==4 );	// Unknown
+
+	// The cgroup limits the CPUs and the concurrency.
+	const active::topology limited(root+"/cpu", root+"/cgroup");
+	assert( limited.cpus().size()==7 );
+	assert( limited.get_quota()==2.5 && limited.concurrency()==3 );
+
+	// Physical cores first, package by package, then SMT siblings.
+	const std::vector<int> placement = limited.placement();
+	assert( placement.size()==7 );
+	for(int i=0; i<7; ++i)
+		assert( placement[i]==i );
+
+	remove_topology(root);
+#endif
+}
+
+#ifdef ACTIVE_USE_CXX11
+void test_persistent_pool()
+{
+	active::scheduler sched;
+	active::pool pool(4, sched);
+	pool.wait_idle();	// Nothing to do
+
+	const int N=100, M=100;
+	object1 o1[N];
+	object2 o2[N];
+	for(int burst=1; burst<=3; ++burst)
+	{
+		for(int i=0; i<N; ++i)
+		{
+			o1[i].set_scheduler(sched);
+			o2[i].set_scheduler(sched);
+			o1[i].other = &o2[i];
+			o2[i].other = &o1[i];
+			object1::foo f = { M };
+			o1[i](f);
+		}
+		pool.wait_idle();
+		for(int i=0; i<N; ++i)
+		{
+			assert( o1[i].foo_value == burst * M * (M+2) / 4 );
+			assert( o2[i].foo_value == burst * M * M / 4 );
+		}
+	}
+}
+
+struct bouncer : public active::object<bouncer>
+{
+	bouncer(active::scheduler & sched, int & count) : active::object<bouncer>(sched), other(0), count(count) { }
+	bouncer * other;
+	int & count;
+	void active_method(int n)
+	{
+		++count;
+		if( n ) (*other)(n-1);
+	}
+};
+
+struct observer : public active::object<observer>
+{
+	observer(active::scheduler & sched, const int & count) : active::object<observer>(sched), count(count), seen(-1) { }
+	const int & count;
+	int seen;
+	void active_method(bool)
+	{
+		seen = count;
+	}
+};
+
+#ifdef __linux__
+// Records the CPUs which the threads running its messages may use.
+struct affinity_probe : public active::object<affinity_probe>
+{
+	affinity_probe() : pinned(true) { }
+
+	std::vector<int> cpus;
+	bool pinned;	// Whether every message ran on a thread allowed only one CPU
+
+	void active_method(int)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if( sched_getaffinity(0, sizeof(set), &set)!=0 || CPU_COUNT(&set)!=1 )
+		{
+			pinned = false;
+			return;
+		}
+		for(int id=0; id<CPU_SETSIZE; ++id)
+			if( CPU_ISSET(id, &set) ) cpus.push_back(id);
+	}
+};
+#endif
+
+// With pinning, each pool thread is allowed only the CPU which
+// topology::placement() gives its worker, and the caller is left alone.
+void test_pinning()
+{
+	active::scheduler sched(active::policy::work_stealing);
+	assert( !sched.get_pinning() );
+	sched.set_pinning(true);
+	assert( sched.get_pinning() );
+
+#ifdef __linux__
+	cpu_set_t before, after;
+	CPU_ZERO(&before);
+	CPU_ZERO(&after);
+	assert( sched_getaffinity(0, sizeof(before), &before)==0 );
+
+	const int threads = 4, N = 16, M = 100;
+	affinity_probe probes[N];
+	{
+		active::pool pool(threads, sched);
+		for(int i=0; i<N; ++i)
+		{
+			probes[i].set_scheduler(sched);
+			for(int m=0; m<M; ++m)
+				probes[i](m);
+		}
+		pool.wait_idle();
+	}
+
+	// Workers 0 to threads-1 take the first CPUs of the placement, wrapping around.
+	const std::vector<int> placement = active::topology::system().placement();
+	const std::size_t used = std::min(placement.size(), std::size_t(threads));
+	for(int i=0; i<N; ++i)
+	{
+		assert( probes[i].pinned );
+		assert( probes[i].cpus.size()==std::size_t(M) );
+		for(std::size_t c=0; c<probes[i].cpus.size(); ++c)
+			assert( std::find(placement.begin(), placement.begin()+used, probes[i].cpus[c]) != placement.begin()+used );
+	}
+
+	assert( sched_getaffinity(0, sizeof(after), &after)==0 );
+	assert( CPU_EQUAL(&before, &after) );
+#endif
+
+	sched.set_pinning(false);
+	assert( !sched.get_pinning() );
+}
+
+// A pair of objects bouncing a message through the run-next slot
+// must not starve other objects.
+void test_run_next()
+{
+	for(int enabled=0; enabled<2; ++enabled)
+	{
+		active::scheduler sched;
+		sched.set_run_next(enabled!=0);
+		int count=0;
+		bouncer a(sched, count), b(sched, count);
+		a.other = &b;
+		b.other = &a;
+		observer o(sched, count);
+		a(10000);
+		o(true);
+		active::run(1, sched);
+		assert( count==10001 );
+		assert( o.seen>=0 && o.seen<100 );
+	}
+}
+
+// Delivers "events" to a counter from the idle loop, until it has delivered them all.
+struct counting_poller : public active::scheduler::poller
+{
+	counting_poller(active::scheduler & sched, counter & c, int events) :
+		sched(sched), c(c), remaining(events), polls(0), interrupts(0), flushes(0)
+	{
+		sched.start_work();
+	}
+
+	void poll(int timeout_ms)
+	{
+		assert( timeout_ms>0 );
+		++polls;
+		c(counter::inc());
+		if( --remaining==0 ) sched.stop_work();
+	}
+
+	void interrupt() throw()
+	{
+		++interrupts;
+	}
+
+	void flush()
+	{
+		++flushes;
+	}
+
+	active::scheduler & sched;
+	counter & c;
+	int remaining;
+	std::atomic<int> polls, interrupts, flushes;
+};
+
+// Waits until interrupted, or for the whole timeout.
+struct blocking_poller : public active::scheduler::poller
+{
+	blocking_poller() : interrupted(false), inside(0), interrupts(0) { }
+
+	void poll(int timeout_ms)
+	{
+		active::platform::unique_lock<active::platform::mutex> lock(mutex);
+		++inside;
+		if( !interrupted )
+			wake.wait_for(lock, std::chrono::milliseconds(timeout_ms));
+		interrupted = false;
+		--inside;
+	}
+
+	void interrupt() throw()
+	{
+		active::platform::lock_guard<active::platform::mutex> lock(mutex);
+		++interrupts;
+		interrupted = true;
+		wake.notify_one();
+	}
+
+	active::platform::mutex mutex;
+	active::platform::condition_variable wake;
+	bool interrupted;
+	std::atomic<int> inside, interrupts;
+};
+
+void test_poller()
+{
+	for(int threads=1; threads<=4; threads+=3)
+	{
+		active::scheduler sched;
+		counter c;
+		c.set_scheduler(sched);
+		counting_poller p(sched, c, 100);
+		sched.set_poller(&p);
+		active::run(threads, sched);
+		assert( c.count==100 );
+		assert( p.polls==100 );
+		assert( p.flushes>=100 );	// Each event is handled in a slice of its own
+		sched.set_poller(0);
+	}
+
+	// Removing the poller waits for a thread inside it, so that it can be destroyed.
+	{
+		active::scheduler sched;
+		active::pool pool(2, sched);
+		blocking_poller * p = new blocking_poller();
+		sched.set_poller(p);
+		while( !p->inside.load() )
+			active::platform::this_thread::yield();
+		sched.set_poller(0);
+		assert( !p->inside.load() && p->interrupts.load()>0 );
+		delete p;
+		counter c;
+		c.set_scheduler(sched);
+		c(counter::inc());
+		pool.wait_idle();
+		assert( c.count==1 );
+	}
+}
+
+struct timed : public active::object<timed>
+{
+	typedef std::chrono::steady_clock clock;
+
+	timed(active::scheduler & sched) : active::object<timed>(sched), count(0), stop_after(0) { }
+
+	struct tick { int value; };
+
+	void active_method(tick t)
+	{
+		times.push_back(clock::now());
+		values.push_back(t.value);
+		if( ++count == stop_after )
+			active::cancel_timer(*this, periodic);
+	}
+
+	int count, stop_after;
+	active::timer_id periodic;
+	std::vector<clock::time_point> times;
+	std::vector<int> values;
+};
+
+struct timed_shared : public active::shared<timed_shared>
+{
+	void active_method(timed::tick) { }
+};
+
+void test_timers()
+{
+	typedef std::chrono::steady_clock clock;
+	typedef std::chrono::milliseconds ms;
+
+	// Timers are not early, fire in order, and run() waits for them.
+	{
+		active::scheduler sched;
+		timed t(sched);
+		const clock::time_point start = clock::now();
+		for(int i=3; i>=1; --i)
+		{
+			timed::tick tick = { i };
+			active::send_after(t, ms(10*i), tick);
+		}
+		active::run(2, sched);
+		assert( t.count==3 );
+		for(int i=0; i<3; ++i)
+		{
+			assert( t.values[i]==i+1 );
+			assert( t.times[i] - start >= ms(10*(i+1)) );
+		}
+	}
+
+	// Cancelled timers do not fire or hold up run().
+	{
+		active::scheduler sched;
+		timed t(sched);
+		timed::tick tick = { 1 };
+		active::timer_id id = active::send_after(t, std::chrono::hours(1), tick);
+		assert( sched.cancel_timer(id) );
+		assert( !sched.cancel_timer(id) );
+		active::run(2, sched);
+		assert( t.count==0 );
+	}
+
+	// Periodic timers run until they are cancelled.
+	{
+		active::scheduler sched;
+		timed t(sched);
+		t.stop_after = 5;
+		timed::tick tick = { 1 };
+		const clock::time_point start = clock::now();
+		t.periodic = active::send_every(t, ms(2), tick);
+		active::run(1, sched);
+		// A tick may already be queued when the fifth one cancels the timer.
+		assert( t.count>=5 );
+		assert( t.times.back() - start >= ms(10) );
+	}
+
+	// A timer for a shared object which has gone does nothing.
+	{
+		active::scheduler sched;
+		timed_shared::ptr p( new timed_shared() );
+		p->set_scheduler(sched);
+		timed::tick tick = { 1 };
+		active::send_after(p, ms(5), tick);
+		p.reset();
+		active::run(1, sched);
+	}
+
+	// Parked threads wake for an earlier timer.
+	{
+		active::scheduler sched;
+		active::pool pool(2, sched);
+		timed t(sched);
+		timed::tick tick = { 1 };
+		active::timer_id late = active::send_after(t, std::chrono::hours(1), tick);
+		active::platform::this_thread::sleep_for(ms(20));
+		const clock::time_point start = clock::now();
+		active::send_after(t, ms(5), tick);
+		while( t.count==0 && clock::now() - start < std::chrono::seconds(10) )
+			active::platform::this_thread::sleep_for(ms(1));
+		assert( t.count==1 );
+		assert( t.times[0] - start < std::chrono::seconds(1) );
+		assert( sched.cancel_timer(late) );
+		pool.wait_idle();
+	}
+}
+
+struct costly : public active::object<costly>
+{
+	costly(active::scheduler & sched) : active::object<costly>(sched), count(0) { }
+
+	int count;
+
+	void active_method(std::chrono::microseconds cost)
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		while( std::chrono::steady_clock::now() - start < cost )
+			;
+		++count;
+	}
+};
+
+void test_quantum()
+{
+	active::scheduler sched;
+	assert( sched.get_quantum_messages()==100 && sched.get_quantum_microseconds()==0 );
+	sched.set_quantum(0, 200);
+	assert( sched.get_quantum_messages()==0 && sched.get_quantum_microseconds()==200 );
+
+	// Expensive objects run one message per slice, and cheap ones more than the default.
+	costly slow(sched), fast(sched);
+	for(int i=0; i<20; ++i)
+		slow(std::chrono::microseconds(1000));
+	for(int i=0; i<100000; ++i)
+		fast(std::chrono::microseconds(0));
+	active::run(1, sched);
+	assert( slow.count==20 && fast.count==100000 );
+	assert( slow.m_quantum==1 );
+	assert( fast.m_quantum>100 );
+}
+
+struct laned : public active::object<laned>
+{
+	laned(active::scheduler & sched, std::vector<int> & order, int id) :
+		active::object<laned>(sched), order(order), id(id) { }
+
+	std::vector<int> & order;
+	const int id;
+
+	struct run { int repeat; };
+
+	void active_method(run r)
+	{
+		order.push_back(id);
+		if( r.repeat>0 )
+		{
+			run next = { r.repeat-1 };
+			(*this)(next);
+		}
+	}
+};
+
+struct urgent { };
+
+namespace active
+{
+	template<> int priority(const urgent&) { return 3; }
+}
+
+struct raised : public active::object<raised>
+{
+	raised(active::scheduler & sched, std::vector<int> & order) : active::object<raised>(sched), order(order)
+	{
+		set_lane_from_priority(true);
+	}
+
+	std::vector<int> & order;
+
+	void active_method(urgent) { order.push_back(-2); }
+	void active_method(int) { order.push_back(-3); }
+};
+
+void test_lanes()
+{
+	// Objects in higher lanes run first.
+	{
+		active::scheduler sched;
+		std::vector<int> order;
+		std::vector<laned*> bulk;
+		for(int i=0; i<100; ++i)
+		{
+			bulk.push_back(new laned(sched, order, i));
+			laned::run r = { 0 };
+			(*bulk.back())(r);
+		}
+		laned control(sched, order, -1);
+		control.set_lane(2);
+		assert( control.get_lane()==2 );
+		laned::run r = { 0 };
+		control(r);
+
+		// A message with a high priority raises the lane of the object it activates.
+		raised rs(sched, order);
+		rs(urgent());
+		rs(1);
+
+		active::run(1, sched);
+		assert( order.size()==103 );
+		assert( order[0]==-2 && order[1]==-3 );
+		assert( order[2]==-1 );
+		for(int i=0; i<100; ++i)
+			delete bulk[i];
+	}
+
+	// Lower lanes are not starved by a busy higher lane.
+	{
+		active::scheduler sched;
+		std::vector<int> order;
+		laned bulk(sched, order, 0), control(sched, order, 1);
+		control.set_lane(3);
+		sched.set_quantum(1);
+		laned::run r = { 1000 };
+		control(r);
+		bulk(r);
+		active::run(1, sched);
+		assert( order.size()==2002 );
+		const std::size_t first_bulk = std::find(order.begin(), order.end(), 0) - order.begin();
+		assert( first_bulk < 100 );
+	}
+}
+#endif
+
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+struct quote
+{
+	int id;
+	active::deadline_type due;
+	int cost_ms;
+};
+
+namespace active
+{
+	template<> deadline_type deadline(const quote & q) { return q.due; }
+}
+
+template<typename Type>
+struct quote_sink : public active::object<quote_sink<Type>, Type>
+{
+	quote_sink(active::scheduler & sched, std::vector<int> & order) :
+		active::object<quote_sink<Type>, Type>(sched), order(order)
+	{
+	}
+
+	std::vector<int> & order;
+
+	void active_method(quote q)
+	{
+		order.push_back(q.id);
+		if( q.cost_ms ) active::platform::this_thread::sleep_for(std::chrono::milliseconds(q.cost_ms));
+	}
+
+	void active_method(int id) { order.push_back(id); }
+};
+
+void test_deadline_queue()
+{
+	typedef std::chrono::steady_clock clock;
+	const clock::time_point now = clock::now();
+	active::scheduler sched;
+	std::vector<int> order;
+	quote_sink<active::deadline_ordered> book(sched, order);
+
+	const quote q3 = { 3, now + std::chrono::seconds(30), 0 };
+	const quote q1 = { 1, now + std::chrono::seconds(10), 0 };
+	const quote q2 = { 2, now + std::chrono::seconds(20), 0 };
+	const quote stale = { -1, now - std::chrono::milliseconds(1), 0 };
+	book(100);
+	book(q3);
+	book(q1);
+	book(stale);
+	book(q2);
+	assert( book.size()==5 );
+	assert( book.get_deadline()==stale.due );
+
+	// Earliest deadline first, messages without a deadline last, and stale messages dropped.
+	active::run(1, sched);
+	assert( order.size()==4 );
+	assert( order[0]==1 && order[1]==2 && order[2]==3 && order[3]==100 );
+	active::deadline_counts counts = book.get_deadline_counts();
+	assert( counts.on_time==3 && counts.late==0 && counts.expired==1 );
+
+	// Messages which finish after their deadline are late.
+	const quote slow = { 4, clock::now() + std::chrono::milliseconds(5), 20 };
+	book(slow);
+	active::run(1, sched);
+	counts = book.get_deadline_counts();
+	assert( order.back()==4 && counts.on_time==3 && counts.late==1 && counts.expired==1 );
+
+	// Expired messages still run if requested.
+	book.set_discard_expired(false);
+	const quote stale2 = { -2, now - std::chrono::milliseconds(1), 0 };
+	book(stale2);
+	active::run(1, sched);
+	counts = book.get_deadline_counts();
+	assert( order.back()==-2 && counts.expired==2 );
+	assert( book.get_deadline()==active::deadline_type::max() );
+}
+
+void test_earliest_deadline()
+{
+	typedef std::chrono::steady_clock clock;
+	const clock::time_point now = clock::now();
+	active::scheduler sched(active::policy::earliest_deadline);
+	assert( sched.get_scheduling()==active::policy::earliest_deadline );
+	std::vector<int> order;
+
+	// Objects run in order of the deadline of the message which activated them,
+	// and objects without a deadline run last, in the order activated.
+	std::vector<quote_sink<active::basic>*> objects;
+	for(int i=0; i<10; ++i)
+		objects.push_back(new quote_sink<active::basic>(sched, order));
+	(*objects[0])(100);
+	for(int i=1; i<9; ++i)
+	{
+		const quote q = { 10-i, now + std::chrono::seconds(10-i), 0 };
+		(*objects[i])(q);
+	}
+	(*objects[9])(101);
+
+	active::run(1, sched);
+	assert( order.size()==10 );
+	for(int i=0; i<8; ++i)
+		assert( order[i]==i+2 );
+	assert( order[8]==100 && order[9]==101 );
+	for(int i=0; i<10; ++i)
+		delete objects[i];
+
+	// An object which is already activated moves up when its mailbox gets a message
+	// with an earlier deadline, and runs it first.
+	order.clear();
+	quote_sink<active::basic> early(sched, order), late(sched, order);
+	quote_sink<active::deadline_ordered> book(sched, order);
+	const quote q10 = { 10, now + std::chrono::seconds(10), 0 };
+	const quote q20 = { 20, now + std::chrono::seconds(20), 0 };
+	const quote q30 = { 30, now + std::chrono::seconds(30), 0 };
+	const quote q1 = { 1, now + std::chrono::seconds(1), 0 };
+	early(q10);
+	book(q30);
+	late(q20);
+	book(q1);
+	active::run(1, sched);
+	assert( order.size()==4 );
+	assert( order[0]==1 && order[1]==30 && order[2]==10 && order[3]==20 );
+}
+#endif
+
 struct except_object : public active::object<except_object>
 {
 	bool caught;
@@ -608,6 +1341,12 @@ void test_object_types()
 	test_object2( *active::platform::make_shared<test_object< active::schedule::thread_pool, active::queueing::direct_call, active::sharing::enabled<> > >() );
 	test_object2( *active::platform::make_shared<test_object< active::schedule::thread_pool, active::queueing::mutexed_call, active::sharing::enabled<> > >() );
 	test_object2( *active::platform::make_shared<test_object< active::schedule::thread_pool, steal1, active::sharing::enabled<> > >() );
+
+#ifdef ACTIVE_USE_CXX11
+	test_object< active::schedule::thread_pool, active::queueing::lock_free<>, active::sharing::disabled> obj5;
+	test_object2(obj5);
+	test_object2( *active::platform::make_shared<test_object< active::schedule::thread_pool, active::queueing::lock_free<>, active::sharing::enabled<> > >() );
+#endif
 }
 
 
@@ -637,6 +1376,9 @@ void test_clear()
 {
 	test_clear2<active::basic>();
 	test_clear2<active::advanced>();
+#ifdef ACTIVE_USE_CXX11
+	test_clear2<active::lock_free>();
+#endif
 	// Teeny tiny bug - clear does not necessarily clear everything on fast.
 	// test_clear2<active::fast>();
 }
@@ -979,6 +1721,53 @@ void test_move_semantics()
 	//assert( MoveObject::Counted::instances==5 );
 }
 
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+struct CopyCounted
+{
+	static int copies;
+	CopyCounted() { }
+	CopyCounted(const CopyCounted&) { ++copies; }
+	CopyCounted(CopyCounted&&) { }
+};
+
+int CopyCounted::copies=0;
+
+template<typename Type>
+struct move_only_object : public active::object<move_only_object<Type>, Type>
+{
+	int total;
+	const void * data;
+
+	move_only_object() : total(0), data(0) { }
+
+	void active_method(std::unique_ptr<int> p, std::vector<CopyCounted> v, CopyCounted)
+	{
+		total += *p;
+		data = v.data();
+	}
+};
+
+template<typename Type>
+void test_move_only()
+{
+	move_only_object<Type> obj;
+	std::vector<CopyCounted> v(5);
+	const void * data = v.data();
+	CopyCounted::copies = 0;
+	obj(std::unique_ptr<int>(new int(3)), std::move(v), CopyCounted());
+	active::run();
+	assert( obj.total==3 );
+	assert( obj.data==data );
+	assert( CopyCounted::copies==0 );
+}
+
+void test_move_only()
+{
+	test_move_only<active::basic>();
+	test_move_only<active::lock_free>();
+}
+#endif
+
 void test_promise()
 {
 	active::promise<int> x;
@@ -991,27 +1780,29 @@ namespace active
 	template<> int priority(const long & i) { return i; }
 }
 
-struct my_advanced : public active::object<my_advanced,active::advanced>
+template<typename Type>
+struct my_advanced : public active::object<my_advanced<Type>,Type>
 {
 	typedef long msg;
 	int previous;
 	my_advanced() : previous(4) { }
 	my_advanced(int limit) : previous(4)
 	{
-		set_capacity(limit);
-		assert( get_capacity() == limit );
+		this->set_capacity(limit);
+		assert( this->get_capacity() == limit );
 	}
 
 	void active_method(long msg)
 	{
-		assert( msg==0 || get_priority() == msg-1 );
+		assert( msg==0 || this->get_priority() == msg-1 );
 		assert( msg==this->previous-1 ); this->previous = msg;
 	}
 };
 
+template<typename Type>
 void test_advanced_ordering()
 {
-	my_advanced obj;
+	my_advanced<Type> obj;
 	obj(3L);
 	obj(1L);
 	obj(2L);
@@ -1019,9 +1810,10 @@ void test_advanced_ordering()
 	assert( obj.previous == 1 );
 }
 
+template<typename Type>
 void test_advanced_queue_limit()
 {
-	my_advanced obj(3);
+	my_advanced<Type> obj(3);
 	obj.set_queue_policy( active::policy::fail );
 	obj(1L);
 	obj(2L);
@@ -1051,15 +1843,45 @@ void test_advanced_queue_limit()
 	obj(3L);
 	obj(0L);
 	active::run();
+}
 
+void test_advanced_discard()
+{
+	my_advanced<active::advanced> obj(3);
 	obj.set_queue_policy( active::policy::discard );
-	obj.previous = 4;
 	obj(1L);
 	obj(2L);
 	obj(3L);
 	obj(3L);
 	active::run();
+}
+
+struct bucketed_discard : public active::object<bucketed_discard, active::bucketed>
+{
+	std::vector<long> received;
+	void active_method(long msg) { received.push_back(msg); }
+	void active_method(int msg) { received.push_back(msg); }
+};
+
+void test_bucketed_discard()
+{
+	bucketed_discard obj;
+	obj.set_capacity(3);
+	obj.set_queue_policy( active::policy::discard );
+	obj(2L);
+	obj(1);	// Priority 0
+	obj(2);	// Priority 0
+	obj(1L);	// Evicts the oldest lowest priority message, 1
+	obj(0);	// Evicts 2
+	obj(3L);	// Evicts 0
+	obj(100L);	// Clamped to the highest level, evicts 1L
+	obj(-5L);	// Clamped to 0, which is lower than anything queued, so discarded
+	active::run();
 
+	assert( obj.received.size()==3 );
+	assert( obj.received[0]==100 );
+	assert( obj.received[1]==3 );
+	assert( obj.received[2]==2 );
 }
 
 struct msg3{};
@@ -1217,6 +2039,11 @@ void test_containers(Visitor&v)
 	v(active::advanced());
 	v(active::shared<active::any_object,active::advanced>());
 
+#ifdef ACTIVE_USE_CXX11
+	v(active::lock_free());
+	v(active::shared<active::any_object,active::lock_free>());
+#endif
+
 	//v(active::thread());
 	//v(active::shared<active::any_object,active::thread>());
 
@@ -1245,6 +2072,21 @@ int main()
 	test_multiple_separate_instances();
 	test_pool();
 	test_thread_pool();
+	test_work_stealing();
+	test_topology();
+#ifdef ACTIVE_USE_CXX11
+	test_persistent_pool();
+	test_pinning();
+	test_run_next();
+	test_poller();
+	test_timers();
+	test_quantum();
+	test_lanes();
+#endif
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+	test_deadline_queue();
+	test_earliest_deadline();
+#endif
 
 	// Exceptions
 	test_exceptions();
@@ -1260,10 +2102,23 @@ int main()
 #ifdef ACTIVE_USE_CXX11
 	test_move_semantics();
 #endif
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+	test_move_only();
+#endif
 
 	// Advanced queueing object
-	test_advanced_ordering();
-	test_advanced_queue_limit();
+	test_advanced_ordering<active::advanced>();
+	test_advanced_queue_limit<active::advanced>();
+	test_advanced_discard();
+#ifdef ACTIVE_USE_CXX11
+	typedef active::object_impl<active::schedule::thread_pool,
+		active::queueing::advanced<active::slab_allocator<void> >, active::sharing::disabled> advanced_slab;
+	test_advanced_ordering<advanced_slab>();
+	test_advanced_queue_limit<advanced_slab>();
+#endif
+	test_advanced_ordering<active::bucketed>();
+	test_advanced_queue_limit<active::bucketed>();
+	test_bucketed_discard();
 	test_advanced_noreorder();
 	test_advanced_queue_control();
 	test_promise();
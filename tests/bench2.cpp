@@ -2,15 +2,22 @@
   */
 
 #include <active/object.hpp>
+#include <active/scheduler.hpp>
 #include <active/direct.hpp>
 #include <active/synchronous.hpp>
 #include <active/advanced.hpp>
+#include <active/bucketed.hpp>
 #include <active/thread.hpp>
 #include <active/fast.hpp>
 #include <active/promise.hpp>
 #include <active/shared.hpp>
+#ifdef ACTIVE_USE_CXX11
+#include <active/lock_free.hpp>
+#include <active/slab_allocator.hpp>
+#endif
 
 #include <iostream>
+#include <string>
 #include <cstring>
 #include <cassert>
 
@@ -85,10 +92,29 @@ const char * description() { return "todo"; }
 template<> const char * description<active::direct> () { return "active::direct"; }
 template<> const char * description<active::synchronous> () { return "active::synchronous"; }
 template<> const char * description<active::basic> () { return "active::basic"; }
+#ifdef ACTIVE_USE_CXX11
+template<> const char * description<active::lock_free> () { return "active::lock_free"; }
+#endif
 template<> const char * description<active::advanced> () { return "active::advanced"; }
+template<> const char * description<active::bucketed> () { return "active::bucketed"; }
+#ifdef ACTIVE_USE_CXX11
+// active::advanced with the slab allocator, to compare against active::advanced.
+typedef active::object_impl<active::schedule::thread_pool,
+	active::queueing::advanced<active::slab_allocator<void> >, active::sharing::disabled> advanced_slab;
+template<> const char * description<advanced_slab> () { return "active::advanced slab_allocator"; }
+#endif
 template<> const char * description<active::fast> () { return "active::fast"; }
 template<> const char * description<active::thread> () { return "active::thread"; }
 
+std::string description(const active::scheduler & sched)
+{
+	std::string d = sched.get_scheduling()==active::policy::work_stealing ? " work-stealing" : "";
+#ifdef ACTIVE_USE_CXX11
+	if( !sched.get_run_next() ) d += " no-run-next";
+#endif
+	return d;
+}
+
 namespace thread_ring
 {
 	template<typename Object>
@@ -102,11 +128,11 @@ namespace thread_ring
 		virtual void run(int threads)
 		{
 			m_nodes[0](m_messages);
-			active::run r(threads);
+			active::run r(threads, m_scheduler);
 		}
 		virtual void params(std::ostream&os)
 		{
-			os << "(" << description<Object>() << " " << m_messages << " " << m_nodes.size() << ")";
+			os << "(" << description<Object>() << description(m_scheduler) << " " << m_messages << " " << m_nodes.size() << ")";
 		}
 		virtual int messages()
 		{
@@ -125,11 +151,14 @@ namespace thread_ring
 			return "thread-ring";
 		}
 	public:
-		thread_ring_test(int messages, int nodes) : m_nodes(nodes), m_messages(messages)
+		thread_ring_test(int messages, int nodes, active::scheduler & sched) :
+			m_nodes(nodes), m_messages(messages), m_scheduler(sched)
 		{
 			for(int n=1; n<nodes; ++n)
 				m_nodes[n].next = &m_nodes[n-1];
 			m_nodes[0].next=&m_nodes[nodes-1];
+			for(int n=0; n<nodes; ++n)
+				m_nodes[n].set_scheduler(sched);
 		}
 		
 	private:
@@ -149,12 +178,13 @@ namespace thread_ring
 		
 		std::vector<node> m_nodes;
 		const int m_messages;
+		active::scheduler & m_scheduler;
 	};
 	
 	template<typename Object>
-	void run(int messages, int nodes)
+	void run(int messages, int nodes, active::scheduler & sched = active::default_scheduler)
 	{
-		thread_ring_test<Object> obj(messages,nodes);
+		thread_ring_test<Object> obj(messages,nodes,sched);
 		obj.run_tests();
 	};
 	
@@ -165,11 +195,130 @@ namespace thread_ring
 		
 		run<active::fast>(num_messages, 50);
 		run<active::basic>(num_messages, num_nodes);
+#ifdef ACTIVE_USE_CXX11
+		run<active::lock_free>(num_messages, num_nodes);
+#endif
 		run<active::advanced>(num_messages, num_nodes);
+#ifdef ACTIVE_USE_CXX11
+		run<advanced_slab>(num_messages, num_nodes);
+#endif
+		run<active::bucketed>(num_messages, num_nodes);
         run<active::thread>(num_messages/10,num_nodes/10);
+
+		active::scheduler work_stealing(active::policy::work_stealing);
+		run<active::basic>(num_messages, num_nodes, work_stealing);
+#ifdef ACTIVE_USE_CXX11
+		run<active::lock_free>(num_messages, num_nodes, work_stealing);
+#endif
+		run<active::advanced>(num_messages, num_nodes, work_stealing);
+#ifdef ACTIVE_USE_CXX11
+		run<advanced_slab>(num_messages, num_nodes, work_stealing);
+
+		active::scheduler no_run_next;
+		no_run_next.set_run_next(false);
+		run<active::basic>(num_messages, num_nodes, no_run_next);
+		run<active::lock_free>(num_messages, num_nodes, no_run_next);
+#endif
 	}
 };
 
+namespace payload_ring
+{
+	// A thread ring where every message also carries a large vector,
+	// which is moved from node to node.
+	template<typename Object>
+	struct payload_ring_test : public test
+	{
+		virtual void run(int threads)
+		{
+			std::vector<char> payload(m_bytes);
+			m_data = payload.data();
+			m_nodes[0](m_messages, std::move(payload));
+			active::run r(threads);
+		}
+		virtual void params(std::ostream&os)
+		{
+			os << "(" << description<Object>() << " " << m_messages << " " << m_nodes.size() << " " << m_bytes << ")";
+		}
+		virtual int messages()
+		{
+			return m_messages;
+		}
+		virtual int objects()
+		{
+			return m_nodes.size();
+		}
+		bool validate()
+		{
+			const node & first = m_nodes[0];
+			return first.last_count == int(m_messages % m_nodes.size()) && first.last_size == m_bytes
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+				// The payload must never have been copied.
+				&& first.last_data == m_data
+#endif
+				;
+		}
+		virtual const char * name()
+		{
+			return "payload-ring";
+		}
+	public:
+		payload_ring_test(int messages, int nodes, std::size_t bytes) :
+			m_nodes(nodes), m_messages(messages), m_bytes(bytes), m_data(0)
+		{
+			for(int n=1; n<nodes; ++n)
+				m_nodes[n].next = &m_nodes[n-1];
+			m_nodes[0].next=&m_nodes[nodes-1];
+		}
+
+	private:
+		payload_ring_test & operator=(const payload_ring_test&);
+
+		struct node : public active::object<node,Object>
+		{
+			node * next;
+			int last_count;
+			std::size_t last_size;
+			const char * last_data;
+			void active_method(int value, std::vector<char> payload)
+			{
+				last_count = value;
+				last_size = payload.size();
+				last_data = payload.data();
+				if( value ) (*next)(value-1, std::move(payload));
+			}
+			node() : last_count(-1), last_size(0), last_data(0) { }
+		};
+
+		std::vector<node> m_nodes;
+		const int m_messages;
+		const std::size_t m_bytes;
+		const char * m_data;
+	};
+
+	template<typename Object>
+	void run(int messages, int nodes)
+	{
+		payload_ring_test<Object> obj(messages, nodes, 4096);
+		obj.run_tests();
+	}
+
+	void run(bool quick)
+	{
+		int num_messages = quick ? 100000 : 10000000;
+		int num_nodes = 503;
+
+		run<active::basic>(num_messages, num_nodes);
+#ifdef ACTIVE_USE_CXX11
+		run<active::lock_free>(num_messages, num_nodes);
+#endif
+		run<active::advanced>(num_messages, num_nodes);
+#ifdef ACTIVE_USE_CXX11
+		run<advanced_slab>(num_messages, num_nodes);
+#endif
+	}
+}
+
 namespace sieve
 {
 	template<typename Object>
@@ -277,8 +426,14 @@ namespace sieve
 		run<active::synchronous>(max_recursive);
 		run<active::fast>(max_recursive);
 		run<active::basic>(max);
+#ifdef ACTIVE_USE_CXX11
+		run<active::lock_free>(max);
+#endif
 		// ?? Bug this should not deadlock
 		run<active::advanced>(max);
+#ifdef ACTIVE_USE_CXX11
+		run<advanced_slab>(max);
+#endif
 	}
 }
 
@@ -288,7 +443,7 @@ namespace fib
 	class fib_test : public test
 	{
 	public:
-		fib_test(int n) : m_value(n), m_node(n)
+		fib_test(int n, active::scheduler & sched) : m_value(n), m_node(n, sched), m_scheduler(sched)
 		{
 		}
 		
@@ -304,7 +459,7 @@ namespace fib
 		{
 			active::promise<int> r;
 			m_node(m_value, &r);
-			active::run s(threads);
+			active::run s(threads, m_scheduler);
             m_result = r.get();
 		}
         bool validate()
@@ -313,7 +468,7 @@ namespace fib
         }
 		virtual void params(std::ostream&os)
 		{
-			os << "(" << description<Object>() << " " << m_value << ")";
+			os << "(" << description<Object>() << description(m_scheduler) << " " << m_value << ")";
 		}
 		virtual int messages()
 		{
@@ -332,11 +487,11 @@ namespace fib
 
 		struct node : public active::object<node,Object>, active::handle<node,int>
 		{
-			node(int v)
+			node(int v, active::scheduler & sched) : active::object<node,Object>(sched)
 			{
 				if( v>2 )
 				{
-					m_left.reset( new node(v-1)), m_right.reset(new node(v-2));
+					m_left.reset( new node(v-1, sched)), m_right.reset(new node(v-2, sched));
 					m_objects = 1 + m_left->m_objects + m_right->m_objects;
 					m_messages = 3 + m_left->m_messages + m_right->m_messages;
 				}
@@ -373,12 +528,13 @@ namespace fib
 		const int m_value;
 		node m_node;
         int m_result;
+		active::scheduler & m_scheduler;
 	};
 	
 	template<typename Object>
-	void run(int n)
+	void run(int n, active::scheduler & sched = active::default_scheduler)
 	{
-		fib_test<Object> obj(n);
+		fib_test<Object> obj(n, sched);
 		obj.run_tests();
 	}
 	
@@ -389,7 +545,23 @@ namespace fib
 		run<active::synchronous>(n);
 		run<active::fast>(n);
 		run<active::basic>(n);
+#ifdef ACTIVE_USE_CXX11
+		run<active::lock_free>(n);
+#endif
 		run<active::advanced>(n);
+#ifdef ACTIVE_USE_CXX11
+		run<advanced_slab>(n);
+#endif
+
+		active::scheduler work_stealing(active::policy::work_stealing);
+		run<active::basic>(n, work_stealing);
+#ifdef ACTIVE_USE_CXX11
+		run<active::lock_free>(n, work_stealing);
+#endif
+		run<active::advanced>(n, work_stealing);
+#ifdef ACTIVE_USE_CXX11
+		run<advanced_slab>(n, work_stealing);
+#endif
 	}
 }
 
@@ -674,14 +846,15 @@ namespace fifo
 		std::vector<test_sink<Object> > m_sinks;
 	};
 	
+	template<typename Object>
 	struct advanced_queue_test : public test
 	{
-		struct sink : public active::object<sink,active::advanced>
+		struct sink : public active::object<sink,Object>
 		{
 			sink(int capacity) : m_total(0)
 			{
-				set_capacity(capacity);
-				set_queue_policy(active::policy::block);
+				this->set_capacity(capacity);
+				this->set_queue_policy(active::policy::block);
 			}
 			
 			void active_method(int i)
@@ -692,7 +865,7 @@ namespace fifo
 			int m_total;
 		};
 		
-		struct source : public active::object<source,active::advanced>
+		struct source : public active::object<source,Object>
 		{
 			source(sink &s) : m_sink(s)
 			{
@@ -721,7 +894,7 @@ namespace fifo
         }
 		virtual void params(std::ostream&os)
 		{
-			os << "(advanced " << m_count << " " << m_capacity << ")";
+			os << "(" << description<Object>() << " " << m_count << " " << m_capacity << ")";
 		}
 		virtual int messages()
 		{
@@ -769,21 +942,128 @@ namespace fifo
 
         run_buffer_test<active::fast>(quick, 2, 2);
 		run_buffer_test<active::basic>(quick, 2, 2);
+#ifdef ACTIVE_USE_CXX11
+		run_buffer_test<active::lock_free>(quick, 2, 2);
+#endif
 		run_buffer_test<active::advanced>(quick, 2, 2);
+#ifdef ACTIVE_USE_CXX11
+		run_buffer_test<advanced_slab>(quick, 2, 2);
+#endif
 		run_buffer_test<active::thread>(quick, 2, 2);
 
 		run_buffer_test<active::fast>(quick, 1, 1);
 		run_buffer_test<active::basic>(quick, 1, 1);
+#ifdef ACTIVE_USE_CXX11
+		run_buffer_test<active::lock_free>(quick, 1, 1);
+#endif
 		run_buffer_test<active::advanced>(quick, 1, 1);
+#ifdef ACTIVE_USE_CXX11
+		run_buffer_test<advanced_slab>(quick, 1, 1);
+#endif
 		run_buffer_test<active::thread>(quick, 1, 1);
 		
 		run_no_buffer_test<active::fast>(quick);
 		run_no_buffer_test<active::basic>(quick);
+#ifdef ACTIVE_USE_CXX11
+		run_no_buffer_test<active::lock_free>(quick);
+#endif
 		// run_no_buffer_test<active::advanced>(quick);
 		run_no_buffer_test<active::thread>(quick);
 		
-		advanced_queue_test t2(messages, queue_size);
+		advanced_queue_test<active::advanced> t2(messages, queue_size);
 		t2.run_tests(2);
+#ifdef ACTIVE_USE_CXX11
+		advanced_queue_test<advanced_slab> t4(messages, queue_size);
+		t4.run_tests(2);
+#endif
+		advanced_queue_test<active::bucketed> t3(messages, queue_size);
+		t3.run_tests(2);
+	}
+}
+
+namespace batch
+{
+	// Many small bursts of work, waiting for each to finish.
+	// Compares creating threads per burst with a persistent pool.
+	template<typename Object>
+	struct batch_test : public test
+	{
+		batch_test(int batches, int messages, bool persistent) :
+			m_batches(batches), m_messages(messages), m_persistent(persistent)
+		{
+			m_nodes[0].next = &m_nodes[1];
+			m_nodes[1].next = &m_nodes[0];
+		}
+
+		virtual void run(int threads)
+		{
+			m_nodes[0].count = m_nodes[1].count = 0;
+#ifdef ACTIVE_USE_CXX11
+			if( m_persistent )
+			{
+				active::pool p(threads);
+				for(int b=0; b<m_batches; ++b)
+				{
+					m_nodes[0](m_messages);
+					p.wait_idle();
+				}
+				return;
+			}
+#endif
+			for(int b=0; b<m_batches; ++b)
+			{
+				m_nodes[0](m_messages);
+				active::run r(threads);
+			}
+		}
+		virtual void params(std::ostream&os)
+		{
+			os << "(" << description<Object>() << (m_persistent ? " active::pool " : " active::run ")
+				<< m_batches << " " << m_messages << ")";
+		}
+		virtual int messages()
+		{
+			return m_batches * (m_messages+1);
+		}
+		virtual int objects()
+		{
+			return 2;
+		}
+		virtual const char * name()
+		{
+			return "batch";
+		}
+		bool validate()
+		{
+			return m_nodes[0].count + m_nodes[1].count == messages();
+		}
+
+	private:
+		struct node : public active::object<node,Object>
+		{
+			node * next;
+			int count;
+			void active_method(int value)
+			{
+				++count;
+				if( value ) (*next)(value-1);
+			}
+		};
+
+		const int m_batches, m_messages;
+		const bool m_persistent;
+		node m_nodes[2];
+	};
+
+	void run(bool quick)
+	{
+		int batches = quick ? 100 : 10000;
+		batch_test<active::basic> spawn(batches, 100, false);
+		spawn.run_tests();
+#ifdef ACTIVE_USE_CXX11
+		batch_test<active::basic> persistent(batches, 100, true);
+		persistent.run_tests();
+#endif
 	}
 }
 
@@ -795,9 +1075,11 @@ int main(int argc, char**argv)
 		"The tests are as follows:\n\n"
 		"Test name,Parameters,Description\n"
 		"thread-ring,(object type, nodes, iterations),Bounce a message around a ring of objects\n"
+		"payload-ring,(object type, iterations, nodes, bytes),Move a vector around a ring of objects\n"
 		"sieve,(object type,max),prime number sieve\n"
 		"fib,(object type, value),Recursive fibonacci\n"
-		"fifo,(object type,producers,consumers,count,buffer size),FIFO\n";
+		"fifo,(object type,producers,consumers,count,buffer size),FIFO\n"
+		"batch,(object type,active::run or active::pool,batches,messages),Wait for many small bursts of work\n";
 	;
 
 	std::cout << "\nGlobal parameters:\n";
@@ -820,7 +1102,9 @@ int main(int argc, char**argv)
 	
     sieve::run(quick);
 	thread_ring::run(quick);
+	payload_ring::run(quick);
 	fib::run(quick);
 	fifo::run(quick);
+	batch::run(quick);
 	std::cout << "Benchmarks finished!\n";
 }
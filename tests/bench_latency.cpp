@@ -0,0 +1,97 @@
+/*	Measures how long a message sent to an idle thread pool takes to run.
+	A ball is bounced between two objects a few times, with a pause between
+	each serve so that the worker threads have gone idle.
+	This is dominated by the cost of waking a worker.
+ */
+
+#include <active/object.hpp>
+#include <active/scheduler.hpp>
+#include <active/topology.hpp>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+typedef std::chrono::high_resolution_clock clock_type;
+
+struct player : public active::object<player>
+{
+	struct ball
+	{
+		int hits;
+		clock_type::time_point sent;
+	};
+
+	player * other;
+	std::vector<double> latencies;	// Microseconds
+	std::atomic<int> finished;
+
+	player() : finished(0) { }
+
+	void active_method(ball b)
+	{
+		clock_type::time_point now = clock_type::now();
+		latencies.push_back( std::chrono::duration<double, std::micro>(now-b.sent).count() );
+		if( b.hits>0 )
+		{
+			ball reply = { b.hits-1, clock_type::now() };
+			(*other)(reply);
+		}
+		else
+			finished.fetch_add(1, std::memory_order_release);
+	}
+};
+
+double percentile(std::vector<double> & v, double p)
+{
+	std::size_t i = std::min(v.size()-1, std::size_t(p*v.size()));
+	std::nth_element(v.begin(), v.begin()+i, v.end());
+	return v[i];
+}
+
+void run_test(int serves, int rally, int gap_us, int threads)
+{
+	player p1, p2;
+	p1.other = &p2;
+	p2.other = &p1;
+	{
+		active::run r(threads);
+		for(int s=0; s<serves; ++s)
+		{
+			active::platform::this_thread::sleep_for(std::chrono::microseconds(gap_us));
+			player::ball b = { 2*rally, clock_type::now() };
+			p1(b);
+			while( p1.finished.load(std::memory_order_acquire) + p2.finished.load(std::memory_order_acquire) <= s )
+				active::platform::this_thread::yield();
+		}
+	}
+
+	std::vector<double> serve_latency, all;
+	// The first hit of each rally is the wake-up from idle.
+	for(std::size_t i=0; i<p1.latencies.size(); i+=rally+1)
+		serve_latency.push_back(p1.latencies[i]);
+	all.insert(all.end(), p1.latencies.begin(), p1.latencies.end());
+	all.insert(all.end(), p2.latencies.begin(), p2.latencies.end());
+
+	std::cout << threads << "," << gap_us << "," << serves << ","
+		<< percentile(serve_latency, 0.5) << "," << percentile(serve_latency, 0.99) << ","
+		<< *std::max_element(serve_latency.begin(), serve_latency.end()) << ","
+		<< percentile(all, 0.5) << "," << percentile(all, 0.99) << std::endl;
+}
+
+int main(int argc, char**argv)
+{
+	const int serves = argc>1 ? atoi(argv[1]) : 1000;
+	const int rally = 10;
+	const int max_threads = active::topology::system().concurrency();
+
+	std::cout << "Threads,Gap(us),Serves,Wake p50(us),Wake p99(us),Wake max(us),Hit p50(us),Hit p99(us)\n";
+	const int gaps[] = { 100, 1000, 10000 };
+	for(int g=0; g<3; ++g)
+		for(int t=1; t<=max_threads; t*=2)
+			run_test(serves / (1+g*g), rally, gaps[g], t);
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*	Counts how often a message is copied and moved between the sender and
+	the active method, for each queue type, and measures the send rate.
+	With variadic templates, fails if a message is ever copied, or is not
+	moved exactly twice. Otherwise std::bind copies messages, so only report.
+ */
+
+#include <active/object.hpp>
+#include <active/advanced.hpp>
+#include <active/lock_free.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+
+struct counted
+{
+	static std::atomic<int> copies, moves;
+
+	counted() { }
+	counted(const counted&) { copies.fetch_add(1, std::memory_order_relaxed); }
+	counted(counted&&) { moves.fetch_add(1, std::memory_order_relaxed); }
+
+	char payload[64];
+};
+
+std::atomic<int> counted::copies(0), counted::moves(0);
+
+template<typename Type>
+struct receiver : public active::object<receiver<Type>, Type>
+{
+	int received;
+	receiver() : received(0) { }
+
+	void active_method(const counted&)
+	{
+		++received;
+	}
+};
+
+template<typename Type>
+bool bench(const char * name, int messages)
+{
+	receiver<Type> obj;
+	counted::copies = 0;
+	counted::moves = 0;
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for(int i=0; i<messages; ++i)
+		obj(counted());
+	active::run();
+	std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now()-start;
+
+	double copies = double(counted::copies) / messages, moves = double(counted::moves) / messages;
+	std::cout << name << "," << messages << "," << copies << "," << moves << ","
+		<< messages / (1000000.0 * duration.count()) << std::endl;
+
+	return obj.received==messages
+#ifdef ACTIVE_USE_VARIADIC_TEMPLATES
+		// Exactly one move into the method_call's stored arguments, and one as the
+		// method_call is moved into the queue, so that any extra move fails.
+		&& copies==0 && moves==2
+#endif
+		;
+}
+
+int main(int argc, char**argv)
+{
+	int messages = argc>1 ? atoi(argv[1]) : 1000000;
+
+	std::cout << "Object type,Messages,Copies per message,Moves per message,Million messages per second\n";
+	bool ok = bench<active::basic>("active::basic", messages);
+	ok = bench<active::lock_free>("active::lock_free", messages) && ok;
+	ok = bench<active::advanced>("active::advanced", messages) && ok;
+
+	if( !ok )
+	{
+		std::cout << "ERROR: Messages were copied or moved too often\n";
+		return 1;
+	}
+	return 0;
+}
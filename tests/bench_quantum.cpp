@@ -0,0 +1,126 @@
+/*	Measures fairness and throughput with messages of mixed cost.
+	A few heavy objects and many light objects each keep sending themselves
+	messages for a fixed time, so every object always has work. With a fixed
+	quantum, a heavy object holds its thread for the cost of many messages,
+	and the light objects wait. With a time budget, each slice takes about
+	the same time whatever the cost of the messages.
+	Fairness is Jain's index of the time that each object spends running:
+	1 if every object gets the same share of the threads.
+	The gap is the time between two consecutive messages of a light object.
+
+	Usage: bench_quantum [milliseconds] [threads] [heavy cost (us)]
+ */
+
+#include <active/object.hpp>
+#include <active/scheduler.hpp>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+typedef std::chrono::steady_clock clock_type;
+
+struct looper : public active::object<looper>
+{
+	looper(active::scheduler & sched, std::chrono::nanoseconds cost, const std::atomic<bool> & stop) :
+		active::object<looper>(sched), m_cost(cost), m_stop(stop), count(0), busy(0)
+	{
+	}
+
+	struct next { };
+
+	void active_method(next n)
+	{
+		const clock_type::time_point start = clock_type::now();
+		while( clock_type::now() - start < m_cost )
+			;
+		if( count++ ) gaps.push_back( std::chrono::duration<double, std::micro>(start - m_last).count() );
+		m_last = clock_type::now();
+		busy += std::chrono::duration<double>(m_last - start).count();
+		if( !m_stop.load(std::memory_order_relaxed) ) (*this)(n);
+	}
+
+private:
+	const std::chrono::nanoseconds m_cost;
+	const std::atomic<bool> & m_stop;
+	clock_type::time_point m_last;
+public:
+	long count;
+	double busy;	// Seconds
+	std::vector<double> gaps;	// Microseconds
+};
+
+double percentile(std::vector<double> & v, double p)
+{
+	std::size_t i = std::min(v.size()-1, std::size_t(p*v.size()));
+	std::nth_element(v.begin(), v.begin()+i, v.end());
+	return v[i];
+}
+
+void run_test(int messages, int microseconds, int milliseconds, int threads, int heavy_us)
+{
+	const int num_heavy = 4, num_light = 64;
+	active::scheduler sched;
+	sched.set_quantum(messages, microseconds);
+	std::atomic<bool> stop(false);
+
+	std::vector<looper*> heavy, light;
+	for(int i=0; i<num_heavy; ++i)
+		heavy.push_back(new looper(sched, std::chrono::microseconds(heavy_us), stop));
+	for(int i=0; i<num_light; ++i)
+		light.push_back(new looper(sched, std::chrono::nanoseconds(200), stop));
+
+	{
+		active::run r(threads, sched);
+		for(int i=0; i<num_heavy; ++i) (*heavy[i])(looper::next());
+		for(int i=0; i<num_light; ++i) (*light[i])(looper::next());
+		active::platform::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+		stop = true;
+	}
+
+	long heavy_count=0, light_count=0;
+	std::vector<double> gaps;
+	double sum=0, sum_squares=0;
+	for(int i=0; i<num_heavy; ++i)
+	{
+		heavy_count += heavy[i]->count;
+		sum += heavy[i]->busy;
+		sum_squares += heavy[i]->busy * heavy[i]->busy;
+		delete heavy[i];
+	}
+	for(int i=0; i<num_light; ++i)
+	{
+		light_count += light[i]->count;
+		sum += light[i]->busy;
+		sum_squares += light[i]->busy * light[i]->busy;
+		gaps.insert(gaps.end(), light[i]->gaps.begin(), light[i]->gaps.end());
+		delete light[i];
+	}
+	if( gaps.empty() ) gaps.push_back(0);
+
+	const double fairness = sum_squares ? sum*sum / ((num_heavy+num_light) * sum_squares) : 0;
+	const double seconds = milliseconds / 1000.0;
+
+	std::cout << messages << "," << microseconds << "," << threads << ","
+		<< light_count / seconds << "," << heavy_count / seconds << "," << fairness << ","
+		<< percentile(gaps, 0.99) << "," << percentile(gaps, 0.999) << ","
+		<< *std::max_element(gaps.begin(), gaps.end()) << std::endl;
+}
+
+int main(int argc, char**argv)
+{
+	const int milliseconds = argc>1 ? atoi(argv[1]) : 1000;
+	const int threads = argc>2 ? atoi(argv[2]) : 2;
+	const int heavy_us = argc>3 ? atoi(argv[3]) : 50;
+
+	std::cout << "Messages,Budget(us),Threads,Light msgs/s,Heavy msgs/s,Fairness,Gap p99(us),Gap p99.9(us),Gap max(us)\n";
+	run_test(100, 0, milliseconds, threads, heavy_us);
+	run_test(1000, 0, milliseconds, threads, heavy_us);
+	run_test(0, 50, milliseconds, threads, heavy_us);
+	run_test(0, 200, milliseconds, threads, heavy_us);
+	run_test(100, 100, milliseconds, threads, heavy_us);
+	return 0;
+}
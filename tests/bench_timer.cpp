@@ -0,0 +1,106 @@
+/*	Measures the scheduler's timers with a large number pending.
+	Adds timers with random delays spread over a period while the pool is
+	running, cancels every other one, then waits until the rest have fired.
+	Lateness is how long after its deadline each message runs, counting
+	only timers due after the adding and cancelling has finished.
+
+	Usage: bench_timer [timers] [spread (ms)] [threads]
+ */
+
+#include <active/object.hpp>
+#include <active/scheduler.hpp>
+#include <active/thread.hpp>
+#include <active/timer.hpp>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+typedef std::chrono::steady_clock clock_type;
+
+struct target : public active::object<target>
+{
+	target(active::scheduler & sched) : active::object<target>(sched) { }
+
+	struct due { clock_type::time_point deadline; };
+
+	std::vector<clock_type::time_point> deadlines, times;
+
+	void active_method(due d)
+	{
+		deadlines.push_back(d.deadline);
+		times.push_back(clock_type::now());
+	}
+};
+
+double percentile(std::vector<double> & v, double p)
+{
+	std::size_t i = std::min(v.size()-1, std::size_t(p*v.size()));
+	std::nth_element(v.begin(), v.begin()+i, v.end());
+	return v[i];
+}
+
+int main(int argc, char**argv)
+{
+	const int timers = argc>1 ? atoi(argv[1]) : 1000000;
+	const int spread_ms = argc>2 ? atoi(argv[2]) : 2000;
+	const int threads = argc>3 ? atoi(argv[3]) : 2;
+	const int num_targets = 64;
+
+	if( timers<2 || spread_ms<1 )
+	{
+		std::cerr << "Usage: bench_timer [timers] [spread (ms)] [threads]\n";
+		return 1;
+	}
+
+	active::scheduler sched;
+	active::pool pool(threads, sched);
+	std::vector<target*> targets;
+	for(int t=0; t<num_targets; ++t)
+		targets.push_back(new target(sched));
+
+	std::vector<active::timer_id> ids(timers);
+	unsigned random = 12345;
+	const clock_type::time_point add_start = clock_type::now();
+	for(int i=0; i<timers; ++i)
+	{
+		random = random * 1103515245 + 12345;
+		const std::chrono::microseconds delay( (random>>8) % (spread_ms*1000u) );
+		target::due d = { clock_type::now() + delay };
+		ids[i] = active::send_after(*targets[i%num_targets], delay, d);
+	}
+	const clock_type::time_point add_end = clock_type::now();
+
+	int cancelled = 0;
+	for(int i=0; i<timers; i+=2)
+		if( sched.cancel_timer(ids[i]) ) ++cancelled;
+	const clock_type::time_point cancel_end = clock_type::now();
+
+	pool.wait_idle();
+
+	std::vector<double> lateness;	// Microseconds
+	std::size_t fired = 0;
+	for(int t=0; t<num_targets; ++t)
+	{
+		fired += targets[t]->times.size();
+		for(std::size_t i=0; i<targets[t]->times.size(); ++i)
+			if( targets[t]->deadlines[i] > cancel_end )
+				lateness.push_back( std::chrono::duration<double, std::micro>(targets[t]->times[i] - targets[t]->deadlines[i]).count() );
+		delete targets[t];
+	}
+	if( lateness.empty() ) lateness.push_back(0);
+
+	const double add_ns = std::chrono::duration<double, std::nano>(add_end - add_start).count() / timers;
+	const double cancel_ns = std::chrono::duration<double, std::nano>(cancel_end - add_end).count() / ((timers+1)/2);
+	const bool ok = fired + cancelled == std::size_t(timers);
+
+	std::cout << "Timers,Spread(ms),Threads,Add(ns),Cancel(ns),Fired,Late p50(us),Late p99(us),Late max(us)\n";
+	std::cout << timers << "," << spread_ms << "," << threads << ","
+		<< add_ns << "," << cancel_ns << "," << fired << ","
+		<< percentile(lateness, 0.5) << "," << percentile(lateness, 0.99) << ","
+		<< *std::max_element(lateness.begin(), lateness.end()) << std::endl;
+
+	return ok ? 0 : 1;
+}
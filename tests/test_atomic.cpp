@@ -1,8 +1,12 @@
 #undef NDEBUG
 #include <active/atomic_fifo.hpp>
 #include <active/atomic_lifo.hpp>
+#include <active/run_queue.hpp>
+#include <active/slab_allocator.hpp>
 
 #include <vector>
+#include <set>
+#include <thread>
 #include <cassert>
 
 template<typename Fifo>
@@ -39,9 +43,78 @@ void test_stack()
 	assert( !q.pop() );
 }
 
+void test_run_queue()
+{
+	active::run_queue q;
+	std::vector<active::atomic_node> atomic_nodes(active::run_queue::capacity+1);
+	assert( q.empty() );
+	for( unsigned i=0; i<active::run_queue::capacity; ++i )
+	{
+		assert( q.push(&atomic_nodes[i]) );
+	}
+	assert( !q.push(&atomic_nodes.back()) );	// Full
+	for( unsigned i=0; i<10*active::run_queue::capacity; ++i )
+	{
+		// Wraps around several times
+		active::atomic_node * m = q.pop();
+		assert( m==&atomic_nodes[i%active::run_queue::capacity] );
+		assert( q.push(m) );
+	}
+	for( unsigned i=0; i<active::run_queue::capacity; ++i )
+	{
+		assert( q.pop()==&atomic_nodes[i] );
+	}
+	assert( q.empty() );
+	assert( !q.pop() );
+}
+
+void test_slab()
+{
+	for(std::size_t size=1; size<=2*active::slab::max_size; size+=7)
+	{
+		char * p = static_cast<char*>(active::slab::allocate(size));
+		p[0] = p[size-1] = 1;
+		active::slab::deallocate(p, size);
+		void * q = active::slab::allocate(size);
+		assert( size>active::slab::max_size || q==p );	// Reuses the block just freed
+		active::slab::deallocate(q, size);
+	}
+
+	// Blocks freed on one thread are reused by another.
+	const int count=10000;
+	std::vector<void*> blocks(count);
+	for(int i=0; i<count; ++i)
+		blocks[i] = active::slab::allocate(64);
+	std::thread consumer([&]
+	{
+		for(int i=0; i<count; ++i)
+			active::slab::deallocate(blocks[i], 64);
+	});
+	consumer.join();
+
+	std::set<void*> freed(blocks.begin(), blocks.end());
+	int reused=0;
+	for(int i=0; i<count; ++i)
+	{
+		blocks[i] = active::slab::allocate(64);
+		reused += freed.count(blocks[i]);
+	}
+	assert( reused > count-1024 );
+	for(int i=0; i<count; ++i)
+		active::slab::deallocate(blocks[i], 64);
+
+	active::slab_allocator<int> alloc;
+	std::vector<int, active::slab_allocator<int> > v(alloc);
+	for(int i=0; i<1000; ++i)
+		v.push_back(i);
+	assert( v[999]==999 );
+}
+
 int main(int argc, const char * argv[])
 {
 	test_fifo<active::atomic_fifo>();
 	test_stack<active::atomic_lifo>();
+	test_run_queue();
+	test_slab();
     return 0;
 }
@@ -3,6 +3,7 @@
 #include <active/fifo.hpp>
 #include <cassert>
 #include <cstdlib>
+#include <ctime>
 
 void test1()
 {
@@ -90,8 +91,53 @@ void test3()
 	assert( f.size()==0 );
 }
 
+static int chunks_allocated=0, chunks_live=0;
+
+template<typename T>
+struct counting_allocator : public std::allocator<T>
+{
+	template<typename U> struct rebind { typedef counting_allocator<U> other; };
+
+	counting_allocator() { }
+	template<typename U> counting_allocator(const counting_allocator<U>&) { }
+
+	T * allocate(std::size_t n)
+	{
+		++chunks_allocated;
+		++chunks_live;
+		return std::allocator<T>::allocate(n);
+	}
+
+	void deallocate(T * p, std::size_t n)
+	{
+		--chunks_live;
+		std::allocator<T>::deallocate(p, n);
+	}
+};
+
 void test_allocator()
 {
+	typedef active::fifo<int, counting_allocator<int> > fifo_type;
+	{
+		fifo_type f(counting_allocator<int>(), 256);
+
+		// Steady traffic reuses drained chunks.
+		for(int i=0; i<100000; ++i)
+		{
+			f.push(i);
+			if( f.size()>20 ) f.pop();
+		}
+		assert( chunks_allocated < 10 );
+
+		while( !f.empty() ) f.pop();
+		assert( chunks_live > 0 );
+		f.shrink_to_fit();
+		assert( chunks_live==0 );
+
+		f.push(1);
+		assert( f.front()==1 );
+	}
+	assert( chunks_live==0 );
 }
 
 struct A
@@ -159,11 +205,130 @@ void test_polymorphism()
 	assert( allocations==0 );
 }
 
-int main()
+struct E : public A
+{
+	E(int v) : m_value(v) { data[0] = data[sizeof(data)-1] = char(v); }
+
+	int value() const
+	{
+		return data[0]==data[sizeof(data)-1] ? m_value : -1;
+	}
+
+	const int m_value;
+	char data[600];
+};
+
+// Messages larger than the chunk size get a chunk of their own.
+void test_large_messages()
+{
+	active::fifo<A> f(std::allocator<A>(), 256);
+	for(int i=0; i<100; ++i)
+	{
+		if( i%2 ) f.push(E(i));
+		else f.push(B(i));
+	}
+
+	for(int i=0; i<100; ++i)
+	{
+		assert( f.front().value() == i );
+		f.pop();
+	}
+	assert( f.empty() );
+}
+
+#ifdef ACTIVE_USE_CXX11
+struct D : public A
+{
+	static int copies, moves;
+	D(int v) : m_value(v) { }
+	D(const D&d) : m_value(d.m_value) { ++copies; }
+	D(D&&d) : m_value(d.m_value) { ++moves; }
+
+	int value() const
+	{
+		return m_value;
+	}
+
+	const int m_value;
+};
+
+int D::copies=0, D::moves=0;
+
+void test_emplace()
+{
+	active::fifo<A> f;
+	for(int i=0; i<1000; ++i)
+		f.emplace<D>(i+1);
+	f.push(D(1001));
+	D d(1002);
+	f.push(d);
+
+	assert( f.size()==1002 );
+	assert( D::copies==1 );
+	assert( D::moves==1 );
+
+	for(int i=0; i<1002; ++i)
+	{
+		assert( f.front().value() == i+1 );
+		f.pop();
+	}
+	assert( f.empty() );
+}
+#endif
+
+template<int Size>
+struct message
+{
+	char data[Size];
+};
+
+// Pushes and pops messages through a queue which holds about depth messages.
+template<int Size>
+void bench_push_pop(int iterations, std::size_t chunk_size, int depth)
+{
+	typedef active::fifo<message<Size>, counting_allocator<message<Size> > > fifo_type;
+	fifo_type f(counting_allocator<message<Size> >(), chunk_size);
+	message<Size> m = { { 0 } };
+	chunks_allocated = 0;
+
+	std::clock_t start = std::clock();
+	for(int i=0; i<iterations; ++i)
+	{
+		f.push(m);
+		if( int(f.size())>depth ) f.pop();
+	}
+	double duration = double(std::clock()-start) / CLOCKS_PER_SEC;
+
+	std::cout << Size << "," << chunk_size << "," << depth << ","
+		<< iterations / (1000000.0 * duration) << "," << chunks_allocated << std::endl;
+}
+
+template<int Size>
+void bench_push_pop(int iterations)
+{
+	const std::size_t chunk_sizes[] = { 256, 1024, 4096 };
+	for(int c=0; c<3; ++c)
+	{
+		bench_push_pop<Size>(iterations, chunk_sizes[c], 1);
+		bench_push_pop<Size>(iterations, chunk_sizes[c], 16);
+	}
+}
+
+int main(int argc, char**argv)
 {
 	test1();
 	test2();
 	test3();
 	test_allocator();
 	test_polymorphism();
+	test_large_messages();
+#ifdef ACTIVE_USE_CXX11
+	test_emplace();
+#endif
+
+	int iterations = argc>1 ? atoi(argv[1]) : 1000000;
+	std::cout << "Message size,Chunk size,Depth,Million push/pop per second,Chunks allocated\n";
+	bench_push_pop<64>(iterations);
+	bench_push_pop<256>(iterations);
+	bench_push_pop<512>(iterations);
 }